@@ -13,9 +13,16 @@
  *
  * Usage:
  *   ./KernelSim_T2           (kernel)
+ *   ./KernelSim_T2 -L        (kernel, legacy full-struct SFP datagrams, no HELLO)
+ *   ./KernelSim_T2 -I        (kernel, replies complete syscalls on arrival, not on IRQ1/IRQ2)
  *   ./KernelSim_T2 inter     (interrupt controller)
  *   ./KernelSim_T2 app <id>  (application process, id = 1..5)
  *
+ * App -> kernel lines: "<SYSCALL> A<id> <pid> ..." blocks the app until the
+ * reply is in shmem; "ASYNC <t> <SYSCALL> ..." returns at once and the reply
+ * lands in ticket t of the app's shmem; "WAIT A<id> <pid> <t>" blocks only
+ * while ticket t is still outstanding.
+ *
  */
 
 #include <stdio.h>
@@ -36,21 +43,30 @@
 #include <fcntl.h>
 
 #include "sfp_protocol.h"
+#include "sfp_codec.h"
 
 /* ---------------- Configuration ---------------- */
 
 #define N_APPS       5
-#define MAX_BLOCKED  N_APPS
+#define MAX_BLOCKED  N_APPS     /* initial capacity of each completion queue */
 #define MAX_READY    N_APPS
 #define QUANTUM_US   500000     /* 0.5 s quantum for apps/interrupt pacing */
 #define MAX_PC       20         /* max instructions per app */
 #define SYSCALL_PROB 10         /* 1 in SYSCALL_PROB chance per tick */
+#define APP_TICKETS  4          /* async syscalls an app may have outstanding */
 
 #define IRQ1_PROB    3  /* 1/3 chance for IRQ1 generation */
 #define IRQ2_PROB    5  /* 1/5 chance for IRQ2 generation */
 
 #define SFSS_HOST "127.0.0.1"
 #define SFSS_PORT 8888
+#define SFSS_DEADLINE_MS 3000   /* server may shed requests older than this (0 = no deadline) */
+#define SFSS_HELLO_WAIT_MS 500  /* wait for the HELLO reply at startup */
+#define SFSS_HELLO_RETRY_MAX_MS 8000 /* unanswered HELLOs are resent with backoff up to this */
+#define SFSS_RTO_INIT_MS 1000   /* retransmission timeout before the first RTT sample */
+#define SFSS_RTO_MIN_MS  200
+#define SFSS_RTO_MAX_MS  8000
+#define SFSS_MAX_RETRIES 4      /* retransmits before the syscall fails with SFP_ERR_TIMEOUT */
 
 #define SHM_KEY_BASE 0x1316
 
@@ -63,19 +79,49 @@ typedef struct PCB {
     int   id;                  /* logical ID A1..AN (1..N_APPS) */
     int   state;               /* ProcState */
     int   pc;                  /* last program counter observed */
-    SfpMessage pending_syscall;/* saved syscall for snapshot */
+    SfpMsg pending_syscall;    /* saved syscall for snapshot */
+    int   held;                /* its request waits locally for a credit */
+    unsigned long long ticket_req[APP_TICKETS]; /* req_id outstanding on each async ticket (0 = none) */
+    int   wait_ticket;         /* BLOCKED in WAIT on this ticket (-1 = not waiting) */
 } PCB;
 
+/* An async syscall's slot: the app sets PENDING before ASYNC and FREE once it
+   has read the reply; the kernel sets DONE after writing the reply. 'state'
+   is stored with release and loaded with acquire, since app and kernel run
+   concurrently. */
+enum TicketState { TICKET_FREE = 0, TICKET_PENDING = 1, TICKET_DONE = 2 };
+
+typedef struct {
+    int     state;
+    SfpMsg  reply;
+    SfpBulk body;      /* WRITEBUF/APPEND data going out, RD/DL body coming back */
+} AppTicket;
+
+/* Per-app shared memory: last reply, plus its out-of-line body (DL listing or
+   RD data above SFP_PAYLOAD_SIZE). Before a WRITEBUF syscall the app stages
+   the data to be written in 'body'. Async syscalls use 'tickets' instead. */
+typedef struct {
+    SfpMsg  reply;
+    SfpBulk body;
+    AppTicket tickets[APP_TICKETS];
+} AppShm;
+
 /* Global PCBs and scheduler structures */
 static PCB pcbs[N_APPS];
 static int running_idx = -1;
 
-/* Queues to hold responses coming from SFSS (replies) */
-static SfpMessage file_req_q[MAX_BLOCKED];
-static int fq_h = 0, fq_t = 0, fq_sz = 0;
+/* Completion queue: replies from SFSS waiting for their IRQ. A ring that
+   doubles when full, so no reply is ever dropped. */
+typedef struct {
+    SfpMsg   *msgs;
+    SfpBulk **bodies;  /* heap data for large RD replies / DL listings, else NULL */
+    int h, t, sz, cap;
+    int high;          /* deepest the queue has been */
+    int grows;         /* times it had to double */
+} ReplyQ;
 
-static SfpMessage dir_req_q[MAX_BLOCKED];
-static int dq_h = 0, dq_t = 0, dq_sz = 0;
+static ReplyQ file_req_q;  /* IRQ1: file operations */
+static ReplyQ dir_req_q;   /* IRQ2: directory operations */
 
 /* Ready queue (round-robin) */
 static int rq[MAX_READY];
@@ -88,8 +134,102 @@ static pid_t inter_pid = -1;
 /* Network and shared memory */
 static int udp_sockfd = -1;
 static struct sockaddr_in sfss_addr;
+static SfpWireMode wire_mode = SFP_WIRE_COMPACT; /* -L selects the legacy layout */
+static int immediate_completion = 0;             /* -I: unblock on reply arrival instead of IRQ1/IRQ2 */
+static unsigned long completions_irq = 0, completions_immediate = 0;
+static int sfp_max_payload = SFP_MAX_PAYLOAD;    /* negotiated with HELLO */
+static int sfp_max_batch = SFP_MAX_BATCH;
+static int sfp_features = 0;                     /* SFP_FEAT_* both sides support */
+/* HELLO still unanswered, legacy layout meanwhile: SFSS not heard from yet,
+   or it answers other requests and one last HELLO is due / out */
+enum { HELLO_DONE, HELLO_WAIT_SERVER, HELLO_LAST_DUE, HELLO_LAST_OUT };
+static int hello_pending = HELLO_DONE;
+static long long hello_due_us = 0, hello_gap_us = 0; /* next HELLO resend / backoff */
+static unsigned long hello_sent = 0;
+static unsigned long sfp_datagrams = 0, sfp_batched = 0; /* requests sent / sent inside BT-REQs */
+static unsigned long long next_req_id = 1; /* SFP req_id of the next syscall (echoed in its reply) */
+static unsigned long sfp_stale = 0;        /* replies that matched no waiting syscall */
+static unsigned long sfp_views = 0;        /* replies read in place (no SfpMsg decode) */
+static unsigned long body_allocs = 0, body_alloc_bytes = 0; /* reply bodies kept on the heap */
+static unsigned long sfp_notifies = 0, sfp_notified_changes = 0; /* NT-MSGs pushed by SFSS / changes in them */
+
+/* Credit-based flow control: SFSS advertises in each reply how many requests
+   we may keep in flight. Beyond that, syscalls wait here (apps stay BLOCKED)
+   instead of overflowing the server's socket buffer. */
+static int sfp_credits = 0;                /* last advertised window (0 = no limit) */
+static int sfp_inflight = 0;               /* syscalls sent and not yet answered (inflight_tab) */
+
+/* a syscall waiting for a credit (an app holds at most one blocking syscall
+   plus one per async ticket) */
+typedef struct {
+    int idx;
+    int ticket;                            /* -1 = blocking syscall */
+    SfpMsg req;
+} HeldReq;
+#define HELD_MAX (N_APPS * (1 + APP_TICKETS))
+
+static HeldReq held_q[HELD_MAX];           /* FIFO */
+static int hq_h = 0, hq_t = 0, hq_sz = 0;
+static unsigned long sfp_held = 0;         /* syscalls that had to wait for a credit */
+
+/* In-flight table: one slot per request on the wire, keyed by its req_id
+   (open addressing with linear probing; ids are sequential, so req_id & mask
+   rarely collides). A reply finds its request in O(1); a reply whose id is
+   not here is late or a duplicate and is dropped. The table size also caps
+   how many requests are outstanding, on top of the SFSS credits. */
+#define INFLIGHT_SLOTS 256   /* power of two */
+
+typedef struct {
+    unsigned long long req_id; /* 0 = free slot */
+    int idx;                   /* PCB index of the owner */
+    int owner;                 /* hdr.owner of the request (A1=1, ...) */
+    int ticket;                /* async ticket it answers (-1 = blocking syscall) */
+    SfpMsgType op;             /* request type */
+    long long submit_us;       /* when it was handed to the network (mono_us) */
+    SfpMsg req;                /* the request as sent, for retransmission */
+    int tries;                 /* retransmits so far */
+    long long rto_us;          /* current timeout (doubles on every retransmit) */
+    long long due_us;          /* retransmit when no reply by then (mono_us) */
+    /* each transmission: its sent_us stamp (echoed by SFSS) and when it left (mono_us) */
+    long long tx_stamp_us[SFSS_MAX_RETRIES + 1];
+    long long tx_mono_us[SFSS_MAX_RETRIES + 1];
+    unsigned long bc_epoch;    /* block cache epoch when it went out */
+} InFlight;
+
+static InFlight inflight_tab[INFLIGHT_SLOTS];
+static long long rtt_sum_us = 0, rtt_max_us = 0;  /* submit -> reply, per matched reply */
+static unsigned long rtt_samples = 0;
+
+/* RTT estimate (Jacobson/Karels, as in TCP): smoothed RTT and its mean
+   deviation give the retransmission timeout rto = srtt + 4 * rttvar */
+static long long srtt_us = 0, rttvar_us = 0;
+static long long rto_us = SFSS_RTO_INIT_MS * 1000LL;
+static unsigned long sfp_retransmits = 0, sfp_timeouts = 0;
+
+static unsigned long async_submitted = 0, async_completed = 0;
+static unsigned long waits_blocked = 0, waits_ready = 0;   /* WAITs that had to block / found the reply */
+static int async_most = 0;                 /* most async syscalls one app had outstanding */
+
+/* Block cache: RD replies of default 16-byte blocks, keyed by (path, offset),
+   set-associative with LRU inside each set */
+#define BC_SETS 16           /* power of two */
+#define BC_WAYS 4
+
+typedef struct {
+    int used;
+    int offset;
+    unsigned long long last_use;
+    SfpMsg reply;            /* the RD-REP, with the request's path */
+} BcEntry;
+
+static BcEntry bc_tab[BC_SETS][BC_WAYS];
+static int bc_watched[N_APPS + 1];         /* /A<n> is under a WATCH (NT-MSGs report outside changes) */
+static unsigned long bc_epoch = 0;         /* bumped by every invalidation */
+static unsigned long long bc_clock = 0;
+static unsigned long bc_hits = 0, bc_misses = 0, bc_uncacheable = 0;
+static unsigned long bc_fills = 0, bc_evictions = 0, bc_invalidated = 0;
 static int shm_ids[N_APPS];
-static SfpMessage* shm_ptrs[N_APPS];
+static AppShm* shm_ptrs[N_APPS];
 
 /* Flags for signals */
 static volatile sig_atomic_t inter_pending = 0;
@@ -108,6 +248,15 @@ static void die(const char *msg) {
     exit(EXIT_FAILURE);
 }
 
+/* clock of the kernel's own timers (RTO, HELLO backoff, RTT), in us: a
+   wall-clock step must not fire or stall them. sfp_now_us (wall clock) is
+   only for the sent_us/deadline_us stamps SFSS compares with its clock. */
+static long long mono_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
 /* write a newline-terminated literal to fd */
 static ssize_t writeln(int fd, const char *s) {
     return write(fd, s, strlen(s));
@@ -120,6 +269,40 @@ static const char* state_str(int s) {
            s == TERMINATED ? "TERMINATED" : "?";
 }
 
+/* copy a NUL-terminated string into a fixed-size SFP field; returns its
+   length, or -1 (field left empty) when it does not fit: a truncated path
+   would name another file */
+static int copy_field(char *dst, size_t cap, const char *src) {
+    size_t n = strnlen(src, cap);
+    if (n == cap) {
+        dst[0] = '\0';
+        return -1;
+    }
+    memcpy(dst, src, n);
+    dst[n] = '\0';
+    return (int)n;
+}
+
+/* every path/name field of request 'm' was filled by copy_field without overflow */
+static int fields_fit(const SfpMsg *m) {
+    switch (m->hdr.msg_type) {
+        case SFP_MSG_RD_REQ:
+        case SFP_MSG_TR_REQ: return m->rd_req.path_len >= 0;
+        case SFP_MSG_WR_REQ:
+        case SFP_MSG_AP_REQ: return m->wr_req.path_len >= 0;
+        case SFP_MSG_DC_REQ:
+        case SFP_MSG_DR_REQ: return m->dc_req.path_len >= 0 && m->dc_req.name_len >= 0;
+        case SFP_MSG_DL_REQ: return m->dl_req.path_len >= 0 && m->dl_req.cursor_len >= 0;
+        case SFP_MSG_CP_REQ:
+        case SFP_MSG_RN_REQ: return m->cp_req.path_len >= 0 && m->cp_req.dst_len >= 0;
+        case SFP_MSG_GA_REQ:
+        case SFP_MSG_OP_REQ:
+        case SFP_MSG_WA_REQ:
+        case SFP_MSG_UW_REQ: return m->ga_req.path_len >= 0;
+        default: return 1;
+    }
+}
+
 /* convert OS pid -> index in pcbs[] or -1 */
 static int pid_to_index(pid_t pid) {
     for (int i = 0; i < N_APPS; ++i)
@@ -127,6 +310,19 @@ static int pid_to_index(pid_t pid) {
     return -1;
 }
 
+/* async ticket of app 'idx' waiting for 'req_id' (-1 = a blocking syscall) */
+static int ticket_of(int idx, unsigned long long req_id) {
+    if (idx < 0 || idx >= N_APPS || req_id == 0) return -1;
+    for (int t = 0; t < APP_TICKETS; ++t)
+        if (pcbs[idx].ticket_req[t] == req_id) return t;
+    return -1;
+}
+
+/* where the bulk data of a syscall of app 'idx' lives in its shmem */
+static SfpBulk* app_body(int idx, int ticket) {
+    return ticket >= 0 ? &shm_ptrs[idx]->tickets[ticket].body : &shm_ptrs[idx]->body;
+}
+
 /* ---------------- Ready queue ops ---------------- */
 
 static void rq_push_tail(int idx) {
@@ -145,10 +341,315 @@ static int rq_pop_head(void) {
     return v;
 }
 
+/* ---------------- Completion queue ops ---------------- */
+
+/* double the ring (MAX_BLOCKED the first time), unrolling it to start at 0 */
+static int replyq_grow(ReplyQ *q) {
+    int cap = q->cap > 0 ? q->cap * 2 : MAX_BLOCKED;
+    SfpMsg *msgs = malloc(sizeof(SfpMsg) * (size_t)cap);
+    SfpBulk **bodies = malloc(sizeof(SfpBulk*) * (size_t)cap);
+    if (msgs == NULL || bodies == NULL) {
+        free(msgs);
+        free(bodies);
+        return -1;
+    }
+    for (int k = 0; k < q->sz; ++k) {
+        msgs[k] = q->msgs[(q->h + k) % q->cap];
+        bodies[k] = q->bodies[(q->h + k) % q->cap];
+    }
+    if (q->cap > 0) q->grows++;
+    free(q->msgs);
+    free(q->bodies);
+    q->msgs = msgs;
+    q->bodies = bodies;
+    q->h = 0;
+    q->t = q->sz;
+    q->cap = cap;
+    return 0;
+}
+
+/* append a reply; -1 only if the ring cannot grow (out of memory) */
+static int replyq_push(ReplyQ *q, const SfpMsg *m, SfpBulk *body) {
+    if (q->sz == q->cap && replyq_grow(q) != 0) return -1;
+    q->msgs[q->t] = *m;
+    q->bodies[q->t] = body;
+    q->t = (q->t + 1) % q->cap;
+    q->sz++;
+    if (q->sz > q->high) q->high = q->sz;
+    return 0;
+}
+
+/* take the oldest reply; 0 if the queue is empty */
+static int replyq_pop(ReplyQ *q, SfpMsg *m, SfpBulk **body) {
+    if (q->sz == 0) return 0;
+    *m = q->msgs[q->h];
+    *body = q->bodies[q->h];
+    q->h = (q->h + 1) % q->cap;
+    q->sz--;
+    return 1;
+}
+
+static void replyq_free(ReplyQ *q) {
+    SfpMsg m;
+    SfpBulk *body;
+    while (replyq_pop(q, &m, &body)) free(body);
+    free(q->msgs);
+    free(q->bodies);
+    memset(q, 0, sizeof(*q));
+}
+
+/* ---------------- In-flight table ops ---------------- */
+
+static InFlight* inflight_find(unsigned long long req_id) {
+    unsigned mask = INFLIGHT_SLOTS - 1;
+    for (unsigned i = (unsigned)req_id & mask, n = 0; n < INFLIGHT_SLOTS; i = (i + 1) & mask, ++n) {
+        if (inflight_tab[i].req_id == req_id) return &inflight_tab[i];
+        if (inflight_tab[i].req_id == 0) return NULL;
+    }
+    return NULL;
+}
+
+/* legacy replies carry no req_id: the owner's oldest request of the type
+   'rep_type' answers stands in (a late reply to a request that already timed
+   out must not complete the owner's next syscall of another type) */
+static InFlight* inflight_find_owner(int owner, SfpMsgType rep_type) {
+    InFlight *best = NULL;
+    for (int i = 0; i < INFLIGHT_SLOTS; ++i) {
+        InFlight *e = &inflight_tab[i];
+        if (e->req_id != 0 && e->owner == owner && e->op + 1 == rep_type &&
+            (best == NULL || e->req_id < best->req_id)) best = e;
+    }
+    return best;
+}
+
+/* record request 'req' of app 'idx' as sent; -1 if the table is full */
+static int inflight_add(int idx, const SfpMsg *req) {
+    if (sfp_inflight >= INFLIGHT_SLOTS || req->hdr.req_id == 0) return -1;
+    unsigned mask = INFLIGHT_SLOTS - 1;
+    unsigned i = (unsigned)req->hdr.req_id & mask;
+    while (inflight_tab[i].req_id != 0) i = (i + 1) & mask;
+    inflight_tab[i].req_id = req->hdr.req_id;
+    inflight_tab[i].idx = idx;
+    inflight_tab[i].owner = req->hdr.owner;
+    inflight_tab[i].ticket = ticket_of(idx, req->hdr.req_id);
+    inflight_tab[i].op = req->hdr.msg_type;
+    inflight_tab[i].submit_us = mono_us();
+    inflight_tab[i].req = *req;
+    inflight_tab[i].tries = 0;
+    inflight_tab[i].tx_stamp_us[0] = req->hdr.sent_us;
+    inflight_tab[i].tx_mono_us[0] = inflight_tab[i].submit_us;
+    inflight_tab[i].rto_us = rto_us;
+    inflight_tab[i].due_us = inflight_tab[i].submit_us + rto_us;
+    inflight_tab[i].bc_epoch = bc_epoch;
+    sfp_inflight++;
+    return 0;
+}
+
+/* free a slot, shifting later entries of the same probe run back so lookups
+   never stop early at the hole */
+static void inflight_remove(InFlight *e) {
+    unsigned mask = INFLIGHT_SLOTS - 1;
+    unsigned i = (unsigned)(e - inflight_tab), j = i;
+    for (;;) {
+        j = (j + 1) & mask;
+        if (inflight_tab[j].req_id == 0) break;
+        unsigned home = (unsigned)inflight_tab[j].req_id & mask;
+        /* move it into the hole unless its home lies cyclically in (i, j] */
+        int stays = i <= j ? (home > i && home <= j) : (home > i || home <= j);
+        if (!stays) {
+            inflight_tab[i] = inflight_tab[j];
+            i = j;
+        }
+    }
+    inflight_tab[i].req_id = 0;
+    sfp_inflight--;
+}
+
+/* ---------------- Block cache ops ---------------- */
+
+/* 'path' in the form the server resolves it to (as validate_path does:
+   repeated '/' and "." components dropped) into 'out'; 0 when the server
+   would not take it anyway (no leading "/A<n>", "..", too long) */
+static int bc_norm(const char *path, char *out) {
+    const char *p = path;
+    while (*p == '/') p++;
+    if (p[0] != 'A' || p[1] < '1' || p[1] > '9') return 0;  /* /A0 and /A01 are not cached */
+    size_t len = 0;
+    while (*p != '\0') {
+        size_t n = strcspn(p, "/");
+        if (n == 2 && p[0] == '.' && p[1] == '.') return 0;
+        if (n > 0 && !(n == 1 && p[0] == '.')) {
+            if (len + 1 + n >= SFP_PATH_CAP) return 0;
+            out[len++] = '/';
+            memcpy(out + len, p, n);
+            len += n;
+        }
+        p += n;
+        while (*p == '/') p++;
+    }
+    out[len] = '\0';
+    return 1;
+}
+
+/* area n of a normalized file path directly inside /A<n> (-1 otherwise): a
+   WATCH on /A<n> reports changes to its direct entries only */
+static int area_of_file(const char *path) {
+    int area = -1, end = 0;
+    if (sscanf(path, "/A%d/%n", &area, &end) != 1 || end == 0) return -1;
+    return path[end] != '\0' && strchr(path + end, '/') == NULL ? area : -1;
+}
+
+/* RD of a default block, by path, in the requesting app's own watched area,
+   with the normalized path (the cache key) into 'key'. The shared /A0 is never
+   cached: other SFSS clients write there without telling us. Another app's
+   area is not either: the server answers that with SFP_ERR_PERMISSION. */
+static int bc_cacheable(const SfpMsg *req, char *key) {
+    if (req->rd_req.handle != 0 || req->rd_req.length != 0) return 0;
+    if (!bc_norm(req->rd_req.path, key)) return 0;
+    int area = area_of_file(key);
+    return area >= 1 && area <= N_APPS && area == req->hdr.owner && bc_watched[area];
+}
+
+static unsigned bc_set(const char *path, int offset) {
+    unsigned h = 2166136261u; /* FNV-1a */
+    for (const char *c = path; *c != '\0'; ++c) h = (h ^ (unsigned char)*c) * 16777619u;
+    h = (h ^ (unsigned)offset) * 16777619u;
+    return h & (BC_SETS - 1);
+}
+
+static BcEntry* bc_find(const char *path, int offset) {
+    BcEntry *set = bc_tab[bc_set(path, offset)];
+    for (int w = 0; w < BC_WAYS; ++w)
+        if (set[w].used && set[w].offset == offset && strcmp(set[w].reply.rd_rep.path, path) == 0) return &set[w];
+    return NULL;
+}
+
+/* a cached reply for RD request 'req' into 'rep' (1 = hit) */
+static int bc_lookup(const SfpMsg *req, SfpMsg *rep) {
+    if (req->hdr.msg_type != SFP_MSG_RD_REQ) return 0;
+    char key[SFP_PATH_CAP];
+    if (!bc_cacheable(req, key)) {
+        bc_uncacheable++;
+        return 0;
+    }
+    BcEntry *b = bc_find(key, req->rd_req.offset);
+    if (b == NULL) {
+        bc_misses++;
+        return 0;
+    }
+    bc_hits++;
+    b->last_use = ++bc_clock;
+    *rep = b->reply;
+    rep->hdr.owner = req->hdr.owner;
+    rep->hdr.req_id = req->hdr.req_id;
+    rep->rd_rep.path_len = req->rd_req.path_len;   /* the server echoes the path as asked */
+    memcpy(rep->rd_rep.path, req->rd_req.path, SFP_PATH_CAP);
+    fprintf(stderr, "[Kernel] Block cache hit: A%d READ %s @ %d (req %llu)\n",
+            req->hdr.owner, req->rd_req.path, req->rd_req.offset, req->hdr.req_id);
+    return 1;
+}
+
+/* keep the successful RD-REP 'rep' to 'req', unless something was invalidated
+   after 'req' went out at 'epoch' (the server may have read before that write) */
+static void bc_fill(const SfpMsg *req, const SfpMsg *rep, unsigned long epoch) {
+    char key[SFP_PATH_CAP];
+    if (!bc_cacheable(req, key) || epoch != bc_epoch || rep->rd_rep.offset < 0 || rep->rd_rep.length > SFP_PAYLOAD_SIZE)
+        return;
+    BcEntry *b = bc_find(key, req->rd_req.offset);
+    if (b == NULL) {
+        BcEntry *set = bc_tab[bc_set(key, req->rd_req.offset)];
+        b = &set[0];
+        for (int w = 0; w < BC_WAYS && b->used; ++w)
+            if (!set[w].used || set[w].last_use < b->last_use) b = &set[w];
+        if (b->used) bc_evictions++;
+    }
+    b->used = 1;
+    b->offset = req->rd_req.offset;
+    b->last_use = ++bc_clock;
+    b->reply = *rep;
+    memset(&b->reply.hdr, 0, sizeof(SfpHdr));
+    b->reply.hdr.msg_type = SFP_MSG_RD_REP;
+    b->reply.rd_rep.path_len = copy_field(b->reply.rd_rep.path, SFP_PATH_CAP, key);
+    bc_fills++;
+}
+
+/* drop the cached blocks of 'path' and of everything below it ("" = all).
+   A path that does not normalize has nothing cached under it. */
+static void bc_invalidate(const char *path) {
+    char key[SFP_PATH_CAP] = "";
+    bc_epoch++;
+    if (path[0] != '\0' && !bc_norm(path, key)) return;
+    size_t n = strlen(key);
+    for (int s = 0; s < BC_SETS; ++s)
+        for (int w = 0; w < BC_WAYS; ++w) {
+            BcEntry *b = &bc_tab[s][w];
+            const char *p = b->reply.rd_rep.path;
+            if (b->used && strncmp(p, key, n) == 0 && (p[n] == '\0' || p[n] == '/')) {
+                b->used = 0;
+                bc_invalidated++;
+            }
+        }
+}
+
+static void bc_invalidate_in(const char *dir, const char *name) {
+    char full[SFP_PATH_CAP + SFP_NAME_CAP + 1];
+    snprintf(full, sizeof(full), "%s/%s", dir, name);
+    bc_invalidate(full);
+}
+
+/* a request that changes files: drop what it may change before it goes out,
+   so no later READ is answered with the old data */
+static void bc_note_request(const SfpMsg *m) {
+    switch (m->hdr.msg_type) {
+        case SFP_MSG_WR_REQ:
+            /* by handle we do not know the path: "" matches every path */
+            bc_invalidate(m->wr_req.handle != 0 ? "" : m->wr_req.path);
+            break;
+        case SFP_MSG_AP_REQ: bc_invalidate(m->ap_req.path); break;
+        case SFP_MSG_TR_REQ: bc_invalidate(m->tr_req.path); break;
+        case SFP_MSG_CP_REQ: bc_invalidate(m->cp_req.dst); break;
+        case SFP_MSG_RN_REQ:
+            bc_invalidate(m->rn_req.path);
+            bc_invalidate(m->rn_req.dst);
+            break;
+        case SFP_MSG_DR_REQ: bc_invalidate_in(m->dr_req.path, m->dr_req.name); break;
+        default: break;
+    }
+}
+
+/* a WATCH on /A<n> (or its UNWATCH) makes that area's files cacheable (or not) */
+static void bc_note_watch(const char *path, int on) {
+    char key[SFP_PATH_CAP];
+    int area = -1, end = 0;
+    if (!bc_norm(path, key)) return;
+    if (sscanf(key, "/A%d%n", &area, &end) != 1 || key[end] != '\0' || area < 1 || area > N_APPS) return;
+    bc_watched[area] = on;
+    if (!on) bc_invalidate(path);
+}
+
 /* ---------------- Scheduler ---------------- */
 
 /* Choose next READY process and CONT it; stop current running process */
 /* Escalonador principal (seleciona próximo processo READY) */
+/* The running app writes a syscall line and then stops itself with
+   raise(SIGSTOP). A SIGCONT that gets there before that stop is lost and the
+   app stays stopped for good, so resuming it at once must wait for the stop
+   first. While it is RUNNING we sent it no SIGSTOP, so the stop reported is
+   its own. Returns 0 if the app exited instead. */
+static int await_app_stop(int idx) {
+    int st;
+    for (;;) {
+        pid_t r = waitpid(pcbs[idx].pid, &st, WUNTRACED);
+        if (r < 0 && errno == EINTR) continue;
+        if (r == pcbs[idx].pid && WIFSTOPPED(st)) return 1;
+        if (r == pcbs[idx].pid) {
+            pcbs[idx].state = TERMINATED;
+            fprintf(stderr, "[Kernel] (reap) A%d (PID %d) TERMINATED\n", idx + 1, (int)r);
+        }
+        return 0;
+    }
+}
+
 static void schedule_next(void){
     // Tenta encontrar um processo pronto
     int tries = rq_sz;
@@ -236,9 +737,14 @@ static void print_snapshot(void) {
     for (int i = 0; i < N_APPS; ++i) {
         PCB *p = &pcbs[i];
         fprintf(stderr, "A%d (PID %d): PC=%d, state=%s", p->id, (int)p->pid, p->pc, state_str(p->state));
-        if (p->state == BLOCKED) {
-            fprintf(stderr, ", waiting SFP_MSG %d", p->pending_syscall.msg_type);
+        if (p->state == BLOCKED && p->wait_ticket >= 0) {
+            fprintf(stderr, ", waiting ticket %d (req %llu)", p->wait_ticket, p->ticket_req[p->wait_ticket]);
+        } else if (p->state == BLOCKED) {
+            fprintf(stderr, ", waiting SFP_MSG %d (req %llu%s)", p->pending_syscall.hdr.msg_type,
+                    p->pending_syscall.hdr.req_id, p->held ? ", held for credit" : "");
         }
+        for (int t = 0; t < APP_TICKETS; ++t)
+            if (p->ticket_req[t] != 0) fprintf(stderr, ", ticket %d: req %llu", t, p->ticket_req[t]);
         if (p->state == TERMINATED) fprintf(stderr, " (TERMINATED)");
         fprintf(stderr, "\n");
     }
@@ -251,7 +757,51 @@ static void print_snapshot(void) {
     }
     if (running_idx >= 0) fprintf(stderr, "RUNNING: A%d\n", running_idx + 1);
     else fprintf(stderr, "RUNNING: (none)\n");
-    fprintf(stderr, "File-Q: %d waiting / Dir-Q: %d waiting\n", fq_sz, dq_sz);
+    fprintf(stderr, "File-Q: %d waiting (high %d, capacity %d, grew %d times) / "
+            "Dir-Q: %d waiting (high %d, capacity %d, grew %d times)\n",
+            file_req_q.sz, file_req_q.high, file_req_q.cap, file_req_q.grows,
+            dir_req_q.sz, dir_req_q.high, dir_req_q.cap, dir_req_q.grows);
+    fprintf(stderr, "Completion: %s (%lu by IRQ1/IRQ2, %lu on arrival)\n",
+            immediate_completion ? "immediate" : "IRQ1/IRQ2", completions_irq, completions_immediate);
+    fprintf(stderr, "Async: %lu submitted, %lu completed, most outstanding per app %d; "
+            "WAIT blocked %lu times, found the reply ready %lu times\n",
+            async_submitted, async_completed, async_most, waits_blocked, waits_ready);
+    fprintf(stderr, "SFP: %s wire%s, payload <= %d, batch <= %d, %lu HELLOs sent\n",
+            wire_mode == SFP_WIRE_COMPACT ? "compact" : "legacy",
+            hello_pending != HELLO_DONE ? " (HELLO unanswered, retrying)" : "", sfp_max_payload, sfp_max_batch, hello_sent);
+    fprintf(stderr, "SFP: %lu datagrams sent, %lu syscalls sent in batches, %lu stale replies\n",
+            sfp_datagrams, sfp_batched, sfp_stale);
+    SfpCodecCounters cc;
+    sfp_codec_counters(&cc);
+    fprintf(stderr, "SFP: %lu replies read in place, %llu codec copies (%llu bytes), %llu scatter sends, "
+            "%lu body allocs (%lu bytes)\n", sfp_views, cc.copies, cc.bytes_copied, cc.scatter_sends,
+            body_allocs, body_alloc_bytes);
+    fprintf(stderr, "SFP: %lu notifies received (%lu changes coalesced)\n", sfp_notifies, sfp_notified_changes);
+    int bc_used = 0;
+    for (int s = 0; s < BC_SETS; ++s)
+        for (int w = 0; w < BC_WAYS; ++w) bc_used += bc_tab[s][w].used;
+    unsigned long bc_lookups = bc_hits + bc_misses;
+    fprintf(stderr, "Block cache: %d/%d blocks, %lu hits / %lu lookups (%.1f%%), %lu READs not cacheable "
+            "(/A0, unwatched area, handle or length); %lu filled, %lu evicted, %lu invalidated\n",
+            bc_used, BC_SETS * BC_WAYS, bc_hits, bc_lookups,
+            bc_lookups ? 100.0 * (double)bc_hits / (double)bc_lookups : 0.0, bc_uncacheable,
+            bc_fills, bc_evictions, bc_invalidated);
+    if (sfp_credits > 0)
+        fprintf(stderr, "SFP: %d/%d credits in use, %d held now, %lu held so far\n",
+                sfp_inflight, sfp_credits, hq_sz, sfp_held);
+    else
+        fprintf(stderr, "SFP: %d in flight (no credit limit)\n", sfp_inflight);
+    long long now = mono_us();
+    for (int i = 0; i < INFLIGHT_SLOTS; ++i) {
+        const InFlight *e = &inflight_tab[i];
+        if (e->req_id != 0)
+            fprintf(stderr, "  in flight: req %llu A%d SFP_MSG %d, %lld ms\n", e->req_id, e->owner, e->op,
+                    (now - e->submit_us) / 1000);
+    }
+    fprintf(stderr, "SFP: reply time avg %lld us, max %lld us (%lu replies)\n",
+            rtt_samples ? rtt_sum_us / (long long)rtt_samples : 0, rtt_max_us, rtt_samples);
+    fprintf(stderr, "SFP: RTT srtt %lld us, rttvar %lld us, RTO %lld ms; %lu retransmits, %lu timeouts\n",
+            srtt_us, rttvar_us, rto_us / 1000, sfp_retransmits, sfp_timeouts);
     fprintf(stderr, "=============================================================\n");
 }
 
@@ -319,6 +869,130 @@ static void acc_consume_line(char acc[], int *acc_len, int linelen) {
 
 /* ---------------- Application process ---------------- */
 
+/* send one syscall line to the kernel and sleep until it is answered */
+static void app_syscall(int id, const char *msg) {
+    write(STDOUT_FILENO, msg, strlen(msg));
+    kill(getppid(), SIGUSR2);
+
+    /* stop and wait for kernel to unblock via SIGCONT */
+    raise(SIGSTOP);
+    fprintf(stderr, "[App A%d] Woke up — checking shmem reply\n", id);
+}
+
+/* start a syscall without waiting: it returns at once and the reply lands in
+   ticket 't' (which must be FREE) */
+static void app_submit(AppShm *shm_ptr, int t, const char *msg) {
+    char line[1100];
+    __atomic_store_n(&shm_ptr->tickets[t].state, TICKET_PENDING, __ATOMIC_RELEASE);
+    int n = snprintf(line, sizeof(line), "ASYNC %d %s", t, msg);
+    write(STDOUT_FILENO, line, (size_t)n);
+    kill(getppid(), SIGUSR2);
+}
+
+/* POLL: is the reply of ticket 't' there? (shmem only, no syscall) */
+static int app_poll(AppShm *shm_ptr, int t) {
+    return __atomic_load_n(&shm_ptr->tickets[t].state, __ATOMIC_ACQUIRE) == TICKET_DONE;
+}
+
+/* WAIT: sleep only if the reply of ticket 't' is not there yet */
+static void app_wait(int id, AppShm *shm_ptr, int t) {
+    char line[128];
+    while (!app_poll(shm_ptr, t)) {
+        int n = snprintf(line, sizeof(line), "WAIT A%d %d %d\n", id, (int)getpid(), t);
+        write(STDOUT_FILENO, line, (size_t)n);
+        kill(getppid(), SIGUSR2);
+        raise(SIGSTOP);
+    }
+}
+
+/* print a reply: the last one in shmem (app_report) or one from a ticket */
+static void app_report_msg(int id, const SfpMsg *r, const SfpBulk *body) {
+    switch (r->hdr.msg_type) {
+        case SFP_MSG_RD_REP:
+            if (r->rd_rep.offset >= 0 && r->rd_rep.length > SFP_PAYLOAD_SIZE) {
+                /* bulk read: show the size and the first bytes */
+                fprintf(stderr, "[App A%d] READ OK @ offset=%d length=%d data='", id,
+                        r->rd_rep.offset, r->rd_rep.length);
+                fwrite(sfp_rw_data(&r->rd_rep, body), 1, 24, stderr);
+                fprintf(stderr, "...'\n");
+            } else if (r->rd_rep.offset >= 0) {
+                /* payload may not be null-terminated; print as binary-safe */
+                int len = sfp_rw_len(r->rd_rep.length);
+                fprintf(stderr, "[App A%d] READ OK @ offset=%d payload='", id, r->rd_rep.offset);
+                fwrite(r->rd_rep.payload, 1, len, stderr);
+                fprintf(stderr, "'\n");
+            } else {
+                fprintf(stderr, "[App A%d] READ ERROR code=%d\n", id, r->rd_rep.offset);
+            }
+            break;
+        case SFP_MSG_WR_REP:
+            if (r->wr_rep.offset >= 0) fprintf(stderr, "[App A%d] WRITE OK @ offset=%d length=%d\n", id,
+                                               r->wr_rep.offset, sfp_rw_len(r->wr_rep.length));
+            else fprintf(stderr, "[App A%d] WRITE ERROR code=%d\n", id, r->wr_rep.offset);
+            break;
+        case SFP_MSG_DC_REP:
+            if (r->dc_rep.path_len >= 0) fprintf(stderr, "[App A%d] DIR CREATE OK -> %s\n", id, r->dc_rep.path);
+            else fprintf(stderr, "[App A%d] DIR CREATE ERROR code=%d\n", id, r->dc_rep.path_len);
+            break;
+        case SFP_MSG_DR_REP:
+            if (r->dr_rep.path_len >= 0) fprintf(stderr, "[App A%d] DIR REMOVE OK -> %s\n", id, r->dr_rep.path);
+            else fprintf(stderr, "[App A%d] DIR REMOVE ERROR code=%d\n", id, r->dr_rep.path_len);
+            break;
+        case SFP_MSG_DL_REP:
+            if (r->dl_rep.nrnames >= 0 && r->dl_rep.cursor[0] != '\0')
+                fprintf(stderr, "[App A%d] LISTDIR OK -> %d entries, more after '%s'\n", id, r->dl_rep.nrnames,
+                        r->dl_rep.cursor);
+            else if (r->dl_rep.nrnames >= 0) fprintf(stderr, "[App A%d] LISTDIR OK -> %d entries\n", id, r->dl_rep.nrnames);
+            else fprintf(stderr, "[App A%d] LISTDIR ERROR code=%d\n", id, r->dl_rep.nrnames);
+            break;
+        case SFP_MSG_GA_REP:
+            if (r->ga_rep.status >= 0) fprintf(stderr, "[App A%d] STAT OK -> %lld bytes, version %llu\n", id,
+                                               r->ga_rep.size, r->ga_rep.version);
+            else fprintf(stderr, "[App A%d] STAT ERROR code=%d\n", id, r->ga_rep.status);
+            break;
+        case SFP_MSG_OP_REP:
+            if (r->op_rep.handle > 0) fprintf(stderr, "[App A%d] OPEN OK -> handle %d\n", id, r->op_rep.handle);
+            else fprintf(stderr, "[App A%d] OPEN ERROR code=%d\n", id, r->op_rep.handle);
+            break;
+        case SFP_MSG_CL_REP:
+            if (r->cl_rep.handle >= 0) fprintf(stderr, "[App A%d] CLOSE OK\n", id);
+            else fprintf(stderr, "[App A%d] CLOSE ERROR code=%d\n", id, r->cl_rep.handle);
+            break;
+        case SFP_MSG_AP_REP:
+            if (r->ap_rep.offset >= 0) fprintf(stderr, "[App A%d] APPEND OK @ offset=%d length=%d\n", id,
+                                               r->ap_rep.offset, sfp_rw_len(r->ap_rep.length));
+            else fprintf(stderr, "[App A%d] APPEND ERROR code=%d\n", id, r->ap_rep.offset);
+            break;
+        case SFP_MSG_TR_REP:
+            if (r->tr_rep.offset >= 0) fprintf(stderr, "[App A%d] TRUNC OK -> %d bytes\n", id, r->tr_rep.offset);
+            else fprintf(stderr, "[App A%d] TRUNC ERROR code=%d\n", id, r->tr_rep.offset);
+            break;
+        case SFP_MSG_CP_REP:
+            if (r->cp_rep.offset >= 0) fprintf(stderr, "[App A%d] COPY OK -> %s (%d bytes)\n", id,
+                                               r->cp_rep.path, r->cp_rep.length);
+            else fprintf(stderr, "[App A%d] COPY ERROR code=%d\n", id, r->cp_rep.offset);
+            break;
+        case SFP_MSG_RN_REP:
+            if (r->rn_rep.offset >= 0) fprintf(stderr, "[App A%d] RENAME OK -> %s\n", id, r->rn_rep.path);
+            else fprintf(stderr, "[App A%d] RENAME ERROR code=%d\n", id, r->rn_rep.offset);
+            break;
+        case SFP_MSG_WA_REP:
+            if (r->wa_rep.path_len >= 0) fprintf(stderr, "[App A%d] WATCH OK -> %s\n", id, r->wa_rep.path);
+            else fprintf(stderr, "[App A%d] WATCH ERROR code=%d\n", id, r->wa_rep.path_len);
+            break;
+        case SFP_MSG_UW_REP:
+            if (r->uw_rep.path_len >= 0) fprintf(stderr, "[App A%d] UNWATCH OK -> %s\n", id, r->uw_rep.path);
+            else fprintf(stderr, "[App A%d] UNWATCH ERROR code=%d\n", id, r->uw_rep.path_len);
+            break;
+        default:
+            fprintf(stderr, "[App A%d] Unexpected SFP msg in shmem: %d\n", id, r->hdr.msg_type);
+    }
+}
+
+static void app_report(int id, AppShm *shm_ptr) {
+    app_report_msg(id, &shm_ptr->reply, &shm_ptr->body);
+}
+
 static void run_app(int id) {
     /* ignore SIGINT inside app; parent handles snapshot */
     signal(SIGINT, SIG_IGN);
@@ -331,12 +1005,12 @@ static void run_app(int id) {
 
     /* attach shmem for this app */
     key_t shm_key = SHM_KEY_BASE + id;
-    int shm_id = shmget(shm_key, sizeof(SfpMessage), 0666);
+    int shm_id = shmget(shm_key, sizeof(AppShm), 0666);
     if (shm_id < 0) {
         fprintf(stderr, "[App A%d] shmget failed (key 0x%x)\n", id, (unsigned)shm_key);
         _exit(1);
     }
-    SfpMessage *shm_ptr = (SfpMessage*) shmat(shm_id, NULL, 0);
+    AppShm *shm_ptr = (AppShm*) shmat(shm_id, NULL, 0);
     if (shm_ptr == (void*)-1) {
         fprintf(stderr, "[App A%d] shmat failed\n", id);
         _exit(1);
@@ -344,6 +1018,13 @@ static void run_app(int id) {
 
     fprintf(stderr, "[App A%d] started, attached to shmem (shm_id=%d)\n", id, shm_id);
 
+    /* subscribe to changes in the app's own area; the kernel is told with
+       NT-MSGs instead of re-listing it */
+    char watch_msg[128];
+    snprintf(watch_msg, sizeof(watch_msg), "WATCH A%d %d /A%d\n", id, (int)getpid(), id);
+    app_syscall(id, watch_msg);
+    app_report(id, shm_ptr);
+
     int pc = 0;
     while (pc < MAX_PC) {
         usleep(QUANTUM_US);
@@ -358,7 +1039,9 @@ static void run_app(int id) {
         /* probabilistic syscall */
         if (rand() % SYSCALL_PROB == 0) {
             char msg[1024];
-            int op_type = rand() % 5; /* 0=read,1=write,2=add,3=rem,4=list */
+            int op_type = rand() % 11; /* 0=read,1=write,2=add,3=rem,4=list,5=bulk read,6=bulk write,
+                                          7=stat then read,8=open/write/read/close,
+                                          9=append/copy/rename/trunc,10=async read-ahead */
 
             switch (op_type) {
                 case 0: { /* READ */
@@ -390,58 +1073,149 @@ static void run_app(int id) {
                              id, (int)getpid(), path, id, pc>0?pc-1:0);
                     break;
                 }
-                case 4: { /* LISTDIR */
+                case 4: { /* LISTDIR, following the cursor through every page */
                     char path[128];
                     snprintf(path, sizeof(path), "/A%d", (rand()%2==0)?id:0);
                     snprintf(msg, sizeof(msg), "LISTDIR A%d %d %s\n", id, (int)getpid(), path);
+                    const SfpDlRep *l = &shm_ptr->reply.dl_rep;
+                    for (int page = 1; page < 16; ++page) {
+                        app_syscall(id, msg);
+                        app_report(id, shm_ptr);
+                        if (l->hdr.msg_type != SFP_MSG_DL_REP || l->nrnames < 0 || l->cursor[0] == '\0') break;
+                        snprintf(msg, sizeof(msg), "LISTDIR A%d %d %s %s\n", id, (int)getpid(), path, l->cursor);
+                    }
+                    msg[0] = '\0';
                     break;
                 }
-                default:
-                    msg[0] = '\0';
-            }
-
-            /* send syscall line to kernel */
-            write(STDOUT_FILENO, msg, strlen(msg));
-            kill(getppid(), SIGUSR2);
-
-            /* stop and wait for kernel to unblock via SIGCONT */
-            raise(SIGSTOP);
-
-            /* upon wake-up, read shmem result and print outcome */
-            fprintf(stderr, "[App A%d] Woke up — checking shmem reply\n", id);
-
-            SfpMessage *r = shm_ptr;
-            switch (r->msg_type) {
-                case SFP_MSG_RD_REP:
-                    if (r->offset >= 0) {
-                        /* payload may not be null-terminated; print as binary-safe */
-                        int len = SFP_PAYLOAD_SIZE;
-                        fprintf(stderr, "[App A%d] READ OK @ offset=%d payload='", id, r->offset);
-                        fwrite(r->payload, 1, len, stderr);
-                        fprintf(stderr, "'\n");
+                case 5: { /* READ with length (bulk) */
+                    char path[128];
+                    snprintf(path, sizeof(path), "/A%d/bulk.dat", (rand()%2==0)?id:0);
+                    int offset = (rand() % 4) * 256;
+                    int length = 64 << (rand() % 5); /* 64..1024 */
+                    snprintf(msg, sizeof(msg), "READ A%d %d %s %d %d\n", id, (int)getpid(), path, offset, length);
+                    break;
+                }
+                case 6: { /* WRITEBUF: data staged in shmem, length on the line */
+                    char path[128];
+                    snprintf(path, sizeof(path), "/A%d/bulk.dat", (rand()%2==0)?id:0);
+                    int offset = (rand() % 4) * 256;
+                    int length = 64 << (rand() % 5);
+                    char tag[32];
+                    int tn = snprintf(tag, sizeof(tag), "[A%d PC%d] ", id, pc);
+                    for (int k = 0; k < length; ++k) shm_ptr->body.data[k] = tag[k % tn];
+                    snprintf(msg, sizeof(msg), "WRITEBUF A%d %d %s %d %d\n", id, (int)getpid(), path, offset, length);
+                    break;
+                }
+                case 7: { /* STAT first, then READ only bytes that exist */
+                    char path[128];
+                    snprintf(path, sizeof(path), "/A%d/bulk.dat", (rand()%2==0)?id:0);
+                    snprintf(msg, sizeof(msg), "STAT A%d %d %s\n", id, (int)getpid(), path);
+                    app_syscall(id, msg);
+
+                    const SfpGaRep *a = &shm_ptr->reply.ga_rep;
+                    if (a->hdr.msg_type == SFP_MSG_GA_REP && a->status == SFP_ERR_UNKNOWN_MSG) {
+                        /* no GETATTR on this server: probe with a plain read */
+                        snprintf(msg, sizeof(msg), "READ A%d %d %s 0 256\n", id, (int)getpid(), path);
+                    } else if (a->hdr.msg_type != SFP_MSG_GA_REP || a->status < 0 || a->is_dir || a->size == 0) {
+                        fprintf(stderr, "[App A%d] STAT %s -> code=%d, nothing to read\n", id, path,
+                                a->hdr.msg_type == SFP_MSG_GA_REP ? a->status : SFP_ERR_IO);
+                        msg[0] = '\0';
                     } else {
-                        fprintf(stderr, "[App A%d] READ ERROR code=%d\n", id, r->offset);
+                        long long nblocks = (a->size + 255) / 256;
+                        int offset = (rand() % (int)(nblocks < 4 ? nblocks : 4)) * 256;
+                        long long left = a->size - offset;
+                        int length = left > SFP_MAX_PAYLOAD ? SFP_MAX_PAYLOAD : (int)left;
+                        fprintf(stderr, "[App A%d] STAT OK %s: %lld bytes, version %llu -> read %d @ %d\n",
+                                id, path, a->size, a->version, length, offset);
+                        snprintf(msg, sizeof(msg), "READ A%d %d %s %d %d\n", id, (int)getpid(), path, offset, length);
                     }
                     break;
-                case SFP_MSG_WR_REP:
-                    if (r->offset >= 0) fprintf(stderr, "[App A%d] WRITE OK @ offset=%d\n", id, r->offset);
-                    else fprintf(stderr, "[App A%d] WRITE ERROR code=%d\n", id, r->offset);
-                    break;
-                case SFP_MSG_DC_REP:
-                    if (r->path_len >= 0) fprintf(stderr, "[App A%d] DIR CREATE OK -> %s\n", id, r->path);
-                    else fprintf(stderr, "[App A%d] DIR CREATE ERROR code=%d\n", id, r->path_len);
+                }
+                case 8: { /* OPEN once, then WRITEH/READH by handle, then CLOSE */
+                    char path[128];
+                    snprintf(path, sizeof(path), "/A%d/bulk.dat", (rand()%2==0)?id:0);
+                    snprintf(msg, sizeof(msg), "OPEN A%d %d %s\n", id, (int)getpid(), path);
+                    app_syscall(id, msg);
+                    app_report(id, shm_ptr);
+                    int handle = shm_ptr->reply.op_rep.handle;
+                    if (shm_ptr->reply.hdr.msg_type != SFP_MSG_OP_REP || handle <= 0) {
+                        msg[0] = '\0';
+                        break;
+                    }
+
+                    int offset = (rand() % 4) * 256;
+                    int length = 64 << (rand() % 3);
+                    char tag[32];
+                    int tn = snprintf(tag, sizeof(tag), "<A%d h%d> ", id, handle);
+                    for (int k = 0; k < length; ++k) shm_ptr->body.data[k] = tag[k % tn];
+                    snprintf(msg, sizeof(msg), "WRITEH A%d %d %d %d %d\n", id, (int)getpid(), handle, offset, length);
+                    app_syscall(id, msg);
+                    app_report(id, shm_ptr);
+
+                    snprintf(msg, sizeof(msg), "READH A%d %d %d %d %d\n", id, (int)getpid(), handle, offset, length);
+                    app_syscall(id, msg);
+                    app_report(id, shm_ptr);
+
+                    snprintf(msg, sizeof(msg), "CLOSE A%d %d %d\n", id, (int)getpid(), handle);
                     break;
-                case SFP_MSG_DR_REP:
-                    if (r->path_len >= 0) fprintf(stderr, "[App A%d] DIR REMOVE OK -> %s\n", id, r->path);
-                    else fprintf(stderr, "[App A%d] DIR REMOVE ERROR code=%d\n", id, r->path_len);
+                }
+                case 9: { /* server-side file ops: one round trip each instead of RD/WR loops */
+                    char path[128], copy[128];
+                    int area = (rand()%2==0)?id:0;
+                    snprintf(path, sizeof(path), "/A%d/log.txt", area);
+                    snprintf(copy, sizeof(copy), "/A%d/log.bak", area);
+                    int length = 32 << (rand() % 3);
+                    char tag[32];
+                    int tn = snprintf(tag, sizeof(tag), "A%d PC%d; ", id, pc);
+                    for (int k = 0; k < length; ++k) shm_ptr->body.data[k] = tag[k % tn];
+                    snprintf(msg, sizeof(msg), "APPEND A%d %d %s %d\n", id, (int)getpid(), path, length);
+                    app_syscall(id, msg);
+                    app_report(id, shm_ptr);
+                    if (shm_ptr->reply.hdr.msg_type != SFP_MSG_AP_REP || shm_ptr->reply.ap_rep.offset < 0) {
+                        msg[0] = '\0';
+                        break;
+                    }
+
+                    switch (rand() % 3) {
+                        case 0: /* snapshot the whole log */
+                            snprintf(msg, sizeof(msg), "COPY A%d %d %s %s\n", id, (int)getpid(), path, copy);
+                            break;
+                        case 1: /* rotate it */
+                            snprintf(msg, sizeof(msg), "RENAME A%d %d %s %s\n", id, (int)getpid(), path, copy);
+                            break;
+                        default: /* keep only the first 256 bytes */
+                            snprintf(msg, sizeof(msg), "TRUNC A%d %d %s 256\n", id, (int)getpid(), path);
+                    }
                     break;
-                case SFP_MSG_DL_REP:
-                    if (r->nrnames >= 0) fprintf(stderr, "[App A%d] LISTDIR OK -> %d entries\n", id, r->nrnames);
-                    else fprintf(stderr, "[App A%d] LISTDIR ERROR code=%d\n", id, r->nrnames);
+                }
+                case 10: { /* every block of the file in flight at once, overlapped with work */
+                    char path[128];
+                    snprintf(path, sizeof(path), "/A%d/file.txt", (rand()%2==0)?id:0);
+                    for (int t = 0; t < APP_TICKETS; ++t) {
+                        snprintf(msg, sizeof(msg), "READ A%d %d %s %d\n", id, (int)getpid(), path, t * 16);
+                        app_submit(shm_ptr, t, msg);
+                    }
+                    usleep(QUANTUM_US / 2); /* computation while the reads are out */
+                    for (int t = 0; t < APP_TICKETS; ++t) {
+                        if (!app_poll(shm_ptr, t)) fprintf(stderr, "[App A%d] ticket %d not ready, waiting\n", id, t);
+                        app_wait(id, shm_ptr, t);
+                        app_report_msg(id, &shm_ptr->tickets[t].reply, &shm_ptr->tickets[t].body);
+                        __atomic_store_n(&shm_ptr->tickets[t].state, TICKET_FREE, __ATOMIC_RELEASE);
+                    }
+                    msg[0] = '\0';
                     break;
+                }
                 default:
-                    fprintf(stderr, "[App A%d] Unexpected SFP msg in shmem: %d\n", id, r->msg_type);
+                    msg[0] = '\0';
+            }
+            if (msg[0] == '\0') {
+                usleep(QUANTUM_US);
+                continue;
             }
+
+            /* send syscall line to kernel; upon wake-up, read shmem result and print outcome */
+            app_syscall(id, msg);
+            app_report(id, shm_ptr);
         }
 
         usleep(QUANTUM_US);
@@ -458,52 +1232,396 @@ static void run_app(int id) {
     _exit(0);
 }
 
+/* ---------------- Kernel: SFP capability negotiation (HELLO) ---------------- */
+
+/* fall back to what every server speaks: fixed SfpMessage, 16-byte blocks, no batches */
+static void use_legacy_sfp(void) {
+    wire_mode = SFP_WIRE_LEGACY;
+    sfp_max_payload = SFP_PAYLOAD_SIZE;
+    sfp_max_batch = 1;
+    sfp_features = 0;
+}
+
+#define HELLO_FEATURES (SFP_FEAT_DEADLINE | SFP_FEAT_LENGTH | SFP_FEAT_BATCH | SFP_FEAT_REQID | \
+                        SFP_FEAT_GETATTR | SFP_FEAT_HANDLES | SFP_FEAT_FILEOPS | SFP_FEAT_DLPAGE | \
+                        SFP_FEAT_WATCH | SFP_FEAT_CREDITS)
+
+static void send_hello(void) {
+    unsigned char buf[128];
+    SfpMsg hello;
+    memset(&hello, 0, sizeof(hello));
+    hello.hdr.msg_type = SFP_MSG_HL_REQ;
+    hello.hdr.req_id = next_req_id++;
+    hello.hello.version = SFP_PROTO_VERSION;
+    hello.hello.max_payload = SFP_MAX_PAYLOAD;
+    hello.hello.max_batch = SFP_MAX_BATCH;
+    hello.hello.transports = SFP_TR_LEGACY | SFP_TR_COMPACT;
+    hello.hello.features = HELLO_FEATURES;
+    int len = sfp_encode(&hello, NULL, SFP_WIRE_COMPACT, buf, sizeof(buf));
+    if (sendto(udp_sockfd, buf, len, 0, (struct sockaddr*)&sfss_addr, sizeof(sfss_addr)) < 0)
+        perror("[Kernel] sendto failed (HELLO)");
+    else
+        hello_sent++;
+}
+
+/* pick the fastest mode both sides support from HL-REP 'rep'. A server that
+   answers with anything else predates negotiation and only speaks the fixed
+   SfpMessage: legacy for good. */
+static void apply_hello(const SfpMsg *rep) {
+    hello_pending = HELLO_DONE;
+    if (rep->hdr.msg_type != SFP_MSG_HL_REP || rep->hello.version < 2 ||
+        !(rep->hello.transports & SFP_TR_COMPACT)) {
+        fprintf(stderr, "[Kernel] SFSS did not negotiate (old server) - using legacy SFP layout\n");
+        use_legacy_sfp();
+        return;
+    }
+    int features = HELLO_FEATURES & rep->hello.features;
+    sfp_features = features;
+    wire_mode = SFP_WIRE_COMPACT;
+    sfp_max_payload = SFP_PAYLOAD_SIZE;
+    if ((features & SFP_FEAT_LENGTH) && rep->hello.max_payload > SFP_PAYLOAD_SIZE)
+        sfp_max_payload = rep->hello.max_payload < SFP_MAX_PAYLOAD ? rep->hello.max_payload : SFP_MAX_PAYLOAD;
+    sfp_credits = (features & SFP_FEAT_CREDITS) ? (int)rep->hdr.credits : 0;
+    sfp_max_batch = 1;
+    if ((features & SFP_FEAT_BATCH) && rep->hello.max_batch > 1)
+        sfp_max_batch = rep->hello.max_batch < SFP_MAX_BATCH ? rep->hello.max_batch : SFP_MAX_BATCH;
+    fprintf(stderr, "[Kernel] SFSS v%d: compact SFP, payload <= %d, batch <= %d, credits %d, features 0x%x\n",
+            rep->hello.version, sfp_max_payload, sfp_max_batch, sfp_credits, features);
+}
+
+/* exchange HELLOs at startup, waiting at most SFSS_HELLO_WAIT_MS. If SFSS is
+   not up yet the kernel starts on the legacy layout, which any server
+   understands, and keeps resending the HELLO (see hello_tick) */
+static void negotiate_sfp(void) {
+    static unsigned char buf[SFP_WIRE_MAX];
+    if (wire_mode == SFP_WIRE_LEGACY) { use_legacy_sfp(); return; }
+
+    send_hello();
+    fd_set rfds;
+    FD_ZERO(&rfds);
+    FD_SET(udp_sockfd, &rfds);
+    struct timeval tv = { SFSS_HELLO_WAIT_MS / 1000, (SFSS_HELLO_WAIT_MS % 1000) * 1000 };
+    ssize_t n = -1;
+    if (select(udp_sockfd + 1, &rfds, NULL, NULL, &tv) > 0) n = recv(udp_sockfd, buf, sizeof(buf), 0);
+
+    SfpMsg rep;
+    if (n >= 0 && sfp_decode(buf, (size_t)n, &rep, NULL, NULL) == 0) {
+        apply_hello(&rep);
+        return;
+    }
+    fprintf(stderr, "[Kernel] No HELLO reply from SFSS yet - legacy SFP layout until it answers\n");
+    use_legacy_sfp();
+    hello_pending = HELLO_WAIT_SERVER;
+    hello_gap_us = SFSS_HELLO_WAIT_MS * 1000LL;
+    hello_due_us = mono_us() + hello_gap_us;
+}
+
+/* resend an unanswered HELLO when due, doubling the gap up to
+   SFSS_HELLO_RETRY_MAX_MS. Once SFSS answers other requests, a last HELLO
+   that also goes unanswered means an old server: legacy for good. */
+static void hello_tick(void) {
+    if (hello_pending == HELLO_DONE) return;
+    long long now = mono_us();
+    if (now < hello_due_us) return;
+    if (hello_pending == HELLO_LAST_OUT) {
+        fprintf(stderr, "[Kernel] SFSS answers but not HELLO (old server) - staying on legacy SFP layout\n");
+        hello_pending = HELLO_DONE;
+        return;
+    }
+    send_hello();
+    if (hello_pending == HELLO_LAST_DUE) {
+        hello_pending = HELLO_LAST_OUT;
+        hello_due_us = now + rto_us;
+        return;
+    }
+    hello_gap_us = hello_gap_us * 2 < SFSS_HELLO_RETRY_MAX_MS * 1000LL ? hello_gap_us * 2 : SFSS_HELLO_RETRY_MAX_MS * 1000LL;
+    hello_due_us = now + hello_gap_us;
+}
+
+/* microseconds until hello_tick has work (-1 = none) */
+static long long next_hello_us(void) {
+    if (hello_pending == HELLO_DONE) return -1;
+    long long now = mono_us();
+    return hello_due_us > now ? hello_due_us - now : 0;
+}
+
 /* ---------------- Kernel: handle replies from SFSS (UDP recv) ---------------- */
 
-static void handle_sfs_reply(void) {
-    SfpMessage res_msg;
-    struct sockaddr_in from_addr;
-    socklen_t from_len = sizeof(from_addr);
-    ssize_t n = recvfrom(udp_sockfd, &res_msg, sizeof(SfpMessage), 0,
-                         (struct sockaddr*)&from_addr, &from_len);
-    if (n < 0) {
-        if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK) return;
-        perror("[Kernel] recvfrom error");
+/* syscall length argument -> SFP 'length' field (0 = default 16-byte block) */
+static int clamp_length(int length) {
+    if (length <= 0) return 0;
+    return length > sfp_max_payload ? sfp_max_payload : length;
+}
+
+/* size of the out-of-line body carried by a reply (0 = none) */
+static size_t reply_body_size(const SfpMsg *m) {
+    if (m->hdr.msg_type == SFP_MSG_DL_REP && m->dl_rep.nrnames > 0) return sizeof(SfpDlList);
+    if (m->hdr.msg_type == SFP_MSG_RD_REP && m->rd_rep.length > SFP_PAYLOAD_SIZE) return (size_t)m->rd_rep.length;
+    return 0;
+}
+
+/* async syscall done: reply into its ticket, then wake the app if it is
+   blocked in WAIT on that ticket */
+static void complete_ticket(int idx, int t, const SfpMsg *m, const void *body) {
+    AppTicket *tk = &shm_ptrs[idx]->tickets[t];
+    memcpy(&tk->reply, m, sizeof(SfpMsg));
+    if (body != NULL) memcpy(&tk->body, body, reply_body_size(m));
+    __atomic_store_n(&tk->state, TICKET_DONE, __ATOMIC_RELEASE);
+    pcbs[idx].ticket_req[t] = 0;
+    async_completed++;
+    if (pcbs[idx].state == BLOCKED && pcbs[idx].wait_ticket == t) {
+        pcbs[idx].wait_ticket = -1;
+        pcbs[idx].state = READY;
+        rq_push_tail(idx);
+        fprintf(stderr, "[Kernel] A%d ticket %d done -> unblocked from WAIT\n", idx + 1, t);
+    }
+}
+
+/* complete a blocked syscall without the server: error reply into shmem, owner
+   back to READY. If the request was on the wire, its slot (and credit) is freed
+   and a late reply for it will be dropped as stale. */
+static void fail_syscall(int idx, const SfpMsg *req, int code) {
+    InFlight *e = inflight_find(req->hdr.req_id);
+    if (e != NULL) inflight_remove(e);
+    SfpMsg rep;
+    memset(&rep, 0, sizeof(rep));
+    rep.hdr.msg_type = req->hdr.msg_type + 1;
+    rep.hdr.owner = req->hdr.owner;
+    rep.hdr.req_id = req->hdr.req_id;
+    sfp_set_status(&rep, code);
+    int t = ticket_of(idx, req->hdr.req_id);
+    if (t >= 0) {
+        complete_ticket(idx, t, &rep, NULL);
         return;
     }
+    memcpy(&shm_ptrs[idx]->reply, &rep, sizeof(SfpMsg));
+    if (pcbs[idx].state == BLOCKED) {
+        pcbs[idx].state = READY;
+        rq_push_tail(idx);
+    }
+}
+
+/* fold one RTT measurement into srtt/rttvar and recompute the RTO */
+static void rtt_sample(long long r) {
+    if (srtt_us == 0) {
+        srtt_us = r;
+        rttvar_us = r / 2;
+    } else {
+        long long err = srtt_us > r ? srtt_us - r : r - srtt_us;
+        rttvar_us = (3 * rttvar_us + err) / 4;
+        srtt_us = (7 * srtt_us + r) / 8;
+    }
+    rto_us = srtt_us + 4 * rttvar_us;
+    if (rto_us < SFSS_RTO_MIN_MS * 1000LL) rto_us = SFSS_RTO_MIN_MS * 1000LL;
+    if (rto_us > SFSS_RTO_MAX_MS * 1000LL) rto_us = SFSS_RTO_MAX_MS * 1000LL;
+}
+
+/* is app 'idx' still blocked on the request 'm' answers? (the in-flight table
+   already matched the reply; this guards the wait in the completion queues) */
+static int reply_matches(int idx, const SfpMsg *m) {
+    return pcbs[idx].state == BLOCKED && m->hdr.req_id == pcbs[idx].pending_syscall.hdr.req_id;
+}
+
+/* heap copy of a reply body for the completion queues; 'src' is either a
+   decoded SfpBulk or the data straight from the datagram (both start at
+   offset 0 of the union), and only the bytes in use are allocated */
+static SfpBulk* keep_body(const SfpMsg *m, const void *src) {
+    size_t n = reply_body_size(m);
+    if (n == 0) return NULL;
+    SfpBulk *copy = malloc(n);
+    if (copy == NULL) return NULL;
+    memcpy(copy, src, n);
+    body_allocs++;
+    body_alloc_bytes += n;
+    return copy;
+}
+
+/* copy a reply (and its body) into the app's shared memory */
+static void deliver_to_shm(int idx, const SfpMsg *m, const SfpBulk *body) {
+    memcpy(&shm_ptrs[idx]->reply, m, sizeof(SfpMsg));
+    if (body != NULL) memcpy(&shm_ptrs[idx]->body, body, reply_body_size(m));
+}
+
+/* hand a reply to the app blocked on it and make the app READY; 'how' names
+   what completed it (IRQ1, IRQ2 or the reply itself) for the log */
+static void complete_reply(const SfpMsg *res_msg, const void *body, const char *how) {
+    int owner = res_msg->hdr.owner;
+    int idx = owner - 1;
+    int t = ticket_of(idx, res_msg->hdr.req_id);
+    if (t >= 0) {
+        fprintf(stderr, "[Kernel] %s -> A%d ticket %d (req %llu) done\n", how, owner, t, res_msg->hdr.req_id);
+        complete_ticket(idx, t, res_msg, body);
+        if (running_idx == -1) schedule_next();
+    } else if (idx >= 0 && idx < N_APPS && reply_matches(idx, res_msg)) {
+        /* copy into shared mem for that process */
+        deliver_to_shm(idx, res_msg, body);
+        pcbs[idx].state = READY;
+        rq_push_tail(idx);
+        fprintf(stderr, "[Kernel] %s -> unblocked A%d (PID %d) enqueued\n", how, idx + 1, (int)pcbs[idx].pid);
+        if (running_idx == -1) schedule_next();
+    } else {
+        fprintf(stderr, "[Kernel] %s -> WARN owner A%d not found or not waiting for req %llu\n",
+                how, owner, res_msg->hdr.req_id);
+    }
+}
 
-    fprintf(stderr, "[Kernel] Received SFP msg %d from SFSS for owner %d\n",
-            res_msg.msg_type, res_msg.owner);
+/* put one reply in its completion queue (IRQ1 for files, IRQ2 for directories);
+   with -I it completes the syscall right away instead */
+static void enqueue_reply(const SfpMsg *reply, const void *body) {
+    fprintf(stderr, "[Kernel] Received SFP msg %d from SFSS for owner %d (req %llu)\n",
+            reply->hdr.msg_type, reply->hdr.owner, reply->hdr.req_id);
+    InFlight *e = reply->hdr.req_id != 0 ? inflight_find(reply->hdr.req_id) : inflight_find_owner(reply->hdr.owner, reply->hdr.msg_type);
+    if (e == NULL || e->owner != reply->hdr.owner) {
+        sfp_stale++;
+        fprintf(stderr, "[Kernel] Stale SFP reply (req %llu) for A%d dropped\n",
+                reply->hdr.req_id, reply->hdr.owner);
+        return;
+    }
+    /* from here on the reply carries its request's id, also on the legacy wire */
+    SfpMsg matched = *reply;
+    const SfpMsg *res_msg = &matched;
+    matched.hdr.req_id = e->req_id;
+    long long now = mono_us();
+    long long rtt = now - e->submit_us;
+    rtt_sum_us += rtt;
+    rtt_samples++;
+    if (rtt > rtt_max_us) rtt_max_us = rtt;
+    /* the server echoes the sent_us of the copy it answered, so even a
+       retransmitted request gives an unambiguous sample; without the echo,
+       only first transmissions count (Karn). The stamp only names the copy:
+       the sample itself is taken on the monotonic clock. */
+    int copy = -1;
+    for (int k = 0; k <= e->tries && reply->hdr.sent_us > 0; ++k)
+        if (e->tx_stamp_us[k] == reply->hdr.sent_us) copy = k;
+    if (copy >= 0) rtt_sample(now - e->tx_mono_us[copy]);
+    else if (e->tries == 0) rtt_sample(rtt);
+    if (res_msg->hdr.msg_type == SFP_MSG_RD_REP) bc_fill(&e->req, res_msg, e->bc_epoch);
+    else if (res_msg->hdr.msg_type == SFP_MSG_WA_REP && res_msg->wa_rep.path_len >= 0) bc_note_watch(e->req.wa_req.path, 1);
+    else if (res_msg->hdr.msg_type == SFP_MSG_UW_REP && res_msg->uw_rep.path_len >= 0) bc_note_watch(e->req.uw_req.path, 0);
+    inflight_remove(e);
+
+    if (immediate_completion) {
+        /* the body is still in the receive buffer: copied once, into shmem */
+        completions_immediate++;
+        complete_reply(res_msg, body, "REPLY");
+        return;
+    }
 
-    switch (res_msg.msg_type) {
+    ReplyQ *q;
+    switch (res_msg->hdr.msg_type) {
         case SFP_MSG_RD_REP:
         case SFP_MSG_WR_REP:
-            if (fq_sz < MAX_BLOCKED) {
-                file_req_q[fq_t] = res_msg;
-                fq_t = (fq_t + 1) % MAX_BLOCKED;
-                fq_sz++;
-            } else {
-                fprintf(stderr, "[Kernel] File queue full — dropping reply\n");
-            }
+        case SFP_MSG_GA_REP:
+        case SFP_MSG_OP_REP:
+        case SFP_MSG_CL_REP:
+        case SFP_MSG_AP_REP:
+        case SFP_MSG_TR_REP:
+        case SFP_MSG_CP_REP:
+        case SFP_MSG_RN_REP:
+            q = &file_req_q;
             break;
 
         case SFP_MSG_DC_REP:
         case SFP_MSG_DR_REP:
         case SFP_MSG_DL_REP:
-            if (dq_sz < MAX_BLOCKED) {
-                dir_req_q[dq_t] = res_msg;
-                dq_t = (dq_t + 1) % MAX_BLOCKED;
-                dq_sz++;
-            } else {
-                fprintf(stderr, "[Kernel] Dir queue full — dropping reply\n");
-            }
+        case SFP_MSG_WA_REP:
+        case SFP_MSG_UW_REP:
+            q = &dir_req_q;
             break;
 
         default:
-            fprintf(stderr, "[Kernel] Unknown reply type from SFSS: %d\n", res_msg.msg_type);
+            fprintf(stderr, "[Kernel] Unknown reply type from SFSS: %d\n", res_msg->hdr.msg_type);
+            return;
+    }
+    SfpBulk *kept = keep_body(res_msg, body);
+    if (replyq_push(q, res_msg, kept) != 0) {
+        /* no memory to queue it: rather than lose the reply, complete it now */
+        fprintf(stderr, "[Kernel] %s queue cannot grow — completing reply now\n", q == &file_req_q ? "File" : "Dir");
+        complete_reply(res_msg, kept != NULL ? (const void*)kept : body, "REPLY");
+        free(kept);
     }
 }
 
+/* NT-MSG pushed by SFSS: a watched path changed (no syscall is waiting for it) */
+static void handle_notify(const SfpNtMsg *nt) {
+    sfp_notifies++;
+    sfp_notified_changes += nt->count > 0 ? (unsigned long)nt->count : 0;
+    fprintf(stderr, "[Kernel] NOTIFY A%d: %s%s%s changed (events 0x%x, %d change%s)\n",
+            nt->hdr.owner, nt->path, nt->name[0] != '\0' ? "/" : "", nt->name,
+            nt->events, nt->count, nt->count == 1 ? "" : "s");
+    /* the change may come from another SFSS client: cached blocks go stale */
+    if (nt->name[0] != '\0') bc_invalidate_in(nt->path, nt->name);
+    else bc_invalidate(nt->path);
+}
+
+/* take the credit window advertised in a reply (or batch reply) header */
+static void note_credits(const SfpHdr *h) {
+    if (!(sfp_features & SFP_FEAT_CREDITS) || h->credits == 0 || (int)h->credits == sfp_credits) return;
+    fprintf(stderr, "[Kernel] SFSS credits: %d -> %u\n", sfp_credits, h->credits);
+    sfp_credits = (int)h->credits;
+}
+
+static void recv_sfs_reply(void) {
+    static SfpMsg res_msg;
+    static SfpBulk body;
+    static SfpBatch batch;
+    static unsigned char buf[SFP_WIRE_MAX];
+    struct sockaddr_in from_addr;
+    socklen_t from_len = sizeof(from_addr);
+    ssize_t n = recvfrom(udp_sockfd, buf, sizeof(buf), 0,
+                         (struct sockaddr*)&from_addr, &from_len);
+    if (n < 0) {
+        if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK) return;
+        perror("[Kernel] recvfrom error");
+        return;
+    }
+    /* RD/WR/AP/TR replies are read in place: a bulk RD-REP goes from the
+       datagram to its completion queue in a single copy */
+    SfpView view;
+    int vrc = sfp_view(buf, (size_t)n, &view);
+    if (vrc == 0) {
+        sfp_views++;
+        sfp_view_to_msg(&view, &res_msg);
+        note_credits(&res_msg.hdr);
+        enqueue_reply(&res_msg, view.data);
+        return;
+    }
+    SfpWireMode mode;
+    if (vrc < 0 || sfp_decode(buf, (size_t)n, &res_msg, &body, &mode) != 0) {
+        fprintf(stderr, "[Kernel] Malformed SFP datagram from SFSS (%zd bytes) dropped\n", n);
+        return;
+    }
+    /* a late HL-REP upgrades the wire; any other reply shows SFSS is up by now.
+       A server that predates HELLO answers it with its generic error in the
+       legacy layout, under a type made up from the HELLO's first bytes. */
+    if (res_msg.hdr.msg_type == SFP_MSG_HL_REP ||
+        (mode == SFP_WIRE_LEGACY && res_msg.hdr.msg_type > SFP_MSG_DL_REP &&
+         res_msg.dc_rep.path_len == SFP_ERR_UNKNOWN_MSG)) {
+        if (hello_pending != HELLO_DONE) apply_hello(&res_msg);
+        return;
+    }
+    if (hello_pending == HELLO_WAIT_SERVER) {
+        hello_pending = HELLO_LAST_DUE;
+        hello_due_us = 0;
+    }
+    note_credits(&res_msg.hdr);
+
+    /* batch reply: one sub-reply per request of the batch, each with its own status */
+    if (res_msg.hdr.msg_type == SFP_MSG_BT_REP) {
+        if (sfp_decode_batch(buf, (size_t)n, &res_msg, &batch) != 0) {
+            fprintf(stderr, "[Kernel] Malformed SFP batch from SFSS (%zd bytes) dropped\n", n);
+            return;
+        }
+        for (int i = 0; i < batch.count; ++i) enqueue_reply(&batch.items[i], &batch.bodies[i]);
+        return;
+    }
+    if (res_msg.hdr.msg_type == SFP_MSG_NT_MSG) {
+        handle_notify(&res_msg.nt);
+        return;
+    }
+    enqueue_reply(&res_msg, &body);
+}
+
 /* ---------------- Kernel: drain intercontroller pipe (IRQ lines) ---------------- */
 
 static void drain_inter(void) {
@@ -535,44 +1653,21 @@ static void drain_inter(void) {
 
         } else if (strcmp(line, "IRQ1") == 0) {
             /* File I/O done: pop file_req_q and unblock owner */
-            if (fq_sz > 0) {
-                SfpMessage res_msg = file_req_q[fq_h];
-                fq_h = (fq_h + 1) % MAX_BLOCKED;
-                fq_sz--;
-
-                int owner = res_msg.owner;
-                int idx = owner - 1;
-                if (idx >= 0 && idx < N_APPS && pcbs[idx].state == BLOCKED) {
-                    /* copy into shared mem for that process */
-                    memcpy(shm_ptrs[idx], &res_msg, sizeof(SfpMessage));
-                    pcbs[idx].state = READY;
-                    rq_push_tail(idx);
-                    fprintf(stderr, "[Kernel] IRQ1 -> unblocked A%d (PID %d) enqueued\n",
-                            idx + 1, (int)pcbs[idx].pid);
-                    if (running_idx == -1) schedule_next();
-                } else {
-                    fprintf(stderr, "[Kernel] IRQ1 -> WARN owner A%d not found or not blocked\n", owner);
-                }
+            SfpMsg res_msg;
+            SfpBulk *body;
+            if (replyq_pop(&file_req_q, &res_msg, &body)) {
+                completions_irq++;
+                complete_reply(&res_msg, body, "IRQ1");
+                free(body);
             }
         } else if (strcmp(line, "IRQ2") == 0) {
             /* Dir I/O done: pop dir_req_q and unblock owner */
-            if (dq_sz > 0) {
-                SfpMessage res_msg = dir_req_q[dq_h];
-                dq_h = (dq_h + 1) % MAX_BLOCKED;
-                dq_sz--;
-
-                int owner = res_msg.owner;
-                int idx = owner - 1;
-                if (idx >= 0 && idx < N_APPS && pcbs[idx].state == BLOCKED) {
-                    memcpy(shm_ptrs[idx], &res_msg, sizeof(SfpMessage));
-                    pcbs[idx].state = READY;
-                    rq_push_tail(idx);
-                    fprintf(stderr, "[Kernel] IRQ2 -> unblocked A%d (PID %d) enqueued\n",
-                            idx + 1, (int)pcbs[idx].pid);
-                    if (running_idx == -1) schedule_next();
-                } else {
-                    fprintf(stderr, "[Kernel] IRQ2 -> WARN owner A%d not found or not blocked\n", owner);
-                }
+            SfpMsg res_msg;
+            SfpBulk *body;
+            if (replyq_pop(&dir_req_q, &res_msg, &body)) {
+                completions_irq++;
+                complete_reply(&res_msg, body, "IRQ2");
+                free(body);
             }
         } else {
             fprintf(stderr, "[Kernel] Unknown IRQ line: '%s'\n", line);
@@ -580,6 +1675,293 @@ static void drain_inter(void) {
     }
 }
 
+/* ---------------- Kernel: outgoing SFP requests ---------------- */
+
+/* Syscalls parsed in one drain_apps pass are collected and sent together:
+   several become a single BT-REQ datagram (compact wire only). */
+static SfpBatch out_batch;
+static int out_idx[SFP_MAX_BATCH];  /* PCB index of each collected request */
+
+/* stamp a request (or batch) so an overloaded server can skip it once we
+   would no longer care */
+static void stamp_deadline(SfpHdr *h) {
+    h->sent_us = sfp_now_us();
+    h->deadline_us = SFSS_DEADLINE_MS > 0 ? h->sent_us + (long long)SFSS_DEADLINE_MS * 1000 : 0;
+}
+
+/* send one request on its own; if it cannot leave, the syscall fails here */
+static void send_single(int idx, const SfpMsg *req, const SfpBulk *body) {
+    static unsigned char wire[SFP_WIRE_MAX];
+    struct iovec iov[2];
+    /* bulk WR/AP data goes out from 'body' as a second iovec */
+    int niov = sfp_encode_iov(req, body, wire_mode, wire, sizeof(wire), iov);
+    struct msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_name = &sfss_addr;
+    mh.msg_namelen = sizeof(sfss_addr);
+    mh.msg_iov = iov;
+    mh.msg_iovlen = niov > 0 ? (size_t)niov : 0;
+    ssize_t sent = niov < 0 ? -1 : sendmsg(udp_sockfd, &mh, 0);
+    if (sent < 0) {
+        if (niov < 0)
+            fprintf(stderr, "[Kernel] SYSCALL A%d: request not representable on the wire\n", idx + 1);
+        else
+            perror("[Kernel] sendto failed");
+        /* the request never left: complete it here with an error */
+        fail_syscall(idx, req, SFP_ERR_IO);
+        return;
+    }
+    sfp_datagrams++;
+}
+
+/* ---------------- Kernel: retransmission ---------------- */
+
+/* microseconds until the next retransmission is due (-1 = nothing in flight) */
+static long long next_retransmit_us(void) {
+    if (sfp_inflight == 0) return -1;
+    long long now = mono_us(), wait = -1;
+    for (int i = 0; i < INFLIGHT_SLOTS; ++i) {
+        const InFlight *e = &inflight_tab[i];
+        if (e->req_id == 0) continue;
+        long long w = e->due_us > now ? e->due_us - now : 0;
+        if (wait < 0 || w < wait) wait = w;
+    }
+    return wait;
+}
+
+/* send the request of 'e' again, with the same req_id (SFSS answers a
+   repeat it already executed from its reply cache) */
+static void retransmit(InFlight *e, long long now) {
+    static unsigned char wire[SFP_WIRE_MAX];
+    struct iovec iov[2];
+    e->tries++;
+    e->rto_us = e->rto_us * 2 > SFSS_RTO_MAX_MS * 1000LL ? SFSS_RTO_MAX_MS * 1000LL : e->rto_us * 2;
+    e->due_us = now + e->rto_us;
+    stamp_deadline(&e->req.hdr);
+    e->tx_stamp_us[e->tries] = e->req.hdr.sent_us;
+    e->tx_mono_us[e->tries] = now;
+    sfp_retransmits++;
+    fprintf(stderr, "[Kernel] Retransmit %d/%d of req %llu (A%d, SFP_MSG %d), next timeout %lld ms\n",
+            e->tries, SFSS_MAX_RETRIES, e->req_id, e->owner, e->op, e->rto_us / 1000);
+
+    int niov = sfp_encode_iov(&e->req, app_body(e->idx, e->ticket), wire_mode, wire, sizeof(wire), iov);
+    struct msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_name = &sfss_addr;
+    mh.msg_namelen = sizeof(sfss_addr);
+    mh.msg_iov = iov;
+    mh.msg_iovlen = niov > 0 ? (size_t)niov : 0;
+    /* a failed send is just another lost copy: the next timeout retries it */
+    if (niov < 0 || sendmsg(udp_sockfd, &mh, 0) < 0) perror("[Kernel] sendto failed (retransmit)");
+    else sfp_datagrams++;
+}
+
+/* send everything collected so far */
+static void flush_requests(void) {
+    static unsigned char wire[SFP_WIRE_MAX];
+    int n = out_batch.count;
+    if (n == 0) return;
+
+    int wire_len = -1;
+    if (n > 1 && sfp_max_batch > 1) {
+        SfpMsg hdr;
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.hdr.msg_type = SFP_MSG_BT_REQ;
+        stamp_deadline(&hdr.hdr);
+        wire_len = sfp_encode_batch(&hdr, &out_batch, wire, sizeof(wire));
+    }
+    if (wire_len < 0) {
+        for (int i = 0; i < n; ++i) send_single(out_idx[i], &out_batch.items[i], &out_batch.bodies[i]);
+    } else if (sendto(udp_sockfd, wire, wire_len, 0,
+                      (struct sockaddr*)&sfss_addr, sizeof(sfss_addr)) < 0) {
+        perror("[Kernel] sendto failed (batch)");
+        for (int i = 0; i < n; ++i) fail_syscall(out_idx[i], &out_batch.items[i], SFP_ERR_IO);
+    } else {
+        sfp_datagrams++;
+        sfp_batched += n;
+        fprintf(stderr, "[Kernel] Sent %d syscalls in one SFP batch (%d bytes)\n", n, wire_len);
+    }
+    out_batch.count = 0;
+    if (running_idx == -1) schedule_next();
+}
+
+/* SFP_FEAT_* the server must have negotiated to understand 'm' (0 = none) */
+static int required_feature(const SfpMsg *m) {
+    switch (m->hdr.msg_type) {
+        case SFP_MSG_GA_REQ: return SFP_FEAT_GETATTR;
+        case SFP_MSG_OP_REQ:
+        case SFP_MSG_CL_REQ: return SFP_FEAT_HANDLES;
+        case SFP_MSG_RD_REQ: return m->rd_req.handle != 0 ? SFP_FEAT_HANDLES : 0;
+        case SFP_MSG_WR_REQ: return m->wr_req.handle != 0 ? SFP_FEAT_HANDLES : 0;
+        case SFP_MSG_AP_REQ:
+        case SFP_MSG_TR_REQ:
+        case SFP_MSG_CP_REQ:
+        case SFP_MSG_RN_REQ: return SFP_FEAT_FILEOPS;
+        case SFP_MSG_WA_REQ:
+        case SFP_MSG_UW_REQ: return SFP_FEAT_WATCH;
+        default: return 0;
+    }
+}
+
+/* queue a request of app 'idx' for the next flush; from here on it holds a credit */
+static void submit_request(int idx, const SfpMsg *req, const SfpBulk *body) {
+    if (out_batch.count >= sfp_max_batch) flush_requests();
+    int k = out_batch.count++;
+    out_batch.items[k] = *req;
+    out_idx[k] = idx;
+    stamp_deadline(&out_batch.items[k].hdr);
+    inflight_add(idx, &out_batch.items[k]);
+    if (body != NULL && (req->hdr.msg_type == SFP_MSG_WR_REQ || req->hdr.msg_type == SFP_MSG_AP_REQ) &&
+        req->wr_req.length > SFP_PAYLOAD_SIZE)
+        memcpy(out_batch.bodies[k].data, body->data, (size_t)req->wr_req.length);
+}
+
+/* room for one more request on the wire: an SFSS credit and an in-flight slot */
+static int can_submit(void) {
+    return (sfp_credits == 0 || sfp_inflight < sfp_credits) && sfp_inflight < INFLIGHT_SLOTS;
+}
+
+/* submit now if SFSS left us a credit; otherwise keep the syscall here, in
+   order, until replies free one (earlier held syscalls go first) */
+static void submit_or_hold(int idx, const SfpMsg *req, const SfpBulk *body) {
+    bc_note_request(req);
+    if (hq_sz == 0 && can_submit()) {
+        submit_request(idx, req, body);
+        return;
+    }
+    held_q[hq_t].idx = idx;
+    held_q[hq_t].ticket = ticket_of(idx, req->hdr.req_id);
+    held_q[hq_t].req = *req;
+    if (held_q[hq_t].ticket < 0) pcbs[idx].held = 1;
+    hq_t = (hq_t + 1) % HELD_MAX;
+    hq_sz++;
+    sfp_held++;
+    fprintf(stderr, "[Kernel] SYSCALL A%d held: %d/%d SFSS credits in use\n", idx + 1, sfp_inflight, sfp_credits);
+}
+
+/* send held syscalls while credits allow; their data is still in the app's
+   shmem (in its ticket, for async ones), since the app waits for the reply */
+static void release_held(void) {
+    while (hq_sz > 0 && can_submit()) {
+        const HeldReq *h = &held_q[hq_h];
+        int idx = h->idx;
+        hq_h = (hq_h + 1) % HELD_MAX;
+        hq_sz--;
+        if (h->ticket < 0) {
+            pcbs[idx].held = 0;
+            if (pcbs[idx].state != BLOCKED) continue;
+        } else if (pcbs[idx].ticket_req[h->ticket] != h->req.hdr.req_id) {
+            continue;
+        }
+        fprintf(stderr, "[Kernel] SYSCALL A%d released (req %llu)\n", idx + 1, h->req.hdr.req_id);
+        submit_request(idx, &h->req, app_body(idx, h->ticket));
+    }
+    flush_requests();
+}
+
+/* a datagram from SFSS: complete what it answers, then use the credits it freed */
+static void handle_sfs_reply(void) {
+    recv_sfs_reply();
+    release_held();
+}
+
+/* running 'op' twice leaves the same result. Only these are retransmitted on
+   the legacy wire: it drops req_id, so SFSS cannot recognize a repetition
+   and would run a DC or DR again (and answer it with an error) */
+static int idempotent(SfpMsgType op) {
+    return op == SFP_MSG_RD_REQ || op == SFP_MSG_WR_REQ || op == SFP_MSG_DL_REQ || op == SFP_MSG_GA_REQ;
+}
+
+/* retransmit every request whose timeout expired; after SFSS_MAX_RETRIES (or
+   at once, for a non-idempotent one on the legacy wire) the syscall fails with
+   SFP_ERR_TIMEOUT instead of leaving the app BLOCKED */
+static void check_retransmits(void) {
+    if (sfp_inflight == 0) return;
+    long long now = mono_us();
+    unsigned long long due[INFLIGHT_SLOTS];
+    int n = 0;
+    for (int i = 0; i < INFLIGHT_SLOTS; ++i)
+        if (inflight_tab[i].req_id != 0 && inflight_tab[i].due_us <= now) due[n++] = inflight_tab[i].req_id;
+
+    /* collected first: failing a syscall frees its slot and moves others */
+    for (int k = 0; k < n; ++k) {
+        InFlight *e = inflight_find(due[k]);
+        if (e == NULL) continue;
+        int may_repeat = wire_mode != SFP_WIRE_LEGACY || idempotent(e->op);
+        if (e->tries < SFSS_MAX_RETRIES && may_repeat) {
+            retransmit(e, now);
+            continue;
+        }
+        SfpMsg req = e->req;
+        int idx = e->idx;
+        sfp_timeouts++;
+        fprintf(stderr, "[Kernel] Req %llu of A%d unanswered after %d retransmits -> SFP_ERR_TIMEOUT\n",
+                req.hdr.req_id, req.hdr.owner, e->tries);
+        fail_syscall(idx, &req, SFP_ERR_TIMEOUT);
+    }
+    if (running_idx == -1) schedule_next();
+    release_held();
+}
+
+/* ---------------- Kernel: async syscalls (ASYNC / WAIT) ---------------- */
+
+/* ASYNC syscall: the app keeps running and its reply goes to ticket 't' */
+static void submit_async(int idx, int t, const SfpMsg *req, const SfpBulk *body) {
+    if (pcbs[idx].ticket_req[t] != 0) {
+        fprintf(stderr, "[Kernel] ASYNC A%d: ticket %d still outstanding - syscall dropped\n", idx + 1, t);
+        return;
+    }
+    pcbs[idx].ticket_req[t] = req->hdr.req_id;
+    async_submitted++;
+    int outstanding = 0;
+    for (int k = 0; k < APP_TICKETS; ++k) outstanding += pcbs[idx].ticket_req[k] != 0;
+    if (outstanding > async_most) async_most = outstanding;
+    fprintf(stderr, "[Kernel] ASYNC A%d ticket %d: MSG %d (req %llu), %d outstanding\n",
+            idx + 1, t, req->hdr.msg_type, req->hdr.req_id, outstanding);
+
+    SfpMsg cached;
+    int feature = required_feature(req);
+    if (!fields_fit(req))
+        fail_syscall(idx, req, SFP_ERR_PATH);
+    else if (wire_mode == SFP_WIRE_LEGACY)
+        /* legacy replies carry no req_id and are matched by owner: with several
+           requests of one owner on the wire they could land on the wrong ticket */
+        fail_syscall(idx, req, SFP_ERR_UNKNOWN_MSG);
+    else if (bc_lookup(req, &cached))
+        complete_ticket(idx, t, &cached, NULL);
+    else if (feature != 0 && !(sfp_features & feature))
+        fail_syscall(idx, req, SFP_ERR_UNKNOWN_MSG);
+    else
+        submit_or_hold(idx, req, body);
+}
+
+/* WAIT: the app stopped itself; it stays BLOCKED only while ticket 't' is
+   outstanding (a finished or unused ticket puts it straight back to READY) */
+static void wait_ticket(int idx, int t) {
+    if (idx < 0 || pcbs[idx].state == TERMINATED) return;
+    if (idx == running_idx && !await_app_stop(idx)) {
+        running_idx = -1;
+        schedule_next();
+        return;
+    }
+    pcbs[idx].state = BLOCKED;
+    if (t >= 0 && t < APP_TICKETS && pcbs[idx].ticket_req[t] != 0) {
+        pcbs[idx].wait_ticket = t;
+        waits_blocked++;
+        fprintf(stderr, "[Kernel] WAIT A%d ticket %d (req %llu) -> BLOCKED\n", idx + 1, t, pcbs[idx].ticket_req[t]);
+    } else {
+        pcbs[idx].state = READY;
+        rq_push_tail(idx);
+        waits_ready++;
+    }
+    if (idx == running_idx) {
+        running_idx = -1;
+        schedule_next();
+    } else if (running_idx == -1) {
+        schedule_next();
+    }
+}
+
 /* ---------------- Kernel: drain apps pipe (app messages and syscalls) ---------------- */
 
 static void drain_apps(void) {
@@ -619,9 +2001,13 @@ static void drain_apps(void) {
                     }
                 }
             }
+        } else if (strncmp(line, "WAIT", 4) == 0) {
+            int t = -1;
+            if (sscanf(line, "WAIT A%d %d %d", &aid, &pid, &t) == 3) wait_ticket(pid_to_index((pid_t)pid), t);
         } else {
-            /* parse syscalls: READ, WRITE, ADD, REM, LISTDIR */
-            SfpMessage req_msg;
+            /* parse syscalls: READ, READH, WRITEH, WRITEBUF, WRITE, ADD, REM, LISTDIR, STAT, OPEN, CLOSE,
+               APPEND, TRUNC, COPY, RENAME, WATCH, UNWATCH */
+            SfpMsg req_msg;
             memset(&req_msg, 0, sizeof(req_msg));
             int idx = -1;
             char path_buf[SFP_MAX_PATH_LEN];
@@ -629,78 +2015,193 @@ static void drain_apps(void) {
             char payload_buf[SFP_PAYLOAD_SIZE + 32];
             int offset = 0;
 
-            if (sscanf(line, "READ A%d %d %s %d", &aid, &pid, path_buf, &offset) == 4) {
+            int length = 0;
+            const SfpBulk *req_body = NULL; /* WRITEBUF data staged in the app's shmem */
+
+            int handle = 0;
+            int fields = 0;
+
+            /* "ASYNC <t> <syscall>": same syscall, but the app does not wait for it */
+            int ticket = -1, skip = 0;
+            const char *call = line;
+            if (sscanf(line, "ASYNC %d %n", &ticket, &skip) == 1 && skip > 0) {
+                if (ticket < 0 || ticket >= APP_TICKETS) {
+                    fprintf(stderr, "[Kernel] ASYNC with invalid ticket %d: '%s'\n", ticket, line);
+                    continue;
+                }
+                call = line + skip;
+            } else {
+                ticket = -1;
+            }
+            if (sscanf(call, "READ A%d %d %s %d %d", &aid, &pid, path_buf, &offset, &length) >= 4) {
                 idx = pid_to_index((pid_t)pid);
-                req_msg.msg_type = SFP_MSG_RD_REQ;
-                req_msg.owner = aid;
-                strncpy(req_msg.path, path_buf, SFP_MAX_PATH_LEN);
-                req_msg.path[SFP_MAX_PATH_LEN - 1] = '\0';
-                req_msg.path_len = strlen(req_msg.path);
-                req_msg.offset = offset;
-
-            } else if (sscanf(line, "WRITE A%d %d %s %d %s", &aid, &pid, path_buf, &offset, payload_buf) == 5) {
+                req_msg.hdr.msg_type = SFP_MSG_RD_REQ;
+                req_msg.rd_req.path_len = copy_field(req_msg.rd_req.path, SFP_PATH_CAP, path_buf);
+                req_msg.rd_req.offset = offset;
+                req_msg.rd_req.length = clamp_length(length);
+
+            } else if (sscanf(call, "READH A%d %d %d %d %d", &aid, &pid, &handle, &offset, &length) >= 4) {
+                idx = pid_to_index((pid_t)pid);
+                req_msg.hdr.msg_type = SFP_MSG_RD_REQ;
+                req_msg.rd_req.handle = handle;
+                req_msg.rd_req.offset = offset;
+                req_msg.rd_req.length = clamp_length(length);
+
+            } else if (sscanf(call, "WRITEH A%d %d %d %d %d", &aid, &pid, &handle, &offset, &length) == 5) {
+                /* like WRITEBUF, but on a file opened with OPEN */
+                idx = pid_to_index((pid_t)pid);
+                req_msg.hdr.msg_type = SFP_MSG_WR_REQ;
+                req_msg.wr_req.handle = handle;
+                req_msg.wr_req.offset = offset;
+                req_msg.wr_req.length = clamp_length(length);
+                if (idx >= 0) {
+                    req_body = app_body(idx, ticket);
+                    if (sfp_rw_len(req_msg.wr_req.length) <= SFP_PAYLOAD_SIZE)
+                        memcpy(req_msg.wr_req.payload, req_body->data, sfp_rw_len(req_msg.wr_req.length));
+                }
+
+            } else if (sscanf(call, "WRITEBUF A%d %d %s %d %d", &aid, &pid, path_buf, &offset, &length) == 5) {
                 idx = pid_to_index((pid_t)pid);
-                req_msg.msg_type = SFP_MSG_WR_REQ;
-                req_msg.owner = aid;
-                strncpy(req_msg.path, path_buf, SFP_MAX_PATH_LEN);
-                req_msg.path[SFP_MAX_PATH_LEN - 1] = '\0';
-                req_msg.path_len = strlen(req_msg.path);
-                req_msg.offset = offset;
+                req_msg.hdr.msg_type = SFP_MSG_WR_REQ;
+                req_msg.wr_req.path_len = copy_field(req_msg.wr_req.path, SFP_PATH_CAP, path_buf);
+                req_msg.wr_req.offset = offset;
+                req_msg.wr_req.length = clamp_length(length);
+                if (idx >= 0) {
+                    req_body = app_body(idx, ticket);
+                    if (sfp_rw_len(req_msg.wr_req.length) <= SFP_PAYLOAD_SIZE)
+                        memcpy(req_msg.wr_req.payload, req_body->data, sfp_rw_len(req_msg.wr_req.length));
+                }
+
+            } else if (sscanf(call, "WRITE A%d %d %s %d %s", &aid, &pid, path_buf, &offset, payload_buf) == 5) {
+                idx = pid_to_index((pid_t)pid);
+                req_msg.hdr.msg_type = SFP_MSG_WR_REQ;
+                req_msg.wr_req.path_len = copy_field(req_msg.wr_req.path, SFP_PATH_CAP, path_buf);
+                req_msg.wr_req.offset = offset;
                 /* copy payload (truncate/pad to SFP_PAYLOAD_SIZE) */
-                memset(req_msg.payload, 0, SFP_PAYLOAD_SIZE);
-                strncpy(req_msg.payload, payload_buf, SFP_PAYLOAD_SIZE);
+                strncpy(req_msg.wr_req.payload, payload_buf, SFP_PAYLOAD_SIZE);
+
+            } else if (sscanf(call, "ADD A%d %d %s %s", &aid, &pid, path_buf, name_buf) == 4) {
+                idx = pid_to_index((pid_t)pid);
+                req_msg.hdr.msg_type = SFP_MSG_DC_REQ;
+                req_msg.dc_req.path_len = copy_field(req_msg.dc_req.path, SFP_PATH_CAP, path_buf);
+                req_msg.dc_req.name_len = copy_field(req_msg.dc_req.name, SFP_NAME_CAP, name_buf);
+
+            } else if (sscanf(call, "REM A%d %d %s %s", &aid, &pid, path_buf, name_buf) == 4) {
+                idx = pid_to_index((pid_t)pid);
+                req_msg.hdr.msg_type = SFP_MSG_DR_REQ;
+                req_msg.dr_req.path_len = copy_field(req_msg.dr_req.path, SFP_PATH_CAP, path_buf);
+                req_msg.dr_req.name_len = copy_field(req_msg.dr_req.name, SFP_NAME_CAP, name_buf);
+
+            } else if ((fields = sscanf(call, "LISTDIR A%d %d %s %s", &aid, &pid, path_buf, name_buf)) >= 3) {
+                /* optional cursor: the last name of the previous page */
+                idx = pid_to_index((pid_t)pid);
+                req_msg.hdr.msg_type = SFP_MSG_DL_REQ;
+                req_msg.dl_req.path_len = copy_field(req_msg.dl_req.path, SFP_PATH_CAP, path_buf);
+                req_msg.dl_req.paged = (sfp_features & SFP_FEAT_DLPAGE) != 0;
+                if (req_msg.dl_req.paged && fields == 4)
+                    req_msg.dl_req.cursor_len = copy_field(req_msg.dl_req.cursor, SFP_NAME_CAP, name_buf);
 
-            } else if (sscanf(line, "ADD A%d %d %s %s", &aid, &pid, path_buf, name_buf) == 4) {
+            } else if (sscanf(call, "STAT A%d %d %s", &aid, &pid, path_buf) == 3) {
                 idx = pid_to_index((pid_t)pid);
-                req_msg.msg_type = SFP_MSG_DC_REQ;
-                req_msg.owner = aid;
-                strncpy(req_msg.path, path_buf, SFP_MAX_PATH_LEN);
-                req_msg.path[SFP_MAX_PATH_LEN - 1] = '\0';
-                req_msg.path_len = strlen(req_msg.path);
-                strncpy(req_msg.name, name_buf, SFP_MAX_PATH_LEN);
-                req_msg.name[SFP_MAX_PATH_LEN - 1] = '\0';
-                req_msg.name_len = strlen(req_msg.name);
-
-            } else if (sscanf(line, "REM A%d %d %s %s", &aid, &pid, path_buf, name_buf) == 4) {
+                req_msg.hdr.msg_type = SFP_MSG_GA_REQ;
+                req_msg.ga_req.path_len = copy_field(req_msg.ga_req.path, SFP_PATH_CAP, path_buf);
+
+            } else if (sscanf(call, "OPEN A%d %d %s", &aid, &pid, path_buf) == 3) {
                 idx = pid_to_index((pid_t)pid);
-                req_msg.msg_type = SFP_MSG_DR_REQ;
-                req_msg.owner = aid;
-                strncpy(req_msg.path, path_buf, SFP_MAX_PATH_LEN);
-                req_msg.path[SFP_MAX_PATH_LEN - 1] = '\0';
-                req_msg.path_len = strlen(req_msg.path);
-                strncpy(req_msg.name, name_buf, SFP_MAX_PATH_LEN);
-                req_msg.name[SFP_MAX_PATH_LEN - 1] = '\0';
-                req_msg.name_len = strlen(req_msg.name);
-
-            } else if (sscanf(line, "LISTDIR A%d %d %s", &aid, &pid, path_buf) == 3) {
+                req_msg.hdr.msg_type = SFP_MSG_OP_REQ;
+                req_msg.op_req.path_len = copy_field(req_msg.op_req.path, SFP_PATH_CAP, path_buf);
+
+            } else if (sscanf(call, "CLOSE A%d %d %d", &aid, &pid, &handle) == 3) {
                 idx = pid_to_index((pid_t)pid);
-                req_msg.msg_type = SFP_MSG_DL_REQ;
-                req_msg.owner = aid;
-                strncpy(req_msg.path, path_buf, SFP_MAX_PATH_LEN);
-                req_msg.path[SFP_MAX_PATH_LEN - 1] = '\0';
-                req_msg.path_len = strlen(req_msg.path);
+                req_msg.hdr.msg_type = SFP_MSG_CL_REQ;
+                req_msg.cl_req.handle = handle;
+
+            } else if (sscanf(call, "APPEND A%d %d %s %d", &aid, &pid, path_buf, &length) == 4) {
+                /* like WRITEBUF, but the server picks the offset (end of file) */
+                idx = pid_to_index((pid_t)pid);
+                req_msg.hdr.msg_type = SFP_MSG_AP_REQ;
+                req_msg.ap_req.path_len = copy_field(req_msg.ap_req.path, SFP_PATH_CAP, path_buf);
+                req_msg.ap_req.length = clamp_length(length);
+                if (idx >= 0) {
+                    req_body = app_body(idx, ticket);
+                    if (sfp_rw_len(req_msg.ap_req.length) <= SFP_PAYLOAD_SIZE)
+                        memcpy(req_msg.ap_req.payload, req_body->data, sfp_rw_len(req_msg.ap_req.length));
+                }
+
+            } else if (sscanf(call, "TRUNC A%d %d %s %d", &aid, &pid, path_buf, &offset) == 4) {
+                idx = pid_to_index((pid_t)pid);
+                req_msg.hdr.msg_type = SFP_MSG_TR_REQ;
+                req_msg.tr_req.path_len = copy_field(req_msg.tr_req.path, SFP_PATH_CAP, path_buf);
+                req_msg.tr_req.offset = offset;
+
+            } else if (sscanf(call, "COPY A%d %d %s %s %d %d", &aid, &pid, path_buf, name_buf, &offset, &length) >= 4) {
+                /* whole file, or 'length' bytes from 'offset' (length 0 = to the end) */
+                idx = pid_to_index((pid_t)pid);
+                req_msg.hdr.msg_type = SFP_MSG_CP_REQ;
+                req_msg.cp_req.path_len = copy_field(req_msg.cp_req.path, SFP_PATH_CAP, path_buf);
+                req_msg.cp_req.dst_len = copy_field(req_msg.cp_req.dst, SFP_PATH_CAP, name_buf);
+                req_msg.cp_req.offset = offset;
+                req_msg.cp_req.length = length;
+
+            } else if (sscanf(call, "RENAME A%d %d %s %s", &aid, &pid, path_buf, name_buf) == 4) {
+                idx = pid_to_index((pid_t)pid);
+                req_msg.hdr.msg_type = SFP_MSG_RN_REQ;
+                req_msg.rn_req.path_len = copy_field(req_msg.rn_req.path, SFP_PATH_CAP, path_buf);
+                req_msg.rn_req.dst_len = copy_field(req_msg.rn_req.dst, SFP_PATH_CAP, name_buf);
+
+            } else if (sscanf(call, "WATCH A%d %d %s", &aid, &pid, path_buf) == 3) {
+                idx = pid_to_index((pid_t)pid);
+                req_msg.hdr.msg_type = SFP_MSG_WA_REQ;
+                req_msg.wa_req.path_len = copy_field(req_msg.wa_req.path, SFP_PATH_CAP, path_buf);
+
+            } else if (sscanf(call, "UNWATCH A%d %d %s", &aid, &pid, path_buf) == 3) {
+                idx = pid_to_index((pid_t)pid);
+                req_msg.hdr.msg_type = SFP_MSG_UW_REQ;
+                req_msg.uw_req.path_len = copy_field(req_msg.uw_req.path, SFP_PATH_CAP, path_buf);
             } else {
                 /* unknown line */
                 fprintf(stderr, "[Kernel] Unknown app line: '%s'\n", line);
             }
-
-            if (idx != -1) {
+            req_msg.hdr.owner = aid;
+            req_msg.hdr.req_id = next_req_id++;
+
+            SfpMsg cached;
+            if (idx >= 0 && ticket != -1) {
+                if (pcbs[idx].state != TERMINATED) submit_async(idx, ticket, &req_msg, req_body);
+            } else if (idx >= 0 && pcbs[idx].state != TERMINATED && bc_lookup(&req_msg, &cached)) {
+                /* block cache hit: the reply goes straight to shmem, no UDP and no
+                   BLOCKED state; the app stops itself, so it just continues */
+                deliver_to_shm(idx, &cached, NULL);
+                if (idx == running_idx) {
+                    if (await_app_stop(idx)) kill(pcbs[idx].pid, SIGCONT);
+                    else {
+                        running_idx = -1;
+                        schedule_next();
+                    }
+                }
+            } else if (idx != -1) {
                 if (idx >= 0 && pcbs[idx].state != TERMINATED) {
                     /* block the process and save pending syscall for snapshot */
                     pcbs[idx].state = BLOCKED;
                     pcbs[idx].pending_syscall = req_msg;
                     fprintf(stderr, "[Kernel] SYSCALL A%d (PID %d): MSG %d -> BLOCKED\n",
-                            idx + 1, pid, req_msg.msg_type);
-
-                    /* send request to SFSS via UDP */
-                    ssize_t sent = sendto(udp_sockfd, &req_msg, sizeof(SfpMessage), 0,
-                                          (struct sockaddr*)&sfss_addr, sizeof(sfss_addr));
-                    if (sent < 0) {
-                        perror("[Kernel] sendto failed");
-                    }
-
-                    /* remove from CPU if it was running */
+                            idx + 1, pid, req_msg.hdr.msg_type);
+
+                    /* send request to SFSS via UDP (batched with the others of this pass);
+                       syscalls the server did not negotiate (e.g. STAT, OPEN) or with a
+                       path too long for the SFP fields fail here */
+                    int feature = required_feature(&req_msg);
+                    if (!fields_fit(&req_msg))
+                        fail_syscall(idx, &req_msg, SFP_ERR_PATH);
+                    else if (feature != 0 && !(sfp_features & feature))
+                        fail_syscall(idx, &req_msg, SFP_ERR_UNKNOWN_MSG);
+                    else
+                        submit_or_hold(idx, &req_msg, req_body);
+
+                    /* remove from CPU if it was running (a syscall failed right
+                       here may be resumed at once: wait for the app's own stop) */
                     if (idx == running_idx) {
+                        if (pcbs[idx].state == READY) await_app_stop(idx);
                         running_idx = -1;
                         schedule_next();
                     } else if (running_idx == -1) {
@@ -710,6 +2211,9 @@ static void drain_apps(void) {
             }
         }
     }
+
+    /* one datagram (or batch) for all syscalls read in this pass */
+    flush_requests();
 }
 
 /* ---------------- Kernel main loop & startup ---------------- */
@@ -735,6 +2239,7 @@ static void run_kernel(void) {
         /* non-fatal: warn and continue */
         perror("[Kernel] warning: bind udp_sockfd failed");
     }
+    negotiate_sfp();
 
     /* create pipes for reading child's stdout (intercontroller and apps) */
     int inter_p[2], app_p[2];
@@ -758,10 +2263,17 @@ static void run_kernel(void) {
     for (int i = 0; i < N_APPS; ++i) {
         /* create shared mem for app (keys use i+1 so app ids 1..N_APPS match) */
         key_t shm_key = SHM_KEY_BASE + (i + 1);
-        int shm_id = shmget(shm_key, sizeof(SfpMessage), IPC_CREAT | 0666);
+        int shm_id = shmget(shm_key, sizeof(AppShm), IPC_CREAT | 0666);
+        if (shm_id < 0 && errno == EINVAL) {
+            /* leftover segment from a build with a smaller AppShm: replace it */
+            int old_id = shmget(shm_key, 0, 0666);
+            if (old_id >= 0) shmctl(old_id, IPC_RMID, NULL);
+            shm_id = shmget(shm_key, sizeof(AppShm), IPC_CREAT | 0666);
+        }
         if (shm_id < 0) die("shmget");
-        SfpMessage* shm_ptr = (SfpMessage*) shmat(shm_id, NULL, 0);
+        AppShm* shm_ptr = (AppShm*) shmat(shm_id, NULL, 0);
         if (shm_ptr == (void*)-1) die("shmat");
+        memset(shm_ptr, 0, sizeof(AppShm));
 
         fprintf(stderr, "[Kernel] Created shmem for A%d (key=0x%x, id=%d)\n",
                 i + 1, (unsigned)shm_key, shm_id);
@@ -789,6 +2301,7 @@ static void run_kernel(void) {
         pcbs[i].id = i + 1;
         pcbs[i].state = READY;
         pcbs[i].pc = 0;
+        pcbs[i].wait_ticket = -1;
     }
 
     /* close write ends in kernel, keep read ends */
@@ -824,7 +2337,18 @@ static void run_kernel(void) {
         inter_pending = 0;
         app_pending = 0;
 
-        int r = pselect(udp_sockfd + 1, &read_fds, NULL, NULL, NULL, &empty_mask);
+        /* wake up for the next retransmission (or HELLO) even if nothing arrives */
+        struct timespec ts, *tsp = NULL;
+        long long wait = paused ? -1 : next_retransmit_us();
+        long long hello_wait = paused ? -1 : next_hello_us();
+        if (hello_wait >= 0 && (wait < 0 || hello_wait < wait)) wait = hello_wait;
+        if (wait >= 0) {
+            ts.tv_sec = wait / 1000000;
+            ts.tv_nsec = (wait % 1000000) * 1000;
+            tsp = &ts;
+        }
+
+        int r = pselect(udp_sockfd + 1, &read_fds, NULL, NULL, tsp, &empty_mask);
         if (r < 0) {
             if (errno == EINTR) {
                 /* expected; signals will be handled below */
@@ -838,6 +2362,10 @@ static void run_kernel(void) {
         if (r > 0 && FD_ISSET(udp_sockfd, &read_fds)) {
             handle_sfs_reply();
         }
+        if (!paused) {
+            check_retransmits();
+            hello_tick();
+        }
 
         /* snapshot (Ctrl-C) */
         if (want_snapshot) {
@@ -896,6 +2424,8 @@ static void run_kernel(void) {
             if (inter_r >= 0) close(inter_r);
             if (app_r >= 0) close(app_r);
             if (udp_sockfd >= 0) close(udp_sockfd);
+            replyq_free(&file_req_q);
+            replyq_free(&dir_req_q);
 
             for (int i = 0; i < N_APPS; ++i) {
                 shmdt(shm_ptrs[i]);
@@ -916,6 +2446,20 @@ int main(int argc, char *argv[]) {
         return 0;
     }
 
+    /* kernel options */
+    if (argv[1][0] == '-') {
+        int opt;
+        while ((opt = getopt(argc, argv, "LI")) != -1) {
+            switch (opt) {
+                case 'L': wire_mode = SFP_WIRE_LEGACY; break;
+                case 'I': immediate_completion = 1; break;
+                default:  goto usage;
+            }
+        }
+        run_kernel();
+        return 0;
+    }
+
     if (argc >= 2 && strcmp(argv[1], "inter") == 0) {
         run_interrupt_controller();
         return 0;
@@ -934,9 +2478,11 @@ int main(int argc, char *argv[]) {
         return 0;
     }
 
+usage:
     fprintf(stderr,
             "Usage:\n"
-            "  ./KernelSim_T2             (kernel)\n"
+            "  ./KernelSim_T2 [-L] [-I]   (kernel; -L = legacy SFP wire layout,\n"
+            "                             -I = complete syscalls on reply arrival, not IRQ1/IRQ2)\n"
             "  ./KernelSim_T2 inter       (interrupt controller)\n"
             "  ./KernelSim_T2 app <id>    (app, id 1..5)\n");
     return 1;
@@ -0,0 +1,260 @@
+// Microbenchmark do codec SFP: vazão de codificação/decodificação por tipo
+// de mensagem e tamanho, nos formatos COMPACT e LEGACY, mais a leitura sem
+// cópia (sfp_view) e o envio em iovecs (sfp_encode_iov). As cópias por
+// operação vêm dos contadores do próprio codec.
+//
+// Uso: ./sfp_bench [-n iterações] [-w diretório]
+//   -w grava o datagrama de cada caso em <diretório> (sementes do fuzzer)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "sfp_codec.h"
+
+typedef struct {
+    const char* name;
+    SfpWireMode mode;
+    SfpMsg msg;
+    SfpBulk* body;
+    SfpBatch* batch;  // BT-REQ: itens do lote
+} BenchCase;
+
+#define MAX_CASES 32
+static BenchCase cases[MAX_CASES];
+static int ncases = 0;
+static volatile unsigned long long sink; // Impede que o compilador descarte o laço
+
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static BenchCase* add_case(const char* name, SfpWireMode mode, SfpMsgType type) {
+    BenchCase* c = &cases[ncases++];
+    memset(c, 0, sizeof(*c));
+    c->name = name;
+    c->mode = mode;
+    c->msg.hdr.msg_type = type;
+    c->msg.hdr.owner = 3;
+    if (mode == SFP_WIRE_COMPACT) {
+        // Como o kernel: req_id e prazo em toda requisição
+        c->msg.hdr.req_id = 123456789;
+        c->msg.hdr.sent_us = 1700000000000000LL;
+        c->msg.hdr.deadline_us = c->msg.hdr.sent_us + 2000000;
+    }
+    return c;
+}
+
+static void set_path(char* dst, int* len, const char* path) {
+    snprintf(dst, SFP_PATH_CAP, "%s", path);
+    *len = (int)strlen(dst);
+}
+
+// RD-REP/WR-REQ com 'length' bytes (0 = bloco padrão de 16 bytes)
+static BenchCase* add_rw(const char* name, SfpWireMode mode, SfpMsgType type, int length) {
+    BenchCase* c = add_case(name, mode, type);
+    SfpWrReq* rw = &c->msg.wr_req;
+    set_path(rw->path, &rw->path_len, "/A3/file.bin");
+    rw->offset = 64;
+    rw->length = length;
+    int n = sfp_rw_len(length);
+    c->body = calloc(1, sizeof(SfpBulk));
+    char* dst = n > SFP_PAYLOAD_SIZE ? c->body->data : rw->payload;
+    for (int i = 0; i < n; i++) dst[i] = (char)('a' + i % 26);
+    return c;
+}
+
+// Listagem com 'n' nomes parecidos (newDir_A3_0, newDir_A3_1, ...)
+static BenchCase* add_dl_rep(const char* name, SfpWireMode mode, int n, int paged) {
+    BenchCase* c = add_case(name, mode, SFP_MSG_DL_REP);
+    c->msg.dl_rep.nrnames = n;
+    c->msg.dl_rep.paged = paged;
+    if (paged) {
+        snprintf(c->msg.dl_rep.cursor, SFP_NAME_CAP, "newDir_A3_%d", n - 1);
+        c->msg.dl_rep.cursor_len = (int)strlen(c->msg.dl_rep.cursor);
+    }
+    c->body = calloc(1, sizeof(SfpBulk));
+    SfpDlList* l = &c->body->list;
+    int pos = 0;
+    for (int i = 0; i < n; i++) {
+        int len = snprintf(l->allfilenames + pos, SFP_DL_PAGE_CHARS - pos, "newDir_A3_%d", i);
+        l->fstlstpositions[i].start_index = pos;
+        l->fstlstpositions[i].end_index = pos + len - 1;
+        l->fstlstpositions[i].is_dir = 1;
+        pos += len;
+    }
+    return c;
+}
+
+static void build_cases(void) {
+    BenchCase* c;
+    c = add_case("RD_REQ path", SFP_WIRE_COMPACT, SFP_MSG_RD_REQ);
+    set_path(c->msg.rd_req.path, &c->msg.rd_req.path_len, "/A3/file.bin");
+    c = add_case("RD_REQ handle", SFP_WIRE_COMPACT, SFP_MSG_RD_REQ);
+    c->msg.rd_req.handle = 42;
+    c->msg.rd_req.length = 1024;
+    add_rw("WR_REQ 16", SFP_WIRE_COMPACT, SFP_MSG_WR_REQ, 0);
+    add_rw("WR_REQ 256", SFP_WIRE_COMPACT, SFP_MSG_WR_REQ, 256);
+    add_rw("WR_REQ 1024", SFP_WIRE_COMPACT, SFP_MSG_WR_REQ, 1024);
+    add_rw("RD_REP 16", SFP_WIRE_COMPACT, SFP_MSG_RD_REP, 0);
+    add_rw("RD_REP 1024", SFP_WIRE_COMPACT, SFP_MSG_RD_REP, 1024);
+    c = add_case("WR_REP", SFP_WIRE_COMPACT, SFP_MSG_WR_REP);
+    set_path(c->msg.wr_rep.path, &c->msg.wr_rep.path_len, "/A3/file.bin");
+    c = add_case("DC_REQ", SFP_WIRE_COMPACT, SFP_MSG_DC_REQ);
+    set_path(c->msg.dc_req.path, &c->msg.dc_req.path_len, "/A3");
+    set_path(c->msg.dc_req.name, &c->msg.dc_req.name_len, "newDir_A3_10");
+    c = add_case("DL_REQ paged", SFP_WIRE_COMPACT, SFP_MSG_DL_REQ);
+    set_path(c->msg.dl_req.path, &c->msg.dl_req.path_len, "/A3");
+    c->msg.dl_req.paged = 1;
+    set_path(c->msg.dl_req.cursor, &c->msg.dl_req.cursor_len, "newDir_A3_127");
+    add_dl_rep("DL_REP 40", SFP_WIRE_COMPACT, 40, 0);
+    add_dl_rep("DL_REP 128 paged", SFP_WIRE_COMPACT, 128, 1);
+    c = add_case("GA_REP", SFP_WIRE_COMPACT, SFP_MSG_GA_REP);
+    c->msg.ga_rep.size = 4096;
+    c->msg.ga_rep.mtime = 1700000000;
+    c->msg.ga_rep.version = 7;
+    c = add_case("HL_REQ", SFP_WIRE_COMPACT, SFP_MSG_HL_REQ);
+    c->msg.hello.version = SFP_WIRE_VERSION;
+    c->msg.hello.max_payload = SFP_MAX_PAYLOAD;
+    c->msg.hello.max_batch = SFP_MAX_BATCH;
+    c = add_case("CP_REQ", SFP_WIRE_COMPACT, SFP_MSG_CP_REQ);
+    set_path(c->msg.cp_req.path, &c->msg.cp_req.path_len, "/A3/log.txt");
+    set_path(c->msg.cp_req.dst, &c->msg.cp_req.dst_len, "/A3/log.bak");
+    c = add_case("BT_REQ 8x RD", SFP_WIRE_COMPACT, SFP_MSG_BT_REQ);
+    c->batch = calloc(1, sizeof(SfpBatch));
+    c->batch->count = SFP_MAX_BATCH;
+    for (int i = 0; i < SFP_MAX_BATCH; i++) {
+        SfpMsg* it = &c->batch->items[i];
+        it->hdr = c->msg.hdr;
+        it->hdr.msg_type = SFP_MSG_RD_REQ;
+        it->hdr.req_id += (unsigned long long)i;
+        set_path(it->rd_req.path, &it->rd_req.path_len, "/A3/file.bin");
+        it->rd_req.offset = 16 * i;
+    }
+
+    c = add_case("RD_REQ", SFP_WIRE_LEGACY, SFP_MSG_RD_REQ);
+    set_path(c->msg.rd_req.path, &c->msg.rd_req.path_len, "/A3/file.bin");
+    add_rw("WR_REQ 16", SFP_WIRE_LEGACY, SFP_MSG_WR_REQ, 0);
+    add_dl_rep("DL_REP 40", SFP_WIRE_LEGACY, 40, 0);
+}
+
+static int encode_case(const BenchCase* c, unsigned char* buf, size_t cap) {
+    if (c->batch != NULL) return sfp_encode_batch(&c->msg, c->batch, buf, cap);
+    return sfp_encode(&c->msg, c->body, c->mode, buf, cap);
+}
+
+// Grava o datagrama de cada caso em 'dir'
+static int write_seeds(const char* dir) {
+    static unsigned char buf[SFP_WIRE_MAX];
+    for (int i = 0; i < ncases; i++) {
+        int len = encode_case(&cases[i], buf, sizeof(buf));
+        if (len < 0) continue;
+        char path[512];
+        snprintf(path, sizeof(path), "%s/%02d-%s-%s.bin", dir, i,
+                 cases[i].mode == SFP_WIRE_COMPACT ? "compact" : "legacy", cases[i].name);
+        for (char* p = path + strlen(dir) + 1; *p != '\0'; p++) {
+            if (*p == ' ') *p = '_';
+        }
+        FILE* f = fopen(path, "wb");
+        if (f == NULL || fwrite(buf, 1, (size_t)len, f) != (size_t)len) {
+            perror(path);
+            if (f != NULL) fclose(f);
+            return 1;
+        }
+        fclose(f);
+    }
+    printf("%d sementes gravadas em %s\n", ncases, dir);
+    return 0;
+}
+
+static double per_op(long long ns, long iters) {
+    return (double)ns / (double)iters;
+}
+
+static void run_case(const BenchCase* c, long iters) {
+    static unsigned char buf[SFP_WIRE_MAX], out[SFP_WIRE_MAX];
+    static SfpMsg msg;
+    static SfpBulk body;
+    static SfpBatch batch;
+    SfpCodecCounters before, after;
+
+    int len = encode_case(c, buf, sizeof(buf));
+    if (len < 0) {
+        printf("%-8s %-18s (não representável)\n", c->mode == SFP_WIRE_COMPACT ? "compact" : "legacy", c->name);
+        return;
+    }
+
+    long long t0 = now_ns();
+    for (long i = 0; i < iters; i++) sink += (unsigned long long)encode_case(c, out, sizeof(out));
+    long long enc_ns = now_ns() - t0;
+
+    sfp_codec_counters(&before);
+    t0 = now_ns();
+    for (long i = 0; i < iters; i++) {
+        if (c->batch != NULL) sink += (unsigned long long)sfp_decode_batch(buf, (size_t)len, &msg, &batch);
+        else sink += (unsigned long long)sfp_decode(buf, (size_t)len, &msg, &body, NULL);
+    }
+    long long dec_ns = now_ns() - t0;
+    sfp_codec_counters(&after);
+    double dec_copies = (double)(after.copies - before.copies) / (double)iters;
+
+    // Leitura sem cópia e envio em iovecs, onde o tipo tem
+    char view_col[32] = "-", iov_col[32] = "-";
+    SfpView view;
+    if (c->batch == NULL && sfp_view(buf, (size_t)len, &view) == 0) {
+        t0 = now_ns();
+        for (long i = 0; i < iters; i++) {
+            sink += (unsigned long long)sfp_view(buf, (size_t)len, &view);
+            sink += (unsigned long long)view.data_len;
+        }
+        snprintf(view_col, sizeof(view_col), "%.1f", per_op(now_ns() - t0, iters));
+    }
+    if (c->batch == NULL) {
+        struct iovec iov[2];
+        t0 = now_ns();
+        for (long i = 0; i < iters; i++) sink += (unsigned long long)sfp_encode_iov(&c->msg, c->body, c->mode, out, sizeof(out), iov);
+        snprintf(iov_col, sizeof(iov_col), "%.1f", per_op(now_ns() - t0, iters));
+    }
+
+    printf("%-8s %-18s %6d %9.1f %9.1f %9.1f %9s %9s %8.1f\n",
+           c->mode == SFP_WIRE_COMPACT ? "compact" : "legacy", c->name, len,
+           per_op(enc_ns, iters), per_op(dec_ns, iters),
+           dec_ns > 0 ? (double)len * (double)iters * 1e3 / (double)dec_ns : 0.0,
+           view_col, iov_col, dec_copies);
+}
+
+int main(int argc, char* argv[]) {
+    long iters = 200000;
+    const char* seed_dir = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:w:")) != -1) {
+        switch (opt) {
+            case 'n':
+                iters = atol(optarg);
+                break;
+            case 'w':
+                seed_dir = optarg;
+                break;
+            default:
+                fprintf(stderr, "Uso: %s [-n iterações] [-w diretório]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (iters <= 0) iters = 1;
+    build_cases();
+    if (seed_dir != NULL) return write_seeds(seed_dir);
+
+    printf("%ld iterações por caso; tempos em ns/op\n", iters);
+    printf("%-8s %-18s %6s %9s %9s %9s %9s %9s %8s\n",
+           "formato", "mensagem", "bytes", "encode", "decode", "dec MB/s", "view", "enc_iov", "cópias");
+    for (int i = 0; i < ncases; i++) run_case(&cases[i], iters);
+
+    SfpCodecCounters cc;
+    sfp_codec_counters(&cc);
+    printf("Codec: %llu cópias (%llu bytes), %llu views, %llu envios em 2 iovecs\n",
+           cc.copies, cc.bytes_copied, cc.views, cc.scatter_sends);
+    return 0;
+}
@@ -0,0 +1,868 @@
+#include <string.h>
+#include "sfp_codec.h"
+
+// --- Contadores de cópia ---
+
+static SfpCodecCounters counters;
+
+// Soma as cópias de um encode/decode (uma vez por mensagem, não por campo)
+static void count_copies(unsigned n, size_t bytes) {
+    if (n == 0) return;
+    __atomic_add_fetch(&counters.copies, n, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&counters.bytes_copied, bytes, __ATOMIC_RELAXED);
+}
+
+// --- Escrita (cursor com checagem de limite) ---
+
+typedef struct {
+    unsigned char* p;
+    size_t len, cap;
+    int err;
+    unsigned copies;          // Blocos copiados para 'p' (contadores)
+    size_t copied;
+} SfpWriter;
+
+static void w_u8(SfpWriter* w, unsigned v) {
+    if (w->len + 1 > w->cap) { w->err = 1; return; }
+    w->p[w->len++] = (unsigned char)v;
+}
+
+static void w_u16(SfpWriter* w, unsigned v) {
+    if (w->len + 2 > w->cap) { w->err = 1; return; }
+    w->p[w->len++] = (unsigned char)(v >> 8);
+    w->p[w->len++] = (unsigned char)v;
+}
+
+static void w_i32(SfpWriter* w, int v) {
+    if (w->len + 4 > w->cap) { w->err = 1; return; }
+    unsigned u = (unsigned)v;
+    for (int s = 24; s >= 0; s -= 8) w->p[w->len++] = (unsigned char)(u >> s);
+}
+
+static void w_i64(SfpWriter* w, long long v) {
+    if (w->len + 8 > w->cap) { w->err = 1; return; }
+    unsigned long long u = (unsigned long long)v;
+    for (int s = 56; s >= 0; s -= 8) w->p[w->len++] = (unsigned char)(u >> s);
+}
+
+// Bytes sem prefixo (partes de um bloco cujo tamanho já foi escrito)
+static void w_raw(SfpWriter* w, const void* src, size_t n) {
+    if (w->len + n > w->cap) { w->err = 1; return; }
+    memcpy(w->p + w->len, src, n);
+    w->len += n;
+    w->copies++;
+    w->copied += n;
+}
+
+static void w_bytes(SfpWriter* w, const void* src, size_t n) {
+    if (n > 0xffff || w->len + 2 + n > w->cap) { w->err = 1; return; }
+    w_u16(w, (unsigned)n);
+    w_raw(w, src, n);
+}
+
+// String limitada a 'cap' bytes (campos de tamanho fixo podem vir sem '\0')
+static void w_str(SfpWriter* w, const char* s, size_t cap) {
+    w_bytes(w, s, strnlen(s, cap));
+}
+
+// Bloco binário de tamanho fixo, sem os zeros finais (o decodificador os repõe)
+static void w_trimmed(SfpWriter* w, const char* src, size_t n) {
+    while (n > 0 && src[n - 1] == '\0') n--;
+    w_bytes(w, src, n);
+}
+
+// --- Leitura ---
+
+typedef struct {
+    const unsigned char* p;
+    size_t len, pos;
+    int err;
+    unsigned copies;          // Blocos copiados de 'p' (contadores)
+    size_t copied;
+} SfpReader;
+
+static unsigned r_u8(SfpReader* r) {
+    if (r->pos + 1 > r->len) { r->err = 1; return 0; }
+    return r->p[r->pos++];
+}
+
+static unsigned r_u16(SfpReader* r) {
+    if (r->pos + 2 > r->len) { r->err = 1; return 0; }
+    unsigned v = ((unsigned)r->p[r->pos] << 8) | r->p[r->pos + 1];
+    r->pos += 2;
+    return v;
+}
+
+static int r_i32(SfpReader* r) {
+    if (r->pos + 4 > r->len) { r->err = 1; return 0; }
+    unsigned u = 0;
+    for (int i = 0; i < 4; i++) u = (u << 8) | r->p[r->pos++];
+    return (int)u;
+}
+
+static long long r_i64(SfpReader* r) {
+    if (r->pos + 8 > r->len) { r->err = 1; return 0; }
+    unsigned long long u = 0;
+    for (int i = 0; i < 8; i++) u = (u << 8) | r->p[r->pos++];
+    return (long long)u;
+}
+
+// Copia um bloco prefixado para 'dst' (até 'cap' bytes). Retorna o tamanho.
+static size_t r_bytes(SfpReader* r, void* dst, size_t cap) {
+    size_t n = r_u16(r);
+    if (r->err || n > cap || r->pos + n > r->len) { r->err = 1; return 0; }
+    memcpy(dst, r->p + r->pos, n);
+    r->pos += n;
+    r->copies++;
+    r->copied += n;
+    return n;
+}
+
+// String: precisa caber com o '\0' em 'cap'
+static int r_str(SfpReader* r, char* dst, size_t cap) {
+    size_t n = r_bytes(r, dst, cap - 1);
+    dst[n] = '\0';
+    return (int)n;
+}
+
+// --- Formato COMPACT ---
+
+// RD/WR com 'length' != 0 levam o campo no fio (SFP_WF_LENGTH)
+static int rw_length(const SfpMsg* m) {
+    switch (m->hdr.msg_type) {
+        case SFP_MSG_RD_REQ:
+        case SFP_MSG_WR_REP:
+        case SFP_MSG_AP_REP:
+        case SFP_MSG_TR_REQ:
+        case SFP_MSG_TR_REP:
+        case SFP_MSG_RN_REP:
+            return m->rd_req.length;
+        case SFP_MSG_RD_REP:
+        case SFP_MSG_WR_REQ:
+        case SFP_MSG_AP_REQ:
+            return m->wr_req.length;
+        default:
+            return 0;
+    }
+}
+
+// RD/WR por handle levam o handle no lugar do path (SFP_WF_HANDLE)
+static int rw_handle(const SfpMsg* m) {
+    switch (m->hdr.msg_type) {
+        case SFP_MSG_RD_REQ:
+        case SFP_MSG_WR_REP:
+        case SFP_MSG_AP_REP:
+        case SFP_MSG_TR_REQ:
+        case SFP_MSG_TR_REP:
+        case SFP_MSG_CP_REP:
+        case SFP_MSG_RN_REP:
+            return m->rd_req.handle;
+        case SFP_MSG_RD_REP:
+        case SFP_MSG_WR_REQ:
+        case SFP_MSG_AP_REQ:
+            return m->wr_req.handle;
+        default:
+            return 0;
+    }
+}
+
+// DL-REQ/DL-REP paginados (SFP_WF_PAGED)
+static int dl_paged(const SfpMsg* m) {
+    if (m->hdr.msg_type == SFP_MSG_DL_REQ) return m->dl_req.paged;
+    if (m->hdr.msg_type == SFP_MSG_DL_REP) return m->dl_rep.paged;
+    return 0;
+}
+
+// Listagem paginada: o prefixo comum com o nome anterior não vai no fio.
+// Entradas (u8 is_dir, u8 shared, u16 suffix_len) e depois os sufixos num
+// único bloco.
+static void w_dl_paged(SfpWriter* w, const SfpDlList* l, int n) {
+    unsigned char shared[SFP_DL_PAGE_NAMES];
+    size_t total = 0;
+    for (int i = 0; i < n; i++) {
+        const SfpFstLst* e = &l->fstlstpositions[i];
+        int len = e->end_index - e->start_index + 1, k = 0;
+        if (i > 0) {
+            const SfpFstLst* prev = &l->fstlstpositions[i - 1];
+            int prev_len = prev->end_index - prev->start_index + 1;
+            while (k < len && k < prev_len && k < 255 &&
+                   l->allfilenames[e->start_index + k] == l->allfilenames[prev->start_index + k]) k++;
+        }
+        shared[i] = (unsigned char)k;
+        w_u8(w, e->is_dir ? 1 : 0);
+        w_u8(w, shared[i]);
+        w_u16(w, (unsigned)(len - k));
+        total += (size_t)(len - k);
+    }
+    if (total > 0xffff) { w->err = 1; return; }
+    w_u16(w, (unsigned)total);
+    for (int i = 0; i < n; i++) {
+        const SfpFstLst* e = &l->fstlstpositions[i];
+        w_raw(w, l->allfilenames + e->start_index + shared[i], (size_t)(e->end_index - e->start_index + 1 - shared[i]));
+    }
+}
+
+// Path ou handle de um RD/WR
+static void w_target(SfpWriter* w, int handle, const char* path) {
+    if (handle != 0) w_i32(w, handle);
+    else w_str(w, path, SFP_PATH_CAP);
+}
+
+// Com 'tail' != NULL, os dados grandes de RD_REP/WR_REQ/AP_REQ (o último
+// campo) não são copiados: só o prefixo u16 vai para 'buf' e '*tail' aponta
+// para os dados, que o chamador envia como um segundo iovec.
+static int encode_compact(const SfpMsg* m, const SfpBulk* body, unsigned char* buf, size_t cap,
+                          const void** tail) {
+    SfpWriter w = { buf, 0, cap, 0, 0, 0 };
+    const SfpHdr* h = &m->hdr;
+    int has_deadline = (h->sent_us != 0 || h->deadline_us != 0);
+    int length = rw_length(m);
+    int handle = rw_handle(m);
+    unsigned credits = h->credits;
+
+    if (length < 0 || length > SFP_MAX_PAYLOAD) return -1;
+    w_u8(&w, SFP_WIRE_MAGIC);
+    w_u8(&w, SFP_WIRE_VERSION);
+    w_u8(&w, (unsigned)h->msg_type);
+    w_u8(&w, (has_deadline ? SFP_WF_DEADLINE : 0) | (length != 0 ? SFP_WF_LENGTH : 0) |
+             (h->req_id != 0 ? SFP_WF_REQID : 0) | (handle != 0 ? SFP_WF_HANDLE : 0) |
+             (dl_paged(m) ? SFP_WF_PAGED : 0) | (credits != 0 ? SFP_WF_CREDITS : 0));
+    w_i32(&w, h->owner);
+    if (h->req_id != 0) w_i64(&w, (long long)h->req_id);
+    if (has_deadline) {
+        w_i64(&w, h->sent_us);
+        w_i64(&w, h->deadline_us);
+    }
+    if (credits != 0) w_u16(&w, credits);
+
+    switch (h->msg_type) {
+        case SFP_MSG_RD_REQ:
+        case SFP_MSG_TR_REQ:
+            w_i32(&w, m->rd_req.offset);
+            if (length != 0) w_i32(&w, length);
+            w_target(&w, handle, m->rd_req.path);
+            break;
+        case SFP_MSG_RD_REP:
+        case SFP_MSG_WR_REQ:
+        case SFP_MSG_AP_REQ:
+            w_i32(&w, m->wr_req.offset);
+            if (length != 0) w_i32(&w, length);
+            w_target(&w, handle, m->wr_req.path);
+            if (length == 0) {
+                w_trimmed(&w, m->wr_req.payload, SFP_PAYLOAD_SIZE);
+            } else {
+                if (length > SFP_PAYLOAD_SIZE && body == NULL) return -1;
+                if (tail != NULL && length > SFP_PAYLOAD_SIZE) {
+                    w_u16(&w, (unsigned)length);
+                    *tail = body->data;
+                } else {
+                    w_bytes(&w, sfp_rw_data(&m->wr_req, body), (size_t)length);
+                }
+            }
+            break;
+        case SFP_MSG_WR_REP:
+        case SFP_MSG_AP_REP:
+        case SFP_MSG_TR_REP:
+        case SFP_MSG_RN_REP:
+            w_i32(&w, m->wr_rep.offset);
+            if (length != 0) w_i32(&w, length);
+            w_target(&w, handle, m->wr_rep.path);
+            break;
+        case SFP_MSG_CP_REP:
+            // Bytes copiados: sempre no fio, de qualquer tamanho
+            w_i32(&w, m->cp_rep.offset);
+            w_i32(&w, m->cp_rep.length);
+            w_target(&w, handle, m->cp_rep.path);
+            break;
+        case SFP_MSG_DC_REQ:
+        case SFP_MSG_DR_REQ:
+            w_str(&w, m->dc_req.path, SFP_PATH_CAP);
+            w_str(&w, m->dc_req.name, SFP_NAME_CAP);
+            break;
+        case SFP_MSG_CP_REQ:
+        case SFP_MSG_RN_REQ:
+            w_i32(&w, m->cp_req.offset);
+            w_i32(&w, m->cp_req.length);
+            w_str(&w, m->cp_req.path, SFP_PATH_CAP);
+            w_str(&w, m->cp_req.dst, SFP_PATH_CAP);
+            break;
+        case SFP_MSG_DC_REP:
+        case SFP_MSG_DR_REP:
+        case SFP_MSG_WA_REP:
+        case SFP_MSG_UW_REP:
+            w_i32(&w, m->dc_rep.path_len);
+            w_str(&w, m->dc_rep.path, SFP_PATH_CAP);
+            break;
+        case SFP_MSG_NT_MSG:
+            w_i32(&w, m->nt.events);
+            w_i32(&w, m->nt.count);
+            w_str(&w, m->nt.path, SFP_PATH_CAP);
+            w_str(&w, m->nt.name, SFP_NAME_CAP);
+            break;
+        case SFP_MSG_DL_REQ:
+            w_str(&w, m->dl_req.path, SFP_PATH_CAP);
+            if (m->dl_req.paged) w_str(&w, m->dl_req.cursor, SFP_NAME_CAP);
+            break;
+        case SFP_MSG_GA_REQ:
+        case SFP_MSG_OP_REQ:
+        case SFP_MSG_WA_REQ:
+        case SFP_MSG_UW_REQ:
+            w_str(&w, m->ga_req.path, SFP_PATH_CAP);
+            break;
+        case SFP_MSG_OP_REP:
+        case SFP_MSG_CL_REQ:
+        case SFP_MSG_CL_REP:
+            w_i32(&w, m->op_rep.handle);
+            break;
+        case SFP_MSG_GA_REP:
+            w_i32(&w, m->ga_rep.status);
+            w_u8(&w, m->ga_rep.is_dir ? 1 : 0);
+            w_i64(&w, m->ga_rep.size);
+            w_i64(&w, m->ga_rep.mtime);
+            w_i64(&w, (long long)m->ga_rep.version);
+            break;
+        case SFP_MSG_BT_REQ:
+        case SFP_MSG_BT_REP:
+            // Só o cabeçalho do lote; os itens são anexados por sfp_encode_batch
+            if (m->bt.count < 0 || m->bt.count > SFP_MAX_BATCH) return -1;
+            w_u8(&w, (unsigned)m->bt.count);
+            break;
+        case SFP_MSG_HL_REQ:
+        case SFP_MSG_HL_REP:
+            w_i32(&w, m->hello.version);
+            w_i32(&w, m->hello.max_payload);
+            w_i32(&w, m->hello.max_batch);
+            w_i32(&w, m->hello.transports);
+            w_i32(&w, m->hello.features);
+            break;
+        case SFP_MSG_DL_REP: {
+            w_i32(&w, m->dl_rep.nrnames);
+            if (m->dl_rep.paged) w_str(&w, m->dl_rep.cursor, SFP_NAME_CAP);
+            int n = m->dl_rep.nrnames > SFP_DL_PAGE_NAMES ? SFP_DL_PAGE_NAMES : m->dl_rep.nrnames;
+            if (n > 0 && body == NULL) return -1;
+            int total = 0;
+            for (int i = 0; i < n; i++) {
+                const SfpFstLst* e = &body->list.fstlstpositions[i];
+                int name_len = e->end_index - e->start_index + 1;
+                if (e->start_index != total || name_len < 0 ||
+                    e->end_index >= SFP_DL_PAGE_CHARS) return -1;
+                total += name_len;
+            }
+            if (m->dl_rep.paged) {
+                w_dl_paged(&w, &body->list, n > 0 ? n : 0);
+                break;
+            }
+            for (int i = 0; i < n; i++) {
+                const SfpFstLst* e = &body->list.fstlstpositions[i];
+                w_u8(&w, e->is_dir ? 1 : 0);
+                w_u16(&w, (unsigned)(e->end_index - e->start_index + 1));
+            }
+            w_bytes(&w, n > 0 ? body->list.allfilenames : "", n > 0 ? (size_t)total : 0);
+            break;
+        }
+        default:
+            w_i32(&w, m->dc_rep.path_len);
+    }
+    if (w.err) return -1;
+    count_copies(w.copies, w.copied);
+    return (int)w.len;
+}
+
+// Lê o path ou o handle de um RD/WR; retorna path_len (0 com handle)
+static int r_target(SfpReader* r, unsigned flags, int* handle, char* path) {
+    if (!(flags & SFP_WF_HANDLE)) return r_str(r, path, SFP_PATH_CAP);
+    *handle = r_i32(r);
+    if (*handle == 0) r->err = 1;
+    return 0;
+}
+
+// Lê o campo 'length' de um RD/WR, se presente
+static int r_length(SfpReader* r, unsigned flags) {
+    if (!(flags & SFP_WF_LENGTH)) return 0;
+    int length = r_i32(r);
+    if (length < 0 || length > SFP_MAX_PAYLOAD) r->err = 1;
+    return length;
+}
+
+// Listagem paginada (ver w_dl_paged): reconstrói cada nome a partir do
+// prefixo do anterior. Retorna 0 ou -1.
+static int r_dl_paged(SfpReader* r, SfpDlList* l, int n) {
+    int shared[SFP_DL_PAGE_NAMES], suffix[SFP_DL_PAGE_NAMES];
+    int total = 0;
+    for (int i = 0; i < n && !r->err; i++) {
+        l->fstlstpositions[i].is_dir = (int)r_u8(r);
+        shared[i] = (int)r_u8(r);
+        suffix[i] = (int)r_u16(r);
+    }
+    size_t blob = r_u16(r);
+    if (r->err || r->pos + blob > r->len) return -1;
+    const unsigned char* src = r->p + r->pos;
+    size_t used = 0;
+    for (int i = 0; i < n; i++) {
+        int prev_len = i > 0 ? l->fstlstpositions[i - 1].end_index - l->fstlstpositions[i - 1].start_index + 1 : 0;
+        int len = shared[i] + suffix[i];
+        if (shared[i] > prev_len || total + len > SFP_DL_PAGE_CHARS || used + (size_t)suffix[i] > blob) return -1;
+        if (shared[i] > 0) memmove(l->allfilenames + total, l->allfilenames + l->fstlstpositions[i - 1].start_index, (size_t)shared[i]);
+        memcpy(l->allfilenames + total + shared[i], src + used, (size_t)suffix[i]);
+        l->fstlstpositions[i].start_index = total;
+        l->fstlstpositions[i].end_index = total + len - 1;
+        used += (size_t)suffix[i];
+        total += len;
+    }
+    if (used != blob) return -1;
+    r->pos += blob;
+    r->copies += (unsigned)n;
+    r->copied += used;
+    return 0;
+}
+
+// Cabeçalho comum; retorna as flags
+static unsigned r_header(SfpReader* r, SfpHdr* h) {
+    if (r_u8(r) != SFP_WIRE_MAGIC || r_u8(r) != SFP_WIRE_VERSION) r->err = 1;
+    h->msg_type = (SfpMsgType)r_u8(r);
+    unsigned flags = r_u8(r);
+    h->owner = r_i32(r);
+    if (flags & SFP_WF_REQID) h->req_id = (unsigned long long)r_i64(r);
+    if (flags & SFP_WF_DEADLINE) {
+        h->sent_us = r_i64(r);
+        h->deadline_us = r_i64(r);
+    }
+    if (flags & SFP_WF_CREDITS) h->credits = r_u16(r);
+    return flags;
+}
+
+static int decode_compact(const unsigned char* buf, size_t len, SfpMsg* m, SfpBulk* body) {
+    SfpReader r = { buf, len, 0, 0, 0, 0 };
+    SfpHdr* h = &m->hdr;
+    unsigned flags = r_header(&r, h);
+    if (r.err) return -1;
+
+    switch (h->msg_type) {
+        case SFP_MSG_RD_REQ:
+        case SFP_MSG_TR_REQ:
+            m->rd_req.offset = r_i32(&r);
+            m->rd_req.length = r_length(&r, flags);
+            m->rd_req.path_len = r_target(&r, flags, &m->rd_req.handle, m->rd_req.path);
+            break;
+        case SFP_MSG_RD_REP:
+        case SFP_MSG_WR_REQ:
+        case SFP_MSG_AP_REQ: {
+            SfpWrReq* rw = &m->wr_req;
+            rw->offset = r_i32(&r);
+            rw->length = r_length(&r, flags);
+            rw->path_len = r_target(&r, flags, &rw->handle, rw->path);
+            if (rw->length <= SFP_PAYLOAD_SIZE) {
+                size_t got = r_bytes(&r, rw->payload, SFP_PAYLOAD_SIZE);
+                if (rw->length != 0 && got != (size_t)rw->length) return -1;
+            } else {
+                if (body == NULL) return -1;
+                if (r_bytes(&r, body->data, SFP_MAX_PAYLOAD) != (size_t)rw->length) return -1;
+            }
+            break;
+        }
+        case SFP_MSG_WR_REP:
+        case SFP_MSG_AP_REP:
+        case SFP_MSG_TR_REP:
+        case SFP_MSG_RN_REP:
+            m->wr_rep.offset = r_i32(&r);
+            m->wr_rep.length = r_length(&r, flags);
+            m->wr_rep.path_len = r_target(&r, flags, &m->wr_rep.handle, m->wr_rep.path);
+            break;
+        case SFP_MSG_CP_REP:
+            m->cp_rep.offset = r_i32(&r);
+            m->cp_rep.length = r_i32(&r);
+            if (m->cp_rep.length < 0) return -1;
+            m->cp_rep.path_len = r_target(&r, flags, &m->cp_rep.handle, m->cp_rep.path);
+            break;
+        case SFP_MSG_DC_REQ:
+        case SFP_MSG_DR_REQ:
+            m->dc_req.path_len = r_str(&r, m->dc_req.path, SFP_PATH_CAP);
+            m->dc_req.name_len = r_str(&r, m->dc_req.name, SFP_NAME_CAP);
+            break;
+        case SFP_MSG_CP_REQ:
+        case SFP_MSG_RN_REQ:
+            m->cp_req.offset = r_i32(&r);
+            m->cp_req.length = r_i32(&r);
+            m->cp_req.path_len = r_str(&r, m->cp_req.path, SFP_PATH_CAP);
+            m->cp_req.dst_len = r_str(&r, m->cp_req.dst, SFP_PATH_CAP);
+            break;
+        case SFP_MSG_DC_REP:
+        case SFP_MSG_DR_REP:
+        case SFP_MSG_WA_REP:
+        case SFP_MSG_UW_REP:
+            m->dc_rep.path_len = r_i32(&r);
+            r_str(&r, m->dc_rep.path, SFP_PATH_CAP);
+            break;
+        case SFP_MSG_NT_MSG:
+            m->nt.events = r_i32(&r);
+            m->nt.count = r_i32(&r);
+            m->nt.path_len = r_str(&r, m->nt.path, SFP_PATH_CAP);
+            m->nt.name_len = r_str(&r, m->nt.name, SFP_NAME_CAP);
+            break;
+        case SFP_MSG_DL_REQ:
+            m->dl_req.path_len = r_str(&r, m->dl_req.path, SFP_PATH_CAP);
+            if (flags & SFP_WF_PAGED) {
+                m->dl_req.paged = 1;
+                m->dl_req.cursor_len = r_str(&r, m->dl_req.cursor, SFP_NAME_CAP);
+            }
+            break;
+        case SFP_MSG_GA_REQ:
+        case SFP_MSG_OP_REQ:
+        case SFP_MSG_WA_REQ:
+        case SFP_MSG_UW_REQ:
+            m->ga_req.path_len = r_str(&r, m->ga_req.path, SFP_PATH_CAP);
+            break;
+        case SFP_MSG_OP_REP:
+        case SFP_MSG_CL_REQ:
+        case SFP_MSG_CL_REP:
+            m->op_rep.handle = r_i32(&r);
+            break;
+        case SFP_MSG_GA_REP:
+            m->ga_rep.status = r_i32(&r);
+            m->ga_rep.is_dir = (int)r_u8(&r);
+            m->ga_rep.size = r_i64(&r);
+            m->ga_rep.mtime = r_i64(&r);
+            m->ga_rep.version = (unsigned long long)r_i64(&r);
+            break;
+        case SFP_MSG_BT_REQ:
+        case SFP_MSG_BT_REP:
+            // Itens lidos à parte por sfp_decode_batch
+            m->bt.count = (int)r_u8(&r);
+            if (m->bt.count > SFP_MAX_BATCH) return -1;
+            break;
+        case SFP_MSG_HL_REQ:
+        case SFP_MSG_HL_REP:
+            m->hello.version = r_i32(&r);
+            m->hello.max_payload = r_i32(&r);
+            m->hello.max_batch = r_i32(&r);
+            m->hello.transports = r_i32(&r);
+            m->hello.features = r_i32(&r);
+            break;
+        case SFP_MSG_DL_REP: {
+            SfpDlList scratch;
+            SfpDlList* l = body != NULL ? &body->list : &scratch; // Sem destino: só valida
+            m->dl_rep.nrnames = r_i32(&r);
+            if (flags & SFP_WF_PAGED) {
+                m->dl_rep.paged = 1;
+                m->dl_rep.cursor_len = r_str(&r, m->dl_rep.cursor, SFP_NAME_CAP);
+            }
+            int n = m->dl_rep.nrnames > 0 ? m->dl_rep.nrnames : 0;
+            if (n > SFP_DL_PAGE_NAMES) return -1;
+            if (m->dl_rep.paged) {
+                if (r_dl_paged(&r, l, n) != 0) return -1;
+                break;
+            }
+            int total = 0;
+            for (int i = 0; i < n && !r.err; i++) {
+                l->fstlstpositions[i].is_dir = (int)r_u8(&r);
+                int name_len = (int)r_u16(&r);
+                l->fstlstpositions[i].start_index = total;
+                l->fstlstpositions[i].end_index = total + name_len - 1;
+                total += name_len;
+            }
+            if (total > SFP_DL_PAGE_CHARS) return -1;
+            if ((int)r_bytes(&r, l->allfilenames, SFP_DL_PAGE_CHARS) != total) return -1;
+            break;
+        }
+        default:
+            if (r.pos < r.len) m->dc_rep.path_len = r_i32(&r);
+    }
+    if (r.err) return -1;
+    count_copies(r.copies, r.copied);
+    return 0;
+}
+
+// --- Formato LEGACY (conversão de/para a struct SfpMessage) ---
+
+// O datagrama LEGACY tem de ser o mesmo das versões anteriores, byte a byte:
+// kernels e servidores antigos só aceitam exatamente este tamanho
+_Static_assert(sizeof(SfpMessage) == 3592, "SfpMessage mudou de tamanho: o formato LEGACY deixaria de ser compatível");
+_Static_assert(offsetof(SfpMessage, path_len) == 8, "layout LEGACY: path_len logo após msg_type/owner");
+_Static_assert(offsetof(SfpMessage, offset) == 1040, "layout LEGACY: offset após path e name");
+_Static_assert(offsetof(SfpMessage, nrnames) == 1060, "layout LEGACY: nrnames após payload");
+
+// Copia uma string para um campo menor; falha se não couber
+static int copy_str(char* dst, size_t cap, const char* src, size_t src_cap) {
+    size_t n = strnlen(src, src_cap);
+    if (n >= cap) return -1;
+    memcpy(dst, src, n);
+    dst[n] = '\0';
+    return (int)n;
+}
+
+// Tipos que o layout legado não tem (todos os posteriores ao DL_REP)
+static int compact_only(int type) {
+    return type >= SFP_MSG_BT_REQ && type < SFP_MSG_N_TYPES;
+}
+
+// O layout legado só transporta blocos de SFP_PAYLOAD_SIZE bytes, por path
+static int to_legacy(const SfpMsg* m, const SfpBulk* body, SfpMessage* o) {
+    int length = rw_length(m);
+    if (length != 0 && length != SFP_PAYLOAD_SIZE) return -1;
+    if (rw_handle(m) != 0) return -1;
+    if (compact_only(m->hdr.msg_type)) return -1;
+    memset(o, 0, sizeof(*o));
+    o->msg_type = m->hdr.msg_type;
+    o->owner = m->hdr.owner;
+
+    switch (m->hdr.msg_type) {
+        case SFP_MSG_RD_REQ:
+        case SFP_MSG_WR_REP:
+            o->offset = m->rd_req.offset;
+            o->path_len = m->rd_req.path_len;
+            copy_str(o->path, SFP_MAX_PATH_LEN, m->rd_req.path, SFP_PATH_CAP);
+            break;
+        case SFP_MSG_RD_REP:
+        case SFP_MSG_WR_REQ:
+            o->offset = m->wr_req.offset;
+            o->path_len = m->wr_req.path_len;
+            copy_str(o->path, SFP_MAX_PATH_LEN, m->wr_req.path, SFP_PATH_CAP);
+            memcpy(o->payload, m->wr_req.payload, SFP_PAYLOAD_SIZE);
+            break;
+        case SFP_MSG_DC_REQ:
+        case SFP_MSG_DR_REQ:
+            o->path_len = m->dc_req.path_len;
+            copy_str(o->path, SFP_MAX_PATH_LEN, m->dc_req.path, SFP_PATH_CAP);
+            o->name_len = m->dc_req.name_len;
+            copy_str(o->name, SFP_MAX_PATH_LEN, m->dc_req.name, SFP_NAME_CAP);
+            break;
+        case SFP_MSG_DC_REP:
+        case SFP_MSG_DR_REP:
+            o->path_len = m->dc_rep.path_len;
+            copy_str(o->path, SFP_MAX_PATH_LEN, m->dc_rep.path, SFP_PATH_CAP);
+            break;
+        case SFP_MSG_DL_REQ:
+            if (m->dl_req.paged) return -1;
+            o->path_len = m->dl_req.path_len;
+            copy_str(o->path, SFP_MAX_PATH_LEN, m->dl_req.path, SFP_PATH_CAP);
+            break;
+        case SFP_MSG_DL_REP:
+            // Sem cursor nem espaço para mais que SFP_MAX_NAMES_IN_DIR nomes
+            if (m->dl_rep.paged || m->dl_rep.nrnames > SFP_MAX_NAMES_IN_DIR) return -1;
+            o->nrnames = m->dl_rep.nrnames;
+            if (body != NULL) {
+                memcpy(o->fstlstpositions, body->list.fstlstpositions, sizeof(o->fstlstpositions));
+                memcpy(o->allfilenames, body->list.allfilenames, sizeof(o->allfilenames));
+            }
+            break;
+        default:
+            o->path_len = m->dc_rep.path_len;
+    }
+    return 0;
+}
+
+static int from_legacy(const SfpMessage* o, SfpMsg* m, SfpBulk* body) {
+    int ok = 0;
+    if (compact_only(o->msg_type)) return -1;
+    m->hdr.msg_type = o->msg_type;
+    m->hdr.owner = o->owner;
+
+    switch (o->msg_type) {
+        case SFP_MSG_RD_REQ:
+        case SFP_MSG_WR_REP:
+            m->rd_req.offset = o->offset;
+            ok = copy_str(m->rd_req.path, SFP_PATH_CAP, o->path, SFP_MAX_PATH_LEN);
+            m->rd_req.path_len = ok;
+            break;
+        case SFP_MSG_RD_REP:
+        case SFP_MSG_WR_REQ:
+            m->wr_req.offset = o->offset;
+            ok = copy_str(m->wr_req.path, SFP_PATH_CAP, o->path, SFP_MAX_PATH_LEN);
+            m->wr_req.path_len = ok;
+            memcpy(m->wr_req.payload, o->payload, SFP_PAYLOAD_SIZE);
+            break;
+        case SFP_MSG_DC_REQ:
+        case SFP_MSG_DR_REQ:
+            ok = copy_str(m->dc_req.path, SFP_PATH_CAP, o->path, SFP_MAX_PATH_LEN);
+            m->dc_req.path_len = ok;
+            m->dc_req.name_len = copy_str(m->dc_req.name, SFP_NAME_CAP, o->name, SFP_MAX_PATH_LEN);
+            if (m->dc_req.name_len < 0) ok = -1;
+            break;
+        case SFP_MSG_DC_REP:
+        case SFP_MSG_DR_REP:
+            m->dc_rep.path_len = o->path_len;
+            ok = copy_str(m->dc_rep.path, SFP_PATH_CAP, o->path, SFP_MAX_PATH_LEN);
+            break;
+        case SFP_MSG_DL_REQ:
+            ok = copy_str(m->dl_req.path, SFP_PATH_CAP, o->path, SFP_MAX_PATH_LEN);
+            m->dl_req.path_len = ok;
+            break;
+        case SFP_MSG_DL_REP:
+            m->dl_rep.nrnames = o->nrnames;
+            if (body != NULL) {
+                memcpy(body->list.fstlstpositions, o->fstlstpositions, sizeof(o->fstlstpositions));
+                memcpy(body->list.allfilenames, o->allfilenames, sizeof(o->allfilenames));
+            }
+            break;
+        default:
+            m->dc_rep.path_len = o->path_len;
+    }
+    return ok < 0 ? SFP_DECODE_LONG_PATH : 0;
+}
+
+// --- Interface ---
+
+int sfp_encode(const SfpMsg* msg, const SfpBulk* body, SfpWireMode mode,
+               unsigned char* buf, size_t cap) {
+    if (mode == SFP_WIRE_COMPACT) return encode_compact(msg, body, buf, cap, NULL);
+    if (cap < sizeof(SfpMessage)) return -1;
+    SfpMessage legacy;
+    if (to_legacy(msg, body, &legacy) != 0) return -1;
+    memcpy(buf, &legacy, sizeof(SfpMessage));
+    count_copies(1, sizeof(SfpMessage));
+    return (int)sizeof(SfpMessage);
+}
+
+int sfp_decode(const unsigned char* buf, size_t len, SfpMsg* msg, SfpBulk* body,
+               SfpWireMode* mode) {
+    memset(msg, 0, sizeof(SfpMsg));
+    if (len >= 8 && buf[0] == SFP_WIRE_MAGIC) {
+        if (mode != NULL) *mode = SFP_WIRE_COMPACT;
+        return decode_compact(buf, len, msg, body);
+    }
+    if (len != sizeof(SfpMessage)) return -1;
+    if (mode != NULL) *mode = SFP_WIRE_LEGACY;
+    SfpMessage legacy;
+    memcpy(&legacy, buf, sizeof(SfpMessage));
+    count_copies(1, sizeof(SfpMessage));
+    return from_legacy(&legacy, msg, body);
+}
+
+// --- Lotes (só no formato COMPACT) ---
+
+int sfp_encode_batch(const SfpMsg* hdr, const SfpBatch* batch, unsigned char* buf, size_t cap) {
+    SfpMsg head = *hdr;
+    head.bt.count = batch->count;
+    int len = encode_compact(&head, NULL, buf, cap, NULL);
+    if (len < 0) return -1;
+
+    size_t pos = (size_t)len;
+    for (int i = 0; i < batch->count; i++) {
+        SfpMsgType t = batch->items[i].hdr.msg_type;
+        if (t == SFP_MSG_BT_REQ || t == SFP_MSG_BT_REP || pos + 2 > cap) return -1;
+        // Cada item é uma mensagem COMPACT completa, prefixada pelo tamanho
+        int n = encode_compact(&batch->items[i], &batch->bodies[i], buf + pos + 2, cap - pos - 2, NULL);
+        if (n < 0 || n > 0xffff) return -1;
+        buf[pos] = (unsigned char)(n >> 8);
+        buf[pos + 1] = (unsigned char)n;
+        pos += 2 + (size_t)n;
+    }
+    return (int)pos;
+}
+
+int sfp_decode_batch(const unsigned char* buf, size_t len, SfpMsg* hdr, SfpBatch* batch) {
+    SfpReader r = { buf, len, 0, 0, 0, 0 };
+    memset(hdr, 0, sizeof(SfpMsg));
+    r_header(&r, &hdr->hdr);
+    if (r.err || (hdr->hdr.msg_type != SFP_MSG_BT_REQ && hdr->hdr.msg_type != SFP_MSG_BT_REP)) return -1;
+    batch->count = hdr->bt.count = (int)r_u8(&r);
+    if (r.err || batch->count > SFP_MAX_BATCH) return -1;
+
+    for (int i = 0; i < batch->count; i++) {
+        size_t n = r_u16(&r);
+        if (r.err || n < 8 || r.pos + n > r.len) return -1;
+        SfpMsg* item = &batch->items[i];
+        memset(item, 0, sizeof(SfpMsg));
+        if (decode_compact(r.p + r.pos, n, item, &batch->bodies[i]) != 0) return -1;
+        if (item->hdr.msg_type == SFP_MSG_BT_REQ || item->hdr.msg_type == SFP_MSG_BT_REP) return -1;
+        r.pos += n;
+    }
+    return 0;
+}
+
+// --- Visão sem cópia e envio em dois iovecs ---
+
+int sfp_view(const unsigned char* buf, size_t len, SfpView* v) {
+    SfpReader r = { buf, len, 0, 0, 0, 0 };
+    memset(v, 0, sizeof(*v));
+    if (len < 8 || buf[0] != SFP_WIRE_MAGIC) return 1;
+    v->flags = r_header(&r, &v->hdr);
+    if (r.err) return -1;
+
+    int has_data = 0;
+    switch (v->hdr.msg_type) {
+        case SFP_MSG_RD_REP:
+        case SFP_MSG_WR_REQ:
+        case SFP_MSG_AP_REQ:
+            has_data = 1;
+            break;
+        case SFP_MSG_RD_REQ:
+        case SFP_MSG_TR_REQ:
+        case SFP_MSG_WR_REP:
+        case SFP_MSG_AP_REP:
+        case SFP_MSG_TR_REP:
+        case SFP_MSG_RN_REP:
+            break;
+        default:
+            return 1; // Demais tipos (inclusive CP-REP): sfp_decode
+    }
+    v->offset = r_i32(&r);
+    v->length = r_length(&r, v->flags);
+    if (v->flags & SFP_WF_HANDLE) {
+        v->handle = r_i32(&r);
+        if (v->handle == 0) return -1;
+    } else {
+        size_t n = r_u16(&r);
+        if (r.err || n > SFP_PATH_CAP - 1 || r.pos + n > len) return -1;
+        v->path = (const char*)buf + r.pos;
+        v->path_len = (int)n;
+        r.pos += n;
+    }
+    if (has_data) {
+        size_t n = r_u16(&r);
+        if (r.err || r.pos + n > len) return -1;
+        if (v->length == 0 ? n > SFP_PAYLOAD_SIZE : n != (size_t)v->length) return -1;
+        v->data = buf + r.pos;
+        v->data_len = (int)n;
+        r.pos += n;
+    }
+    if (r.err) return -1;
+    __atomic_add_fetch(&counters.views, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+void sfp_view_to_msg(const SfpView* v, SfpMsg* msg) {
+    unsigned n = 0;
+    size_t bytes = 0;
+    memset(msg, 0, sizeof(SfpMsg));
+    msg->hdr = v->hdr;
+    // RD_REQ/WR_REP e RD_REP/WR_REQ têm o mesmo prefixo (offset..path)
+    SfpWrReq* rw = &msg->wr_req;
+    rw->offset = v->offset;
+    rw->length = v->length;
+    rw->handle = v->handle;
+    rw->path_len = v->path_len;
+    if (v->path_len > 0) {
+        memcpy(rw->path, v->path, (size_t)v->path_len);
+        n++;
+        bytes += (size_t)v->path_len;
+    }
+    if (v->data != NULL && v->data_len <= SFP_PAYLOAD_SIZE && v->length <= SFP_PAYLOAD_SIZE) {
+        memcpy(rw->payload, v->data, (size_t)v->data_len);
+        n++;
+        bytes += (size_t)v->data_len;
+    }
+    count_copies(n, bytes);
+}
+
+int sfp_encode_iov(const SfpMsg* msg, const SfpBulk* body, SfpWireMode mode,
+                   unsigned char* buf, size_t cap, struct iovec iov[2]) {
+    const void* tail = NULL;
+    int len = mode == SFP_WIRE_COMPACT ? encode_compact(msg, body, buf, cap, &tail)
+                                       : sfp_encode(msg, body, mode, buf, cap);
+    if (len < 0) return -1;
+    iov[0].iov_base = buf;
+    iov[0].iov_len = (size_t)len;
+    if (tail == NULL) return 1;
+    iov[1].iov_base = (void*)tail;
+    iov[1].iov_len = (size_t)msg->wr_req.length;
+    __atomic_add_fetch(&counters.scatter_sends, 1, __ATOMIC_RELAXED);
+    return 2;
+}
+
+void sfp_codec_counters(SfpCodecCounters* out) {
+    out->copies = __atomic_load_n(&counters.copies, __ATOMIC_RELAXED);
+    out->bytes_copied = __atomic_load_n(&counters.bytes_copied, __ATOMIC_RELAXED);
+    out->views = __atomic_load_n(&counters.views, __ATOMIC_RELAXED);
+    out->scatter_sends = __atomic_load_n(&counters.scatter_sends, __ATOMIC_RELAXED);
+}
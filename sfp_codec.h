@@ -0,0 +1,153 @@
+#ifndef SFP_CODEC_H
+#define SFP_CODEC_H
+
+#include <stddef.h>
+#include <sys/uio.h>
+#include "sfp_protocol.h"
+
+// --- Codificação SFP no Fio ---
+//
+// Dois formatos convivem:
+//
+// * LEGACY: o datagrama é a struct SfpMessage inteira (~3.6 KB), como nas
+//   versões anteriores. Mantido por compatibilidade; o codec converte de/para
+//   as structs por tipo (um path sem '\0' dentro do campo é recusado).
+//
+// * COMPACT: cabeçalho fixo pequeno seguido apenas dos campos que o tipo
+//   da mensagem usa. Inteiros em ordem de rede (big-endian); strings e
+//   blocos de bytes prefixados por um u16 com o tamanho (sem '\0').
+//
+//   Cabeçalho (8 bytes):
+//     u8  magic (SFP_WIRE_MAGIC)   u8 version   u8 msg_type   u8 flags
+//     i32 owner
+//   Se flags & SFP_WF_REQID:    u64 req_id
+//   Se flags & SFP_WF_DEADLINE: i64 sent_us, i64 deadline_us
+//   Se flags & SFP_WF_CREDITS:  u16 credits
+//
+//   Corpo por tipo ([length] só com flags & SFP_WF_LENGTH; 'alvo' é
+//   i32 handle com flags & SFP_WF_HANDLE, senão str path):
+//     RD_REQ  i32 offset, [i32 length], alvo
+//     RD_REP  i32 offset, [i32 length], alvo, bytes dados
+//     WR_REQ  i32 offset, [i32 length], alvo, bytes dados
+//     WR_REP  i32 offset, [i32 length], alvo
+//     DC_REQ  str path, str name          DR_REQ  str path, str name
+//     DC_REP  i32 path_len, str path      DR_REP  i32 path_len, str path
+//     DL_REQ  str path, [str cursor]      GA_REQ  str path
+//     GA_REP  i32 status, u8 is_dir, i64 size, i64 mtime, u64 version
+//     OP_REQ  str path                    OP_REP  i32 handle
+//     CL_REQ  i32 handle                  CL_REP  i32 handle
+//     AP_REQ  como WR_REQ                 TR_REQ  como RD_REQ
+//     AP/TR/CP/RN_REP  como WR_REP
+//     CP_REQ  i32 offset, i32 length, str path, str dst
+//     RN_REQ  idem (offset e length ignorados)
+//     WA_REQ  str path                    UW_REQ  str path
+//     WA_REP  como DC_REP                 UW_REP  como DC_REP
+//     NT_MSG  i32 events, i32 count, str path, str name
+//     DL_REP  i32 nrnames, nrnames x (u8 is_dir, u16 name_len), bytes allfilenames
+//             com SFP_WF_PAGED: i32 nrnames, str cursor,
+//             nrnames x (u8 is_dir, u8 shared, u16 suffix_len), bytes sufixos
+//             (cada nome = 'shared' bytes iniciais do anterior + seu sufixo)
+//     BT_REQ  u8 count, count x (u16 len, mensagem COMPACT completa)
+//     BT_REP  idem, com as sub-respostas na ordem das sub-requisições
+//     HL_REQ  i32 version, i32 max_payload, i32 max_batch, i32 transports,
+//             i32 features                HL_REP  idem
+//     outros  i32 path_len (resposta genérica de erro)
+//
+//   [cursor] só com flags & SFP_WF_PAGED (DL_REQ/DL_REP paginados).
+//   Sem 'length', os dados de RD_REP/WR_REQ são o bloco de 16 bytes com os
+//   zeros finais omitidos; com 'length', exatamente 'length' bytes.
+//
+// O decodificador reconhece os dois formatos pelo primeiro byte e pelo
+// tamanho do datagrama, então um lado pode responder no formato recebido.
+
+#define SFP_WIRE_MAGIC   0xF5
+#define SFP_WIRE_VERSION 1
+
+#define SFP_WF_DEADLINE  0x01 // sent_us/deadline_us presentes
+#define SFP_WF_LENGTH    0x02 // RD/WR com campo 'length' (transferência variável)
+#define SFP_WF_REQID     0x04 // req_id presente
+#define SFP_WF_HANDLE    0x08 // RD/WR com 'handle' no lugar de 'path'
+#define SFP_WF_PAGED     0x10 // DL paginado: cursor e nomes com prefixo comprimido
+#define SFP_WF_CREDITS   0x20 // credits presente (respostas)
+
+// Maior datagrama possível em qualquer formato (um lote de DL-REPs cheios
+// passa do SfpMessage legado; o teto é o maior payload UDP/IPv4)
+#define SFP_WIRE_MAX     65507
+
+typedef enum {
+    SFP_WIRE_LEGACY  = 0,
+    SFP_WIRE_COMPACT = 1
+} SfpWireMode;
+
+// Codifica 'msg' em 'buf'. 'body' é o corpo externo (listagem do DL-REP ou
+// dados de RD/WR acima de SFP_PAYLOAD_SIZE; pode ser NULL nos demais casos).
+// Retorna o tamanho do datagrama ou -1 se não couber (ou se o formato LEGACY
+// não puder representar a mensagem).
+int sfp_encode(const SfpMsg* msg, const SfpBulk* body, SfpWireMode mode,
+               unsigned char* buf, size_t cap);
+
+// Decodifica o datagrama 'buf' (len bytes) em 'msg', zerando os campos não
+// transmitidos e garantindo path/name terminados em '\0'. O corpo externo
+// vai para 'body' (a listagem é descartada se NULL; dados grandes exigem
+// 'body'). Se 'mode' não for NULL, recebe o formato detectado.
+// Retorna 0, -1 (datagrama malformado) ou SFP_DECODE_LONG_PATH: layout
+// legado bem formado cujo path/name (até SFP_MAX_PATH_LEN) não cabe nos
+// campos; 'msg' traz o cabeçalho, para uma resposta SFP_ERR_PATH.
+#define SFP_DECODE_LONG_PATH -2
+int sfp_decode(const unsigned char* buf, size_t len, SfpMsg* msg, SfpBulk* body,
+               SfpWireMode* mode);
+
+// HELLO, GETATTR, OPEN/CLOSE, RD/WR por handle, APPEND/TRUNCATE/COPY/
+// RENAME e WATCH/UNWATCH/NOTIFY também só existem no formato COMPACT.
+
+// Lotes (BT-REQ/BT-REP), só no formato COMPACT. 'hdr' dá tipo, owner e prazo
+// do lote; os itens vêm de 'batch'. Retorna o tamanho do datagrama ou -1.
+int sfp_encode_batch(const SfpMsg* hdr, const SfpBatch* batch, unsigned char* buf, size_t cap);
+
+// Decodifica um lote: cabeçalho em 'hdr' e itens (com seus corpos) em 'batch'.
+// sfp_decode num lote só preenche 'hdr.bt'. Retorna 0 ou -1 (malformado).
+int sfp_decode_batch(const unsigned char* buf, size_t len, SfpMsg* hdr, SfpBatch* batch);
+
+// --- Visão sem cópia ---
+//
+// sfp_view valida no próprio buffer um datagrama COMPACT de RD/WR/AP/TR
+// (requisição ou resposta, e as respostas de CP/RN) e devolve ponteiros
+// para dentro dele: nada é copiado nem zerado. O buffer precisa continuar
+// vivo enquanto a visão for usada. 'path' não termina em '\0'.
+typedef struct {
+    SfpHdr hdr;
+    unsigned flags;             // SFP_WF_* do datagrama
+    int offset, length, handle;
+    const char* path;           // NULL com handle
+    int path_len;
+    const unsigned char* data;  // Dados de RD_REP/WR_REQ/AP_REQ (NULL nos demais)
+    int data_len;
+} SfpView;
+
+// Retorna 0 (visão válida), -1 (malformado) ou 1 (formato LEGACY ou tipo
+// sem visão: use sfp_decode).
+int sfp_view(const unsigned char* buf, size_t len, SfpView* v);
+
+// Preenche 'msg' a partir da visão, copiando só o path e dados de até
+// SFP_PAYLOAD_SIZE bytes; dados maiores continuam em v->data.
+void sfp_view_to_msg(const SfpView* v, SfpMsg* msg);
+
+// Como sfp_encode, mas para envio com sendmsg: iov[0] aponta para o
+// cabeçalho e campos escritos em 'buf' e, nos dados grandes de RD_REP/
+// WR_REQ/AP_REQ COMPACT, iov[1] aponta direto para body->data, sem montar
+// o datagrama inteiro. Retorna o número de iovecs (1 ou 2) ou -1.
+int sfp_encode_iov(const SfpMsg* msg, const SfpBulk* body, SfpWireMode mode,
+                   unsigned char* buf, size_t cap, struct iovec iov[2]);
+
+// Contadores acumulados do codec (relaxados; seguros entre threads).
+// O codec não aloca memória: só copia entre structs e datagramas.
+typedef struct {
+    unsigned long long copies;        // Blocos copiados (strings, dados, listagens, layout legado)
+    unsigned long long bytes_copied;
+    unsigned long long views;         // Datagramas lidos por sfp_view
+    unsigned long long scatter_sends; // Envios com os dados em iovec separado
+} SfpCodecCounters;
+
+void sfp_codec_counters(SfpCodecCounters* out);
+
+#endif // SFP_CODEC_H
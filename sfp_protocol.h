@@ -1,16 +1,31 @@
 #ifndef SFP_PROTOCOL_H
 #define SFP_PROTOCOL_H
 
+#include <stddef.h>
+#include <time.h>
+
 // --- Constantes Globais Baseadas no Enunciado ---
 
-// Leitura e escrita são sempre em blocos de 16 bytes
+// Leitura e escrita são, por padrão, em blocos de 16 bytes
 #define SFP_PAYLOAD_SIZE 16
-// Um diretório pode ter no máximo 40 nomes
+// Maior transferência de um RD/WR com 'length' (cabe num datagrama UDP sem fragmentar)
+#define SFP_MAX_PAYLOAD 1024
+// Máximo de sub-requisições num BT-REQ
+#define SFP_MAX_BATCH 8
+// Versão do protocolo anunciada no HELLO (servidores sem HELLO falam só o
+// SfpMessage fixo, a "versão 1")
+#define SFP_PROTO_VERSION 2
+// Um DL-REP sem paginação (e o layout LEGACY) traz no máximo 40 nomes
 #define SFP_MAX_NAMES_IN_DIR 40
 // Tamanho máximo do path. O enunciado sugere não ser longo
 #define SFP_MAX_PATH_LEN 512
-// Tamanho máximo para o buffer de 'allfilenames' do DL-REP
+// Tamanho máximo para o buffer de 'allfilenames' do DL-REP sem paginação
 #define SFP_MAX_ALLFILENAMES_LEN 2048
+// Página de um DL-REP paginado: até SFP_DL_PAGE_NAMES nomes, somando até
+// SFP_DL_PAGE_CHARS caracteres e cabendo em SFP_DL_PAGE_BYTES no fio
+#define SFP_DL_PAGE_NAMES 128
+#define SFP_DL_PAGE_CHARS 4096
+#define SFP_DL_PAGE_BYTES 1024
 
 // --- Códigos de Erro (para status_code ou offset/nrnames) ---
 // Usados em campos de resposta como 'offset', 'path_len' ou 'nrnames'
@@ -19,6 +34,12 @@
 #define SFP_ERR_NOT_FOUND  -2 // Arquivo ou diretório não encontrado
 #define SFP_ERR_OFFSET_OOB -3 // Offset (posição) fora dos limites do arquivo
 #define SFP_ERR_IO         -4 // Erro genérico de I/O
+#define SFP_ERR_CORRUPT    -5 // Checksum do bloco não confere (dado corrompido)
+#define SFP_ERR_QUOTA      -6 // Cota de bytes/inodes da área esgotada
+#define SFP_ERR_EXPIRED    -7 // Prazo do cliente venceu antes do atendimento
+#define SFP_ERR_BAD_HANDLE -8 // Handle inexistente, fechado, expirado ou de outro owner
+#define SFP_ERR_TIMEOUT    -9 // Sem resposta do servidor (o kernel desistiu após retransmitir)
+#define SFP_ERR_PATH       -10 // Path ou nome não cabe no campo do SFP (mais de SFP_MAX_PATH_LEN - 1 caracteres)
 #define SFP_ERR_UNKNOWN_MSG -100 // Mensagem desconhecida
 
 // --- Tipos de Mensagem SFP ---
@@ -36,7 +57,38 @@ typedef enum {
     SFP_MSG_DR_REQ, // Directory Remove Request
     SFP_MSG_DR_REP, // Directory Remove Reply
     SFP_MSG_DL_REQ, // Directory List Request
-    SFP_MSG_DL_REP  // Directory List Reply
+    SFP_MSG_DL_REP, // Directory List Reply
+    // Batch
+    SFP_MSG_BT_REQ, // Batch Request (N sub-requisições)
+    SFP_MSG_BT_REP, // Batch Reply (N sub-respostas, na mesma ordem)
+    // Negotiation
+    SFP_MSG_HL_REQ, // Hello Request (capacidades do cliente)
+    SFP_MSG_HL_REP, // Hello Reply (capacidades do servidor)
+    // Metadata
+    SFP_MSG_GA_REQ, // Get Attributes Request
+    SFP_MSG_GA_REP, // Get Attributes Reply (tamanho, tipo, mtime, versão)
+    // Handles
+    SFP_MSG_OP_REQ, // Open Request (valida o path uma vez)
+    SFP_MSG_OP_REP, // Open Reply (handle)
+    SFP_MSG_CL_REQ, // Close Request
+    SFP_MSG_CL_REP, // Close Reply
+    // Server-side File Operations
+    SFP_MSG_AP_REQ, // Append Request (o servidor escolhe o offset)
+    SFP_MSG_AP_REP, // Append Reply
+    SFP_MSG_TR_REQ, // Truncate Request
+    SFP_MSG_TR_REP, // Truncate Reply
+    SFP_MSG_CP_REQ, // Copy Request (trecho ou arquivo inteiro)
+    SFP_MSG_CP_REP, // Copy Reply
+    SFP_MSG_RN_REQ, // Rename Request
+    SFP_MSG_RN_REP, // Rename Reply
+
+    SFP_MSG_WA_REQ, // Watch Request (assina mudanças de um path)
+    SFP_MSG_WA_REP, // Watch Reply
+    SFP_MSG_UW_REQ, // Unwatch Request
+    SFP_MSG_UW_REP, // Unwatch Reply
+    SFP_MSG_NT_MSG, // Notify (enviada pelo servidor por conta própria; sem resposta)
+
+    SFP_MSG_N_TYPES // Quantidade de tipos (não é uma mensagem)
 } SfpMsgType;
 
 // --- Estrutura para DL-REP (Listar Diretório) ---
@@ -49,38 +101,369 @@ typedef struct {
     int is_dir;      // 0 para Arquivo (F), 1 para Diretório (D)
 } SfpFstLst;
 
-// --- A Mensagem SFP Principal ---
+// --- Mensagens por Tipo ---
+//
+// Cada tipo de mensagem tem sua própria struct, só com os campos que usa,
+// reunidas na união SfpMsg (o tipo vem em hdr.msg_type). Os campos fixos
+// vêm antes dos paths, na primeira linha de cache; só a listagem do DL-REP
+// (SfpDlList) carrega os buffers grandes, e ela viaja fora da união.
+
+// Capacidade (com '\0') dos paths e nomes nas structs por tipo: a mesma do
+// layout antigo, então todo path que as versões anteriores aceitavam cabe.
+// No fio (COMPACT) eles vão prefixados pelo tamanho, sem os bytes livres.
+#define SFP_PATH_CAP SFP_MAX_PATH_LEN
+#define SFP_NAME_CAP SFP_MAX_PATH_LEN
 
-// Esta struct única é usada para TODAS as 10 mensagens.
-// Campos não utilizados por um tipo de msg específico serão ignorados.
-// Ela também é usada como a struct da MEMÓRIA COMPARTILHADA (shmem)
+// Cabeçalho comum a todos os tipos
 typedef struct {
-    // --- Cabeçalho Comum ---
-    SfpMsgType msg_type; // Tipo da mensagem (RD_REQ, RD_REP, etc.)
-    int owner;           // Processo de aplicação (A1=1, A2=2, ...)
+    SfpMsgType msg_type : 8; // Tipo da mensagem (RD_REQ, RD_REP, etc.; no fio é um u8)
+    // Créditos (só em respostas): quantas requisições o cliente pode manter
+    // pendentes neste servidor (0 = não informado, sem limite). Divide a
+    // palavra com msg_type para o cabeçalho continuar em 32 bytes.
+    unsigned credits : 16;
+    int owner;               // Processo de aplicação (A1=1, A2=2, ...)
+
+    // Identificador escolhido pelo cliente e ecoado na resposta: casa cada
+    // resposta com sua requisição mesmo com várias pendentes por owner,
+    // completadas fora de ordem ou retransmitidas (0 = sem id; aí só o
+    // owner identifica). O formato LEGACY não o transporta.
+    unsigned long long req_id;
+
+    // --- Prazo (opcional, em µs de CLOCK_REALTIME; ver sfp_now_us) ---
+    // Como o req_id, só viaja no formato COMPACT.
+    long long sent_us;     // Instante de envio da requisição (0 = não informado)
+    long long deadline_us; // Após este instante o cliente desistiu (0 = sem prazo)
+} SfpHdr;
+
+// --- Status da Operação (para REPs) ---
+// Em toda resposta o primeiro campo após o cabeçalho é o status
+// (valor negativo = código de erro):
+// Em RD/WR/AP/TR/CP/RN-REP: o campo 'offset'
+// Em DC/DR-REP: o campo 'path_len'
+// Em DL-REP: o campo 'nrnames' (nomes desta página)
+// Em GA-REP: o campo 'status'
+// Em OP/CL-REP: o campo 'handle'
+// Em WA/UW-REP: o campo 'path_len'
+
+// --- Handles ---
+// Um OPEN valida o path uma única vez e devolve um handle (> 0). RD/WR com
+// 'handle' != 0 usam o arquivo do handle e ignoram 'path'; na resposta o
+// handle é ecoado. O handle vale só para o owner e o cliente que o abriram
+// e expira após um tempo sem uso ou quando o cliente reinicia (novo HELLO).
+
+// --- Listagem paginada (DL com 'paged') ---
+// Os nomes vêm em ordem (strcmp), então páginas sucessivas não repetem nem
+// pulam nomes que existiam durante toda a listagem. O DL-REP devolve em
+// 'cursor' o último nome da página ("" = fim); o próximo DL-REQ o envia de
+// volta e recebe os nomes seguintes. No fio os nomes vão com o prefixo
+// comum ao nome anterior omitido (sfp_codec.h). Sem 'paged', o DL-REP é o
+// antigo: até SFP_MAX_NAMES_IN_DIR nomes, o resto descartado.
+
+// --- Operações de arquivo no servidor ---
+// Cada uma troca um laço de RD/WR de 16 bytes por uma única ida e volta:
+// AP-REQ  (layout do WR-REQ) acrescenta os dados ao fim do arquivo; 'offset'
+//         é ignorado e o AP-REP devolve em 'offset' onde os dados ficaram.
+// TR-REQ  (layout do RD-REQ) muda o tamanho do arquivo para 'offset' bytes.
+// CP-REQ  substitui 'dst' pelos bytes [offset, offset+length) de 'path'
+//         (length 0 = até o fim); o CP-REP devolve em 'length' os bytes copiados.
+// RN-REQ  renomeia o arquivo 'path' para 'dst' (substituindo 'dst' se existir).
+// AP/TR aceitam 'handle' como RD/WR; AP/TR/CP/RN-REP usam o layout do WR-REP.
+
+// --- Assinaturas (WATCH/UNWATCH) e NOTIFY ---
+// WA-REQ assina 'path' (arquivo ou diretório) para o owner e o endereço de
+// quem pediu; UW-REQ cancela. Quando o servidor muda o path ou uma entrada
+// direta do diretório assinado (DC, DR, WR e as operações de arquivo), ele
+// envia por conta própria um NT-MSG a cada assinante. Mudanças seguidas são
+// agrupadas: cada assinatura recebe no máximo um NT-MSG por intervalo (no
+// servidor, -N), com a união dos eventos e quantas mudanças houve. Com isso
+// um cliente com cache só revalida o que de fato mudou. Assinaturas caem
+// quando o cliente reinicia (novo HELLO), como os handles.
+#define SFP_NT_CREATED 0x01 // Entrada criada (DC; WR/AP/CP/RN que criou arquivo)
+#define SFP_NT_REMOVED 0x02 // Entrada removida (DR; WR de remoção; origem do RN)
+#define SFP_NT_WRITTEN 0x04 // Conteúdo ou tamanho mudou (WR/AP/TR/CP)
+
+// --- Tamanho das transferências RD/WR ('length') ---
+// 0 = bloco padrão de SFP_PAYLOAD_SIZE bytes, como nas versões anteriores.
+// Entre 1 e SFP_MAX_PAYLOAD: bytes pedidos (RD-REQ), enviados (WR-REQ),
+// lidos (RD-REP) ou escritos (WR-REP). Até SFP_PAYLOAD_SIZE bytes os dados
+// ficam em 'payload'; acima disso, no corpo externo (SfpBulk.data).
+
+// RD-REQ e WR-REP
+typedef struct {
+    SfpHdr hdr;
+    int offset;               // 0, 16, 32, etc. (ou código de erro no WR-REP)
+    int length;
+    int handle;               // Arquivo aberto com OPEN (0 = usa 'path')
+    int path_len;             // strlen(path)
+    char path[SFP_PATH_CAP];  // Ex: "/A1/MyDir/MyFile"
+} SfpRdReq, SfpWrRep, SfpTrReq;
 
-    // --- Status da Operação (para REPs) ---
-    // Usado para códigos de erro (valores negativos)
-    // Em RD/WR-REP: será o campo 'offset'
-    // Em DC/DR-REP: será o campo 'path_len'
-    // Em DL-REP: será o campo 'nrnames'
+// WR-REQ e RD-REP
+typedef struct {
+    SfpHdr hdr;
+    int offset;               // (ou código de erro no RD-REP)
+    int length;
+    int handle;               // Arquivo aberto com OPEN (0 = usa 'path')
+    int path_len;
+    char path[SFP_PATH_CAP];
+    char payload[SFP_PAYLOAD_SIZE]; // Dados (até 16 bytes)
+} SfpWrReq, SfpRdRep, SfpApReq;
+
+// DC-REQ e DR-REQ
+typedef struct {
+    SfpHdr hdr;
+    int path_len;
+    char path[SFP_PATH_CAP];  // Diretório base
+    int name_len;             // strlen(name)
+    char name[SFP_NAME_CAP];  // "dirname"
+} SfpDcReq, SfpDrReq;
+
+// DC-REP, DR-REP, WA-REP e UW-REP
+typedef struct {
+    SfpHdr hdr;
+    int path_len;             // (ou código de erro)
+    char path[SFP_PATH_CAP];  // Path criado (DC), diretório base (DR) ou assinado (WA/UW)
+} SfpDcRep, SfpDrRep, SfpWaRep, SfpUwRep;
+
+// CP-REQ e RN-REQ
+typedef struct {
+    SfpHdr hdr;
+    int offset;               // Início do trecho copiado (CP)
+    int length;               // Bytes copiados (CP; 0 = até o fim)
+    int path_len;
+    char path[SFP_PATH_CAP];  // Origem
+    int dst_len;
+    char dst[SFP_PATH_CAP];   // Destino
+} SfpCpReq, SfpRnReq;
+
+// AP-REP, TR-REP, CP-REP e RN-REP: mesmo layout do WR-REP
+typedef SfpWrRep SfpApRep, SfpTrRep, SfpCpRep, SfpRnRep;
+
+// DL-REQ
+typedef struct {
+    SfpHdr hdr;
+    int path_len;
+    char path[SFP_PATH_CAP];
+    int paged;                  // Cliente pagina e aceita nomes comprimidos
+    int cursor_len;
+    char cursor[SFP_NAME_CAP];  // Último nome já recebido ("" = início)
+} SfpDlReq;
+
+// GA-REQ, OP-REQ, WA-REQ e UW-REQ
+typedef struct {
+    SfpHdr hdr;
+    int path_len;
+    char path[SFP_PATH_CAP];
+} SfpGaReq, SfpOpReq, SfpWaReq, SfpUwReq;
+
+// NT-MSG: mudanças num path assinado desde a notificação anterior
+typedef struct {
+    SfpHdr hdr;               // owner = quem assinou; req_id = 0
+    int events;               // SFP_NT_* acumulados
+    int count;                // Mudanças agrupadas nesta notificação
+    int path_len;
+    char path[SFP_PATH_CAP];  // Path assinado
+    int name_len;
+    char name[SFP_NAME_CAP];  // Entrada do diretório que mudou ("" = o próprio path ou várias)
+} SfpNtMsg;
+
+// OP-REP, CL-REQ e CL-REP: só o handle (nas respostas, ou código de erro)
+typedef struct {
+    SfpHdr hdr;
+    int handle;
+} SfpOpRep, SfpClReq, SfpClRep;
+
+// DL-REP: contagem e cursor; os nomes seguem em SfpDlList
+typedef struct {
+    SfpHdr hdr;
+    int nrnames;              // Número de nomes nesta página (ou código de erro)
+    int paged;                // Ecoa o DL-REQ
+    int cursor_len;
+    char cursor[SFP_NAME_CAP]; // Onde continuar ("" = não há mais nomes)
+} SfpDlRep;
+
+// GA-REP: metadados de um arquivo ou diretório, sem abri-lo
+typedef struct {
+    SfpHdr hdr;
+    int status;               // SFP_SUCCESS ou código de erro
+    int is_dir;               // 0 para Arquivo, 1 para Diretório
+    long long size;           // Tamanho em bytes (0 em diretórios)
+    long long mtime;          // Última modificação (segundos desde a época)
+    unsigned long long version; // Muda a cada alteração feita pelo servidor
+} SfpGaRep;
+
+// Listagem que acompanha um DL-REP (cabe uma página inteira)
+typedef struct {
+    SfpFstLst fstlstpositions[SFP_DL_PAGE_NAMES]; // Array de posições
+    char allfilenames[SFP_DL_PAGE_CHARS];         // Nomes concatenados
+} SfpDlList;
+
+// Corpo externo à SfpMsg: a listagem de um DL-REP ou os dados de um
+// RD-REP/WR-REQ com mais de SFP_PAYLOAD_SIZE bytes
+typedef union {
+    SfpDlList list;
+    char data[SFP_MAX_PAYLOAD];
+} SfpBulk;
+
+// BT-REQ/BT-REP: só a contagem; os itens seguem em SfpBatch
+typedef struct {
+    SfpHdr hdr;
+    int count;                // Número de sub-mensagens
+} SfpBtHdr;
+
+// --- HELLO (negociação de capacidades) ---
+// Cada lado anuncia o que suporta; vale o que ambos suportam: o formato
+// mais rápido em comum e o menor dos limites.
+
+// Formatos no fio (ambos sobre UDP)
+#define SFP_TR_LEGACY  0x01 // SfpMessage fixo
+#define SFP_TR_COMPACT 0x02 // Codificação compacta (sfp_codec.h)
+
+// Recursos opcionais
+#define SFP_FEAT_DEADLINE 0x01 // sent_us/deadline_us respeitados
+#define SFP_FEAT_LENGTH   0x02 // RD/WR com 'length' acima de SFP_PAYLOAD_SIZE
+#define SFP_FEAT_BATCH    0x04 // BT-REQ/BT-REP
+#define SFP_FEAT_REQID    0x08 // req_id ecoado nas respostas
+#define SFP_FEAT_GETATTR  0x10 // GA-REQ/GA-REP
+#define SFP_FEAT_HANDLES  0x20 // OPEN/CLOSE e RD/WR por handle
+#define SFP_FEAT_FILEOPS  0x40 // APPEND, TRUNCATE, COPY e RENAME
+#define SFP_FEAT_DLPAGE   0x80 // DL paginado com cursor e nomes comprimidos
+#define SFP_FEAT_WATCH    0x100 // WATCH/UNWATCH e NT-MSG
+#define SFP_FEAT_CREDITS  0x200 // Créditos de controle de fluxo em hdr.credits
+
+// HL-REQ e HL-REP
+typedef struct {
+    SfpHdr hdr;
+    int version;     // SFP_PROTO_VERSION de quem envia
+    int max_payload; // Maior 'length' aceito em RD/WR
+    int max_batch;   // Máximo de itens por BT-REQ (1 = sem lotes)
+    int transports;  // SFP_TR_*
+    int features;    // SFP_FEAT_*
+} SfpHello;
+
+// União de todos os tipos; é o que circula em filas, PCBs e memória compartilhada
+typedef union {
+    SfpHdr   hdr;
+    SfpRdReq rd_req;
+    SfpRdRep rd_rep;
+    SfpWrReq wr_req;
+    SfpWrRep wr_rep;
+    SfpDcReq dc_req;
+    SfpDcRep dc_rep;
+    SfpDrReq dr_req;
+    SfpDrRep dr_rep;
+    SfpDlReq dl_req;
+    SfpDlRep dl_rep;
+    SfpGaReq ga_req;
+    SfpGaRep ga_rep;
+    SfpOpReq op_req;
+    SfpOpRep op_rep;
+    SfpClReq cl_req;
+    SfpClRep cl_rep;
+    SfpApReq ap_req;
+    SfpApRep ap_rep;
+    SfpTrReq tr_req;
+    SfpTrRep tr_rep;
+    SfpCpReq cp_req;
+    SfpCpRep cp_rep;
+    SfpRnReq rn_req;
+    SfpRnRep rn_rep;
+    SfpWaReq wa_req;
+    SfpWaRep wa_rep;
+    SfpUwReq uw_req;
+    SfpUwRep uw_rep;
+    SfpNtMsg nt;
+    SfpBtHdr bt;
+    SfpHello hello;
+} SfpMsg;
+
+_Static_assert(offsetof(SfpWrReq, path) <= 64, "campos fixos das operações de arquivo na primeira linha de cache");
+_Static_assert(offsetof(SfpCpReq, path) <= 64, "campos fixos do CP/RN-REQ na primeira linha de cache");
+
+// Itens de um lote. Cada sub-mensagem é uma mensagem simples completa (com
+// cabeçalho e status próprios); lotes não se aninham.
+typedef struct {
+    int count;
+    SfpMsg  items[SFP_MAX_BATCH];
+    SfpBulk bodies[SFP_MAX_BATCH]; // Corpo externo de cada item (se houver)
+} SfpBatch;
+
+// Grava 'code' no campo de status do tipo de resposta de 'm'
+static inline void sfp_set_status(SfpMsg* m, int code) {
+    switch (m->hdr.msg_type) {
+        case SFP_MSG_RD_REP:
+            m->rd_rep.offset = code;
+            break;
+        case SFP_MSG_WR_REP:
+        case SFP_MSG_AP_REP:
+        case SFP_MSG_TR_REP:
+        case SFP_MSG_CP_REP:
+        case SFP_MSG_RN_REP:
+            m->wr_rep.offset = code;
+            break;
+        case SFP_MSG_DL_REP:
+            m->dl_rep.nrnames = code;
+            break;
+        case SFP_MSG_GA_REP:
+            m->ga_rep.status = code;
+            break;
+        case SFP_MSG_OP_REP:
+        case SFP_MSG_CL_REP:
+            m->op_rep.handle = code;
+            break;
+        default:
+            m->dc_rep.path_len = code;
+    }
+}
+
+// Bytes transferidos por um RD/WR com o campo 'length' dado
+static inline int sfp_rw_len(int length) {
+    return length > 0 ? length : SFP_PAYLOAD_SIZE;
+}
+
+// Dados de um RD-REP/WR-REQ: 'payload' ou, se não couberem, o corpo externo
+static inline const char* sfp_rw_data(const SfpWrReq* m, const SfpBulk* body) {
+    return sfp_rw_len(m->length) <= SFP_PAYLOAD_SIZE ? m->payload : body->data;
+}
+
+// --- Layout LEGACY ---
+
+// Struct única com os campos de TODAS as 10 mensagens, como nas versões
+// anteriores do protocolo. Hoje só descreve o datagrama no formato
+// SFP_WIRE_LEGACY (ver sfp_codec.h); em memória usa-se SfpMsg. O layout é
+// o dos kernels e servidores antigos, byte a byte: não há onde levar
+// req_id nem sent_us/deadline_us, que só viajam no formato COMPACT.
+typedef struct {
+    // --- Cabeçalho Comum ---
+    SfpMsgType msg_type;
+    int owner;
 
     // --- Campos de Path e Nome ---
-    int path_len;        // strlen(path)
-    char path[SFP_MAX_PATH_LEN]; // Ex: "/A1/MyDir/MyFile"
+    int path_len;
+    char path[SFP_MAX_PATH_LEN];
 
-    int name_len;        // strlen(name) - para DC-REQ, DR-REQ
-    char name[SFP_MAX_PATH_LEN]; // "dirname" em DC/DR
+    int name_len;
+    char name[SFP_MAX_PATH_LEN];
 
     // --- Campos de Operações de Arquivo (RD/WR) ---
-    int offset;          // 0, 16, 32, etc. (ou código de erro)
-    char payload[SFP_PAYLOAD_SIZE]; // Dados (16 bytes)
+    int offset;
+    char payload[SFP_PAYLOAD_SIZE];
 
     // --- Campos de Operações de Diretório (DL-REP) ---
-    int nrnames;         // Número de nomes no diretório (ou código de erro)
-    SfpFstLst fstlstpositions[SFP_MAX_NAMES_IN_DIR]; // Array de posições
-    char allfilenames[SFP_MAX_ALLFILENAMES_LEN];   // Nomes concatenados
+    int nrnames;
+    SfpFstLst fstlstpositions[SFP_MAX_NAMES_IN_DIR];
+    char allfilenames[SFP_MAX_ALLFILENAMES_LEN];
 
 } SfpMessage;
 
+// Relógio usado em sent_us/deadline_us (kernel e servidor na mesma base).
+// É o relógio de parede: sujeito a ajustes (NTP, data mudada à mão), serve
+// só para comparar carimbos entre as máquinas. Temporizadores locais
+// (retransmissão, RTT) usam CLOCK_MONOTONIC.
+static inline long long sfp_now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (long long)ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
 #endif // SFP_PROTOCOL_H
\ No newline at end of file
@@ -0,0 +1,111 @@
+// Harness de fuzzing do SFSS: cada entrada é um datagrama arbitrário, levado
+// pelo mesmo caminho do laço principal do servidor (sfp_view/sfp_decode,
+// lotes, despacho e codificação da resposta). A resposta é decodificada de
+// novo, como faria o kernel.
+//
+// libFuzzer:  make fuzz-libfuzzer && ./sfss_fuzz_lf corpus/
+// AFL:        make fuzz CC=afl-clang-fast && afl-fuzz -i seeds -o out ./sfss_fuzz
+// Reprodução: ./sfss_fuzz arquivo...   (sem argumentos, lê um datagrama do stdin)
+//
+// O servidor opera numa raiz temporária (ou em $SFSS_FUZZ_ROOT) e a saída
+// dos handlers vai para /dev/null. Sementes: ./sfp_bench -w seeds
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include "sfp_codec.h"
+#include "sfss_server.h"
+
+static int fuzz_ready = 0;
+
+static void fuzz_setup(void) {
+    static char root[] = "/tmp/sfss_fuzz_XXXXXX";
+    const char* dir = getenv("SFSS_FUZZ_ROOT");
+    if (dir == NULL) {
+        dir = mkdtemp(root);
+        if (dir == NULL) {
+            perror("mkdtemp");
+            exit(1);
+        }
+    }
+    for (int a = 0; a <= 5; a++) {
+        char area[512];
+        snprintf(area, sizeof(area), "%s/A%d", dir, a);
+        mkdir(area, 0755);
+    }
+    if (freopen("/dev/null", "w", stdout) == NULL) perror("freopen");
+    sfss_setup(dir, NULL);
+    fuzz_ready = 1;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+    static SfpMsg reply;
+    static SfpBulk reply_body;
+    static SfpBatch reply_batch;
+    static unsigned char joined[SFP_WIRE_MAX];
+    struct iovec iov[2];
+
+    if (!fuzz_ready) fuzz_setup();
+    if (size > SFP_WIRE_MAX) return 0; // Não cabe num datagrama UDP
+
+    int niov = sfss_serve_datagram(data, size, iov);
+    if (niov < 0) abort(); // Resposta que nem o próprio codec aceita
+    if (niov == 0) return 0;
+
+    // A resposta tem de ser legível pelo kernel: junta os iovecs e decodifica
+    size_t len = 0;
+    for (int i = 0; i < niov; i++) {
+        if (len + iov[i].iov_len > sizeof(joined)) abort();
+        memcpy(joined + len, iov[i].iov_base, iov[i].iov_len);
+        len += iov[i].iov_len;
+    }
+    SfpView view;
+    int vrc = sfp_view(joined, len, &view);
+    if (vrc < 0 || (vrc == 1 && sfp_decode(joined, len, &reply, &reply_body, NULL) != 0)) abort();
+    if (vrc == 1 && reply.hdr.msg_type == SFP_MSG_BT_REP &&
+        sfp_decode_batch(joined, len, &reply, &reply_batch) != 0) abort();
+
+    // NOTIFYs das assinaturas (intervalo ignorado: o relógio é adiantado)
+    static long long fake_now_us = 0;
+    struct sockaddr_in to;
+    int wait_ms, nlen;
+    fake_now_us += 3600LL * 1000000;
+    while ((nlen = sfss_next_notify(fake_now_us, joined, sizeof(joined), &to, &wait_ms)) > 0) {
+        if (sfp_decode(joined, (size_t)nlen, &reply, NULL, NULL) != 0 ||
+            reply.hdr.msg_type != SFP_MSG_NT_MSG) abort();
+    }
+    return 0;
+}
+
+#ifndef SFSS_LIBFUZZER
+// Driver para AFL e reprodução de casos: um datagrama por arquivo. A entrada
+// vai para um buffer do tamanho exato, para o ASan pegar leituras além do fim.
+static void run_file(FILE* f) {
+    static unsigned char buf[SFP_WIRE_MAX];
+    size_t n = fread(buf, 1, sizeof(buf), f);
+    unsigned char* exact = malloc(n > 0 ? n : 1);
+    if (exact == NULL) return;
+    memcpy(exact, buf, n);
+    LLVMFuzzerTestOneInput(exact, n);
+    free(exact);
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        run_file(stdin);
+        return 0;
+    }
+    for (int i = 1; i < argc; i++) {
+        FILE* f = fopen(argv[i], "rb");
+        if (f == NULL) {
+            perror(argv[i]);
+            continue;
+        }
+        run_file(f);
+        fclose(f);
+    }
+    return 0;
+}
+#endif // SFSS_LIBFUZZER
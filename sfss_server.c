@@ -5,92 +5,1394 @@
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include "sfp_protocol.h"
+#include "sfp_codec.h"
+#include "sfss_server.h"
 
 // --- Headers Adicionais ---
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <errno.h>
+#include <stdint.h>
+#include <poll.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
 
 #define SERVER_PORT 8888
-#define BUFFER_SIZE sizeof(SfpMessage)
+#define BUFFER_SIZE SFP_WIRE_MAX
 
 // Variável global para o diretório raiz
 const char* SFSS_ROOT_DIR = NULL;
 
-// --- T2-FIX: Nova Função de Validação de Permissão ---
-// Checa se o 'owner' pode acessar o 'path'
-// Retorna 1 (true) se permitido, 0 (false) se negado.
-int check_permission(int owner, const char* path, int path_len) {
-    // Constrói os dois prefixos válidos
-    char owner_prefix[10]; // Ex: /A5
-    snprintf(owner_prefix, 10, "/A%d", owner);
-    char shared_prefix[] = "/A0";
+// --- Tabela de Permissões por Owner ---
+// Número máximo de áreas /A<n> atendidas pelo servidor. A tabela é indexada
+// pelo número da área, então o custo por requisição não depende de quantos
+// owners existem.
+#define SFSS_MAX_OWNERS 4096
 
-    int owner_prefix_len = strlen(owner_prefix);
-    int shared_prefix_len = strlen(shared_prefix);
+typedef struct {
+    char prefix[12]; // Ex: "/A5" (pré-computado na inicialização)
+    int  prefix_len;
+} SfssOwner;
 
-    int is_owner_path = (strncmp(path, owner_prefix, owner_prefix_len) == 0);
-    int is_shared_path = (strncmp(path, shared_prefix, shared_prefix_len) == 0);
+static SfssOwner owner_tab[SFSS_MAX_OWNERS];
+static int sfss_root_len = 0;
 
-    int is_valid = 0;
+// Preenche os prefixos "/A<n>" uma única vez, na inicialização
+void init_owner_table(void) {
+    for (int n = 0; n < SFSS_MAX_OWNERS; n++) {
+        owner_tab[n].prefix_len = snprintf(owner_tab[n].prefix, sizeof(owner_tab[n].prefix), "/A%d", n);
+    }
+}
+
+// --- Validação de Path em Passada Única ---
+// Resultado da validação: a área /A<n> do path e o path normalizado
+// (sem "//", sem componentes "." e sem '/' final).
+typedef struct {
+    int  area;                    // n de /A<n> (0 = área compartilhada)
+    int  len;                     // strlen(norm)
+    char norm[SFP_MAX_PATH_LEN];  // Ex: "/A1/MyDir/MyFile"
+} SfssPath;
+
+// Sidecars de checksum (ver "Checksums CRC32C") ficam ocultos para os apps
+#define SFSS_CRC_SUFFIX ".sfsscrc"
+
+// 1 se o componente 'name' (len bytes) é um sidecar de checksums
+int is_crc_sidecar(const char* name, int len) {
+    int slen = sizeof(SFSS_CRC_SUFFIX) - 1;
+    return len > slen && name[0] == '.' && memcmp(name + len - slen, SFSS_CRC_SUFFIX, slen) == 0;
+}
+
+// Percorre o 'path' uma única vez: extrai o componente /A<n>, confere se o
+// 'owner' pode acessá-lo (n == owner ou n == 0), rejeita ".." e monta o path
+// normalizado em 'out'. Retorna 1 (true) se permitido, 0 (false) se negado.
+int validate_path(int owner, const char* path, SfssPath* out) {
+    if (owner < 0 || owner >= SFSS_MAX_OWNERS) return 0;
+
+    int i = 0;
+    while (i < SFP_MAX_PATH_LEN && path[i] == '/') i++;
+
+    // 1. Componente da área: "A" seguido de dígitos, sem zeros à esquerda
+    if (i >= SFP_MAX_PATH_LEN || path[i] != 'A') return 0;
+    int comp_start = i++;
+    int area = 0;
+    while (i < SFP_MAX_PATH_LEN && path[i] >= '0' && path[i] <= '9') {
+        area = area * 10 + (path[i] - '0');
+        if (area >= SFSS_MAX_OWNERS) return 0;
+        i++;
+    }
+    if (i >= SFP_MAX_PATH_LEN || (path[i] != '/' && path[i] != '\0')) return 0;
+    // "/A05" e "/A" não batem com o tamanho do prefixo canônico
+    if (i - comp_start != owner_tab[area].prefix_len - 1) return 0;
+    if (area != owner && area != 0) return 0;
+
+    memcpy(out->norm, owner_tab[area].prefix, owner_tab[area].prefix_len);
+    int len = owner_tab[area].prefix_len;
+
+    // 2. Demais componentes: copia, descartando "" e "." e rejeitando ".."
+    while (i < SFP_MAX_PATH_LEN && path[i] != '\0') {
+        while (i < SFP_MAX_PATH_LEN && path[i] == '/') i++;
+        comp_start = i;
+        while (i < SFP_MAX_PATH_LEN && path[i] != '/' && path[i] != '\0') i++;
+        if (i >= SFP_MAX_PATH_LEN) return 0; // path sem terminador
+        int comp_len = i - comp_start;
+        if (comp_len == 0) break;
+        if (comp_len == 1 && path[comp_start] == '.') continue;
+        if (comp_len == 2 && path[comp_start] == '.' && path[comp_start + 1] == '.') return 0;
+        if (is_crc_sidecar(&path[comp_start], comp_len)) return 0;
+        if (len + 1 + comp_len >= SFP_MAX_PATH_LEN) return 0;
+        out->norm[len++] = '/';
+        memcpy(&out->norm[len], &path[comp_start], comp_len);
+        len += comp_len;
+    }
+
+    out->norm[len] = '\0';
+    out->len = len;
+    out->area = area;
+    return 1;
+}
+
+// Valida o 'name' de DC/DR: um único componente, sem '/', "." ou ".."
+int validate_name(const char* name) {
+    int len = strnlen(name, SFP_MAX_PATH_LEN);
+    if (len == 0 || len >= SFP_MAX_PATH_LEN) return 0;
+    if (memchr(name, '/', len) != NULL) return 0;
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) return 0;
+    if (is_crc_sidecar(name, len)) return 0;
+    return 1;
+}
+
+// Monta "<raiz><rel>[/<name>]" em 'dst' reaproveitando os tamanhos já
+// conhecidos (não reprocessa o path validado). Retorna 0 se não couber.
+int join_root(char* dst, size_t cap, const char* rel, int rel_len, const char* name) {
+    size_t name_len = (name != NULL) ? strlen(name) : 0;
+    size_t need = sfss_root_len + rel_len + (name != NULL ? 1 + name_len : 0) + 1;
+    if (need > cap) return 0;
+
+    char* w = dst;
+    memcpy(w, SFSS_ROOT_DIR, sfss_root_len); w += sfss_root_len;
+    memcpy(w, rel, rel_len);                 w += rel_len;
+    if (name != NULL) {
+        *w++ = '/';
+        memcpy(w, name, name_len);           w += name_len;
+    }
+    *w = '\0';
+    return 1;
+}
+
+int build_full_path(char* dst, size_t cap, const SfssPath* p, const char* name) {
+    return join_root(dst, cap, p->norm, p->len, name);
+}
+
+
+// --- Índice de Metadados (nome/tamanho/tipo) ---
+// Mantém em memória o tipo, o tamanho e o mtime de cada item de sfss_root,
+// chaveado pelo path normalizado ("/A1/file.txt"). É construído na
+// inicialização (varredura paralela, uma thread por área /A<n>) e mantido
+// pelos handlers, evitando stat()/fseek() frios nas primeiras requisições.
+#define SFSS_INDEX_BUCKETS 4096
+#define SFSS_INDEX_MAGIC   "SFSSIDX1"
+
+typedef struct SfssIndexEntry {
+    struct SfssIndexEntry* next;
+    long long size;
+    long long mtime;   // segundos desde a época
+    unsigned long long version; // Valor de index_version na última alteração (GA-REP)
+    int  is_dir;
+    int  path_len;
+    char path[];       // path normalizado, terminado em '\0'
+} SfssIndexEntry;
+
+static SfssIndexEntry* index_tab[SFSS_INDEX_BUCKETS];
+static int index_count = 0;
+// Contador global de alterações: toda entrada inserida ou atualizada recebe
+// um valor novo, então a versão de um path muda mesmo se ele for removido
+// e recriado. Não é persistido.
+static unsigned long long index_version = 0;
+static pthread_mutex_t index_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// mtime de cada diretório /A<n> quando o índice foi montado (para validar
+// o índice persistido); -1 = área não indexada
+static long long area_mtime_ns[SFSS_MAX_OWNERS];
+static int index_persistent = 0; // 1 se o índice será salvo em arquivo (-i)
+
+static unsigned index_hash(const char* path, int len) {
+    unsigned h = 2166136261u; // FNV-1a
+    for (int i = 0; i < len; i++) {
+        h ^= (unsigned char)path[i];
+        h *= 16777619u;
+    }
+    return h % SFSS_INDEX_BUCKETS;
+}
+
+// Insere ou atualiza uma entrada. Chamador NÃO deve segurar index_lock.
+void index_put(const char* path, int len, long long size, long long mtime, int is_dir) {
+    unsigned b = index_hash(path, len);
+    pthread_mutex_lock(&index_lock);
+    SfssIndexEntry* e = index_tab[b];
+    while (e != NULL && !(e->path_len == len && memcmp(e->path, path, len) == 0)) e = e->next;
+    if (e == NULL) {
+        e = malloc(sizeof(SfssIndexEntry) + len + 1);
+        if (e == NULL) {
+            pthread_mutex_unlock(&index_lock);
+            return;
+        }
+        memcpy(e->path, path, len);
+        e->path[len] = '\0';
+        e->path_len = len;
+        e->next = index_tab[b];
+        index_tab[b] = e;
+        index_count++;
+    }
+    e->size = size;
+    e->mtime = mtime;
+    e->is_dir = is_dir;
+    e->version = ++index_version;
+    pthread_mutex_unlock(&index_lock);
+}
+
+// Copia a entrada para 'out'. Retorna 1 se encontrada, 0 caso contrário.
+int index_get(const char* path, int len, SfssIndexEntry* out) {
+    unsigned b = index_hash(path, len);
+    int found = 0;
+    pthread_mutex_lock(&index_lock);
+    for (SfssIndexEntry* e = index_tab[b]; e != NULL; e = e->next) {
+        if (e->path_len == len && memcmp(e->path, path, len) == 0) {
+            out->size = e->size;
+            out->mtime = e->mtime;
+            out->version = e->version;
+            out->is_dir = e->is_dir;
+            out->path_len = len;
+            found = 1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&index_lock);
+    return found;
+}
+
+void index_remove(const char* path, int len) {
+    unsigned b = index_hash(path, len);
+    pthread_mutex_lock(&index_lock);
+    SfssIndexEntry** pp = &index_tab[b];
+    while (*pp != NULL) {
+        SfssIndexEntry* e = *pp;
+        if (e->path_len == len && memcmp(e->path, path, len) == 0) {
+            *pp = e->next;
+            free(e);
+            index_count--;
+            break;
+        }
+        pp = &e->next;
+    }
+    pthread_mutex_unlock(&index_lock);
+}
+
+// Remove todas as entradas da área /A<n> (ela própria e tudo abaixo)
+static void index_drop_area(int area) {
+    const char* prefix = owner_tab[area].prefix;
+    int plen = owner_tab[area].prefix_len;
+    pthread_mutex_lock(&index_lock);
+    for (int b = 0; b < SFSS_INDEX_BUCKETS; b++) {
+        SfssIndexEntry** pp = &index_tab[b];
+        while (*pp != NULL) {
+            SfssIndexEntry* e = *pp;
+            if (e->path_len >= plen && memcmp(e->path, prefix, plen) == 0 &&
+                (e->path[plen] == '/' || e->path[plen] == '\0')) {
+                *pp = e->next;
+                free(e);
+                index_count--;
+            } else {
+                pp = &e->next;
+            }
+        }
+    }
+    pthread_mutex_unlock(&index_lock);
+}
+
+// --- Varredura Paralela de sfss_root ---
+
+typedef struct {
+    long long size;
+    long long mtime;
+    int  is_dir;
+    int  path_len;
+    char path[SFP_MAX_PATH_LEN];
+} SfssScanRec;
+
+typedef struct {
+    int          area;
+    pthread_t    tid;
+    SfssScanRec* recs;   // Registros coletados pela thread (mesclados depois)
+    int          nrecs, cap;
+} SfssScanJob;
+
+// Monta "<raiz>/A<n>" em 'dst'
+static void area_full_path(char* dst, size_t cap, int area) {
+    if (!join_root(dst, cap, owner_tab[area].prefix, owner_tab[area].prefix_len, NULL)) dst[0] = '\0';
+}
+
+static void scan_push(SfssScanJob* job, const char* path, int len, const struct stat* st) {
+    if (job->nrecs == job->cap) {
+        int new_cap = job->cap ? job->cap * 2 : 64;
+        SfssScanRec* r = realloc(job->recs, sizeof(SfssScanRec) * new_cap);
+        if (r == NULL) return;
+        job->recs = r;
+        job->cap = new_cap;
+    }
+    SfssScanRec* rec = &job->recs[job->nrecs++];
+    memcpy(rec->path, path, len + 1);
+    rec->path_len = len;
+    rec->size = S_ISDIR(st->st_mode) ? 0 : (long long)st->st_size;
+    rec->mtime = (long long)st->st_mtime;
+    rec->is_dir = S_ISDIR(st->st_mode) ? 1 : 0;
+}
+
+// Percorre recursivamente 'dirfd', cujo path normalizado é 'path' (len)
+static void scan_dir(SfssScanJob* job, int dirfd, char* path, int len) {
+    DIR* d = fdopendir(dirfd);
+    if (d == NULL) {
+        close(dirfd);
+        return;
+    }
+    struct dirent* de;
+    while ((de = readdir(d)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
+        int name_len = strlen(de->d_name);
+        if (is_crc_sidecar(de->d_name, name_len)) continue;
+        if (len + 1 + name_len >= SFP_MAX_PATH_LEN) continue;
+
+        struct stat st;
+        if (fstatat(dirfd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) continue;
+
+        path[len] = '/';
+        memcpy(&path[len + 1], de->d_name, name_len + 1);
+        scan_push(job, path, len + 1 + name_len, &st);
+        if (S_ISDIR(st.st_mode)) {
+            int child = openat(dirfd, de->d_name, O_RDONLY | O_DIRECTORY);
+            if (child >= 0) scan_dir(job, child, path, len + 1 + name_len);
+        }
+        path[len] = '\0';
+    }
+    closedir(d);
+}
+
+static void* scan_area_thread(void* arg) {
+    SfssScanJob* job = arg;
+    char full[SFP_MAX_PATH_LEN + 256];
+    area_full_path(full, sizeof(full), job->area);
+
+    struct stat st;
+    if (stat(full, &st) != 0) return NULL;
+    char path[SFP_MAX_PATH_LEN];
+    memcpy(path, owner_tab[job->area].prefix, owner_tab[job->area].prefix_len + 1);
+    scan_push(job, path, owner_tab[job->area].prefix_len, &st);
+
+    int fd = open(full, O_RDONLY | O_DIRECTORY);
+    if (fd >= 0) scan_dir(job, fd, path, owner_tab[job->area].prefix_len);
+    return NULL;
+}
+
+// Retorna o número da área se 'name' for "A<n>" canônico, senão -1
+static int parse_area_name(const char* name) {
+    if (name[0] != 'A' || name[1] == '\0') return -1;
+    int area = 0;
+    for (const char* c = name + 1; *c != '\0'; c++) {
+        if (*c < '0' || *c > '9') return -1;
+        area = area * 10 + (*c - '0');
+        if (area >= SFSS_MAX_OWNERS) return -1;
+    }
+    if ((int)strlen(name) != owner_tab[area].prefix_len - 1) return -1;
+    return area;
+}
+
+static long long stat_mtime_ns(const struct stat* st) {
+    return (long long)st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec;
+}
+
+// Lê o mtime atual do diretório /A<n> (-1 se não existir)
+static long long area_current_mtime(int area) {
+    char full[SFP_MAX_PATH_LEN + 256];
+    struct stat st;
+    area_full_path(full, sizeof(full), area);
+    return (stat(full, &st) == 0) ? stat_mtime_ns(&st) : -1;
+}
+
+// Criações/remoções feitas pelo servidor mudam o mtime da área. Chamado
+// antes (retorna 1 se a área ainda bate com o índice) e depois da operação
+// (registra o novo mtime), para que só mudanças externas forcem uma nova
+// varredura no próximo início com índice persistido.
+int area_sync_begin(int area) {
+    if (!index_persistent) return 0;
+    long long now = area_current_mtime(area);
+    pthread_mutex_lock(&index_lock);
+    int in_sync = (area_mtime_ns[area] >= 0 && area_mtime_ns[area] == now);
+    pthread_mutex_unlock(&index_lock);
+    return in_sync;
+}
+
+void area_sync_end(int area, int was_in_sync) {
+    if (!was_in_sync) return;
+    long long now = area_current_mtime(area);
+    pthread_mutex_lock(&index_lock);
+    area_mtime_ns[area] = now;
+    pthread_mutex_unlock(&index_lock);
+}
+
+// Varre em paralelo as áreas cujo 'want[area]' é 1 (uma thread por área)
+// e mescla os resultados no índice. Retorna o número de áreas varridas.
+static int scan_areas(const unsigned char* want) {
+    SfssScanJob* jobs = calloc(SFSS_MAX_OWNERS, sizeof(SfssScanJob));
+    if (jobs == NULL) return 0;
+    int njobs = 0;
+    for (int area = 0; area < SFSS_MAX_OWNERS; area++) {
+        if (!want[area]) continue;
+        // O mtime é lido antes da varredura: mudanças durante ela invalidam
+        // a área na próxima carga do índice persistido.
+        area_mtime_ns[area] = area_current_mtime(area);
+
+        jobs[njobs].area = area;
+        if (pthread_create(&jobs[njobs].tid, NULL, scan_area_thread, &jobs[njobs]) != 0) {
+            scan_area_thread(&jobs[njobs]); // Sem thread: varre na thread principal
+            jobs[njobs].tid = 0;
+        }
+        njobs++;
+    }
+    for (int j = 0; j < njobs; j++) {
+        if (jobs[j].tid != 0) pthread_join(jobs[j].tid, NULL);
+        index_drop_area(jobs[j].area);
+        for (int k = 0; k < jobs[j].nrecs; k++) {
+            SfssScanRec* r = &jobs[j].recs[k];
+            index_put(r->path, r->path_len, r->size, r->mtime, r->is_dir);
+        }
+        free(jobs[j].recs);
+    }
+    free(jobs);
+    return njobs;
+}
+
+// --- Persistência do Índice ---
+// Formato: magic, nº de áreas, (área, mtime_ns)*, nº de entradas,
+// (path_len, path, size, mtime, is_dir)*. Uma área cujo diretório mudou
+// desde o salvamento, ou com alguma entrada que não bate mais com o disco,
+// é varrida novamente na carga.
+
+int index_save(const char* file_path) {
+    char tmp_path[SFP_MAX_PATH_LEN + 16];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", file_path);
+    FILE* f = fopen(tmp_path, "wb");
+    if (f == NULL) {
+        perror("Servidor: ERRO ao salvar índice");
+        return 0;
+    }
+    pthread_mutex_lock(&index_lock);
+    fwrite(SFSS_INDEX_MAGIC, 1, 8, f);
+    int nareas = 0;
+    for (int a = 0; a < SFSS_MAX_OWNERS; a++) if (area_mtime_ns[a] >= 0) nareas++;
+    fwrite(&nareas, sizeof(int), 1, f);
+    for (int a = 0; a < SFSS_MAX_OWNERS; a++) {
+        if (area_mtime_ns[a] < 0) continue;
+        fwrite(&a, sizeof(int), 1, f);
+        fwrite(&area_mtime_ns[a], sizeof(long long), 1, f);
+    }
+    fwrite(&index_count, sizeof(int), 1, f);
+    for (int b = 0; b < SFSS_INDEX_BUCKETS; b++) {
+        for (SfssIndexEntry* e = index_tab[b]; e != NULL; e = e->next) {
+            fwrite(&e->path_len, sizeof(int), 1, f);
+            fwrite(e->path, 1, e->path_len, f);
+            fwrite(&e->size, sizeof(long long), 1, f);
+            fwrite(&e->mtime, sizeof(long long), 1, f);
+            fwrite(&e->is_dir, sizeof(int), 1, f);
+        }
+    }
+    pthread_mutex_unlock(&index_lock);
+    int ok = (ferror(f) == 0);
+    if (fclose(f) != 0) ok = 0;
+    if (ok && rename(tmp_path, file_path) != 0) ok = 0;
+    if (!ok) {
+        perror("Servidor: ERRO ao salvar índice");
+        unlink(tmp_path);
+    }
+    return ok;
+}
+
+// O mtime de /A<n> só muda quando uma entrada direta da área é criada ou
+// removida: reescrever um arquivo ou mexer dentro de um subdiretório não o
+// altera. Por isso cada entrada carregada da área é conferida com o disco
+// (um fstatat por entrada: tipo, tamanho e mtime; um diretório alterado
+// tem mtime novo). Retorna 1 se todas ainda batem com o índice.
+static int index_area_matches(int area) {
+    const char* prefix = owner_tab[area].prefix;
+    int plen = owner_tab[area].prefix_len;
+    int root_fd = open(SFSS_ROOT_DIR, O_RDONLY | O_DIRECTORY);
+    if (root_fd < 0) return 0;
+    int ok = 1;
+    pthread_mutex_lock(&index_lock);
+    for (int b = 0; b < SFSS_INDEX_BUCKETS && ok; b++) {
+        for (SfssIndexEntry* e = index_tab[b]; e != NULL && ok; e = e->next) {
+            // Só o que está abaixo de /A<n>; a própria área já foi conferida
+            if (e->path_len <= plen || memcmp(e->path, prefix, plen) != 0 || e->path[plen] != '/') continue;
+            struct stat st;
+            if (fstatat(root_fd, e->path + 1, &st, AT_SYMLINK_NOFOLLOW) != 0 ||
+                (S_ISDIR(st.st_mode) ? 1 : 0) != e->is_dir ||
+                (long long)st.st_mtime != e->mtime ||
+                (!e->is_dir && (long long)st.st_size != e->size)) {
+                ok = 0;
+            }
+        }
+    }
+    pthread_mutex_unlock(&index_lock);
+    close(root_fd);
+    return ok;
+}
+
+// Carrega o índice salvo. 'want' chega com as áreas existentes em disco e
+// sai apenas com as que precisam ser varridas de novo (novas ou modificadas).
+// Retorna 0 se o arquivo não existe ou é inválido (varredura completa).
+int index_load(const char* file_path, unsigned char* want) {
+    FILE* f = fopen(file_path, "rb");
+    if (f == NULL) return 0;
 
-    // Checa o path do dono (Ex: /A5)
-    if (is_owner_path) {
-        // Checa se é /A5 (exato) ou /A5/... (subdiretório)
-        // Isso previne que /A5 acesse /A50
-        if (path_len == owner_prefix_len) { // Exatamente /A5
-            is_valid = 1; 
-        } else if (path[owner_prefix_len] == '/') { // É /A5/...
-            is_valid = 1;
+    char magic[8];
+    int nareas = 0, nentries = 0, ok = 1;
+    if (fread(magic, 1, 8, f) != 8 || memcmp(magic, SFSS_INDEX_MAGIC, 8) != 0 ||
+        fread(&nareas, sizeof(int), 1, f) != 1 || nareas < 0 || nareas > SFSS_MAX_OWNERS) {
+        fclose(f);
+        return 0;
+    }
+    for (int i = 0; i < nareas && ok; i++) {
+        int a;
+        long long mtime_ns;
+        if (fread(&a, sizeof(int), 1, f) != 1 || fread(&mtime_ns, sizeof(long long), 1, f) != 1 ||
+            a < 0 || a >= SFSS_MAX_OWNERS) {
+            ok = 0;
+            break;
+        }
+        area_mtime_ns[a] = mtime_ns;
+    }
+    if (ok && (fread(&nentries, sizeof(int), 1, f) != 1 || nentries < 0)) ok = 0;
+    for (int i = 0; i < nentries && ok; i++) {
+        int len, is_dir;
+        long long size, mtime;
+        char path[SFP_MAX_PATH_LEN];
+        if (fread(&len, sizeof(int), 1, f) != 1 || len <= 0 || len >= SFP_MAX_PATH_LEN ||
+            fread(path, 1, len, f) != (size_t)len ||
+            fread(&size, sizeof(long long), 1, f) != 1 ||
+            fread(&mtime, sizeof(long long), 1, f) != 1 ||
+            fread(&is_dir, sizeof(int), 1, f) != 1) {
+            ok = 0;
+            break;
+        }
+        path[len] = '\0';
+        index_put(path, len, size, mtime, is_dir);
+    }
+    fclose(f);
+    if (!ok) {
+        printf("Servidor: Índice persistido inválido (%s). Varredura completa.\n", file_path);
+        for (int a = 0; a < SFSS_MAX_OWNERS; a++) {
+            if (area_mtime_ns[a] >= 0) index_drop_area(a);
+            area_mtime_ns[a] = -1;
+        }
+        return 0;
+    }
+
+    for (int a = 0; a < SFSS_MAX_OWNERS; a++) {
+        if (area_mtime_ns[a] < 0) continue; // Área nova: continua em 'want'
+        if (!want[a]) {                     // Área removida do disco
+            index_drop_area(a);
+            area_mtime_ns[a] = -1;
+            continue;
+        }
+        if (area_current_mtime(a) == area_mtime_ns[a] && index_area_matches(a)) want[a] = 0;
+    }
+    return 1;
+}
+
+// Monta o índice antes de abrir o socket: carrega o arquivo persistido
+// (se houver) e varre em paralelo as áreas ausentes ou desatualizadas.
+void build_index(const char* persist_path) {
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    // Áreas existentes em sfss_root
+    unsigned char* want = calloc(SFSS_MAX_OWNERS, 1);
+    if (want == NULL) return;
+    for (int a = 0; a < SFSS_MAX_OWNERS; a++) area_mtime_ns[a] = -1;
+    DIR* root = opendir(SFSS_ROOT_DIR);
+    if (root != NULL) {
+        struct dirent* de;
+        while ((de = readdir(root)) != NULL) {
+            int area = parse_area_name(de->d_name);
+            if (area >= 0) want[area] = 1;
+        }
+        closedir(root);
+    }
+
+    index_persistent = (persist_path != NULL);
+    int loaded = index_persistent && index_load(persist_path, want);
+    int nscanned = scan_areas(want);
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    double ms = (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6;
+    printf("Servidor: Índice %s: %d entradas, %d área(s) varrida(s) em paralelo, %.2f ms\n",
+           loaded ? "carregado" : "construído", index_count, nscanned, ms);
+    free(want);
+
+    if (persist_path != NULL && nscanned > 0) index_save(persist_path);
+}
+
+
+// --- Cotas por Área ---
+// Contadores de bytes e inodes de cada área /A<n>, mantidos de forma
+// incremental pelos handlers (WR, remoção via WR, DC e DR) e semeados a
+// partir do índice na inicialização: custo O(1) por requisição, sem du.
+// Sidecars de checksum não entram na conta.
+typedef struct {
+    long long bytes;
+    long      inodes;  // Itens abaixo de /A<n> (arquivos e diretórios)
+} SfssUsage;
+
+static SfssUsage usage_tab[SFSS_MAX_OWNERS];
+static long long quota_bytes = 0;   // -q; 0 = sem limite
+static long      quota_inodes = 0;  // -Q; 0 = sem limite
+static pthread_mutex_t quota_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Reserva 'bytes'/'inodes' na área. Retorna 0 (sem aplicar) se estoura a cota.
+int quota_charge(int area, long long bytes, long inodes) {
+    int ok = 1;
+    pthread_mutex_lock(&quota_lock);
+    SfssUsage* u = &usage_tab[area];
+    if (quota_bytes > 0 && bytes > 0 && u->bytes + bytes > quota_bytes) ok = 0;
+    if (quota_inodes > 0 && inodes > 0 && u->inodes + inodes > quota_inodes) ok = 0;
+    if (ok) {
+        u->bytes += bytes;
+        u->inodes += inodes;
+    }
+    pthread_mutex_unlock(&quota_lock);
+    return ok;
+}
+
+void quota_release(int area, long long bytes, long inodes) {
+    pthread_mutex_lock(&quota_lock);
+    usage_tab[area].bytes -= bytes;
+    usage_tab[area].inodes -= inodes;
+    if (usage_tab[area].bytes < 0) usage_tab[area].bytes = 0;
+    if (usage_tab[area].inodes < 0) usage_tab[area].inodes = 0;
+    pthread_mutex_unlock(&quota_lock);
+}
+
+// Semeia os contadores com uma passada sobre o índice recém-montado
+void seed_quota_from_index(void) {
+    pthread_mutex_lock(&index_lock);
+    for (int b = 0; b < SFSS_INDEX_BUCKETS; b++) {
+        for (SfssIndexEntry* e = index_tab[b]; e != NULL; e = e->next) {
+            int area = 0, i = 2;
+            while (i < e->path_len && e->path[i] != '/') area = area * 10 + (e->path[i++] - '0');
+            if (i >= e->path_len || area >= SFSS_MAX_OWNERS) continue; // A própria área
+            usage_tab[area].bytes += e->is_dir ? 0 : e->size;
+            usage_tab[area].inodes++;
+        }
+    }
+    pthread_mutex_unlock(&index_lock);
+    if (quota_bytes > 0 || quota_inodes > 0) {
+        printf("Servidor: Cotas por área: %lld bytes, %ld inodes (0 = sem limite)\n", quota_bytes, quota_inodes);
+    }
+}
+
+// Após uma falha no meio do WR, devolve a parte da reserva que o arquivo
+// não chegou a crescer
+static void quota_settle(FILE* file, int area, long old_size, long long reserved) {
+    if (reserved <= 0) return;
+    struct stat st;
+    long long grown = 0;
+    fflush(file);
+    if (fstat(fileno(file), &st) == 0 && st.st_size > old_size) grown = st.st_size - old_size;
+    if (grown < reserved) quota_release(area, reserved - grown, 0);
+}
+
+// Tamanho de um item antes de removê-lo: índice, ou lstat() se não indexado
+static long long item_size(const char* rel, int rel_len, const char* full_path) {
+    SfssIndexEntry meta;
+    if (rel_len < SFP_MAX_PATH_LEN && index_get(rel, rel_len, &meta)) return meta.is_dir ? 0 : meta.size;
+    struct stat st;
+    if (lstat(full_path, &st) == 0 && !S_ISDIR(st.st_mode)) return st.st_size;
+    return 0;
+}
+
+
+// --- Checksums CRC32C por Bloco de 16 Bytes ---
+// Cada arquivo "<dir>/<nome>" tem um sidecar "<dir>/.<nome>.sfsscrc" com um
+// CRC32C (uint32) por bloco de SFP_PAYLOAD_SIZE bytes (último bloco
+// completado com zeros). WR atualiza os blocos tocados, RD verifica os
+// blocos lidos (desligável com -V) e uma thread de scrub varre arquivos
+// inteiros em lotes.
+#define SFSS_CRC_BLOCK        SFP_PAYLOAD_SIZE
+#define SFSS_CRC_CHUNK_BLOCKS 256   // Blocos processados por leitura (4 KB)
+#define SFSS_SCRUB_BATCH      32    // Arquivos verificados por lote do scrubber
+
+static uint32_t crc32c_table[256];
+static int crc_verify_on_read = 1;   // -V desliga
+static int scrub_interval_s = 60;    // -S <s>; 0 desliga o scrubber
+static pthread_mutex_t crc_lock = PTHREAD_MUTEX_INITIALIZER; // dado + sidecar
+
+// Contadores (lidos pelo scrubber e pelo relatório de estatísticas)
+static unsigned long crc_blocks_verified = 0;
+static unsigned long crc_mismatches = 0;
+static unsigned long crc_unverified_reads = 0;
+static unsigned long scrub_files = 0;
+static unsigned long scrub_no_sidecar = 0; // Arquivos encontrados sem sidecar
+static unsigned long scrub_sealed = 0;     // Blocos que ganharam checksum no scrub
+
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char* p, size_t n) {
+    crc = ~crc;
+    while (n--) crc = crc32c_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+static void crc32c_blocks_sw(const unsigned char* data, int nblocks, uint32_t* out) {
+    for (int i = 0; i < nblocks; i++) out[i] = crc32c_sw(0, data + (size_t)i * SFSS_CRC_BLOCK, SFSS_CRC_BLOCK);
+}
+
+#if defined(__x86_64__)
+// Instrução crc32 do SSE4.2: 8 bytes por instrução
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char* p, size_t n) {
+    uint64_t c = ~crc & 0xffffffffu;
+    while (n >= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        c = _mm_crc32_u64(c, v);
+        p += 8;
+        n -= 8;
+    }
+    while (n--) c = _mm_crc32_u8((uint32_t)c, *p++);
+    return ~(uint32_t)c;
+}
+
+// Kernel em lote: 4 blocos intercalados por iteração, para que as cadeias
+// independentes escondam a latência de 3 ciclos da instrução crc32
+__attribute__((target("sse4.2")))
+static void crc32c_blocks_hw(const unsigned char* data, int nblocks, uint32_t* out) {
+    int i = 0;
+    for (; i + 4 <= nblocks; i += 4) {
+        const unsigned char* b = data + (size_t)i * SFSS_CRC_BLOCK;
+        uint64_t w[8];
+        memcpy(w, b, sizeof(w));
+        uint64_t c0 = 0xffffffffu, c1 = 0xffffffffu, c2 = 0xffffffffu, c3 = 0xffffffffu;
+        c0 = _mm_crc32_u64(c0, w[0]); c1 = _mm_crc32_u64(c1, w[2]);
+        c2 = _mm_crc32_u64(c2, w[4]); c3 = _mm_crc32_u64(c3, w[6]);
+        c0 = _mm_crc32_u64(c0, w[1]); c1 = _mm_crc32_u64(c1, w[3]);
+        c2 = _mm_crc32_u64(c2, w[5]); c3 = _mm_crc32_u64(c3, w[7]);
+        out[i] = ~(uint32_t)c0;     out[i + 1] = ~(uint32_t)c1;
+        out[i + 2] = ~(uint32_t)c2; out[i + 3] = ~(uint32_t)c3;
+    }
+    for (; i < nblocks; i++) out[i] = crc32c_hw(0, data + (size_t)i * SFSS_CRC_BLOCK, SFSS_CRC_BLOCK);
+}
+#endif
+
+// Implementação escolhida em init_crc32c() (hardware se disponível)
+static void (*crc32c_blocks)(const unsigned char*, int, uint32_t*) = crc32c_blocks_sw;
+
+void init_crc32c(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) c = (c & 1) ? (c >> 1) ^ 0x82F63B78u : (c >> 1);
+        crc32c_table[i] = c;
+    }
+    const char* impl = "portável";
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2") &&
+        crc32c_hw(0, (const unsigned char*)"123456789", 9) == 0xE3069283u) {
+        crc32c_blocks = crc32c_blocks_hw;
+        impl = "SSE4.2";
+    }
+#endif
+    printf("Servidor: CRC32C por bloco (%s), verificação no RD %s\n",
+           impl, crc_verify_on_read ? "ligada" : "desligada");
+}
+
+// "<dir>/<nome>" -> "<dir>/.<nome>.sfsscrc". Retorna 0 se não couber.
+int crc_sidecar_path(char* dst, size_t cap, const char* full_path) {
+    const char* slash = strrchr(full_path, '/');
+    int dir_len = slash ? (int)(slash - full_path) + 1 : 0;
+    int n = snprintf(dst, cap, "%.*s.%s%s", dir_len, full_path, full_path + dir_len, SFSS_CRC_SUFFIX);
+    return n > 0 && (size_t)n < cap;
+}
+
+void crc_remove_sidecar(const char* full_path) {
+    char side[SFP_MAX_PATH_LEN + 512];
+    if (crc_sidecar_path(side, sizeof(side), full_path)) unlink(side);
+}
+
+// Lê os blocos [first, first + n) de 'fd', completando com zeros após o fim
+static int crc_read_blocks(int fd, long first, int n, unsigned char* buf) {
+    size_t want = (size_t)n * SFSS_CRC_BLOCK;
+    memset(buf, 0, want);
+    ssize_t got = pread(fd, buf, want, (off_t)first * SFSS_CRC_BLOCK);
+    return got < 0 ? -1 : 0;
+}
+
+// Recalcula e grava no sidecar os checksums dos blocos [first, last] do
+// arquivo 'fd'. 'reset' trunca o sidecar (arquivo recém-criado).
+// Chamador segura crc_lock.
+int crc_update_range(int fd, const char* full_path, long first, long last, int reset) {
+    char side[SFP_MAX_PATH_LEN + 512];
+    if (!crc_sidecar_path(side, sizeof(side), full_path)) return -1;
+    int sfd = reset ? -1 : open(side, O_RDWR);
+    if (sfd < 0) {
+        // Sidecar novo: os checksums do arquivo inteiro precisam existir
+        sfd = open(side, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (sfd < 0) return -1;
+        first = 0;
+    }
+
+    unsigned char buf[SFSS_CRC_CHUNK_BLOCKS * SFSS_CRC_BLOCK];
+    uint32_t crcs[SFSS_CRC_CHUNK_BLOCKS];
+    int rc = 0;
+    for (long b = first; b <= last && rc == 0; b += SFSS_CRC_CHUNK_BLOCKS) {
+        int n = (last - b + 1 < SFSS_CRC_CHUNK_BLOCKS) ? (int)(last - b + 1) : SFSS_CRC_CHUNK_BLOCKS;
+        if (crc_read_blocks(fd, b, n, buf) != 0) { rc = -1; break; }
+        crc32c_blocks(buf, n, crcs);
+        if (pwrite(sfd, crcs, sizeof(uint32_t) * n, (off_t)b * sizeof(uint32_t)) != (ssize_t)(sizeof(uint32_t) * n)) rc = -1;
+    }
+    close(sfd);
+    return rc;
+}
+
+// Confere 'n' blocos já lidos em 'data' (a partir do bloco 'first') contra
+// o sidecar. Retorna o nº de blocos divergentes (0 = íntegros) ou -1 se
+// não há checksum para eles. 'bad_first' recebe o primeiro divergente.
+int crc_verify_blocks(const char* full_path, long first, int n, const unsigned char* data, long* bad_first) {
+    char side[SFP_MAX_PATH_LEN + 512];
+    if (!crc_sidecar_path(side, sizeof(side), full_path)) return -1;
+    int sfd = open(side, O_RDONLY);
+    if (sfd < 0) return -1;
+
+    uint32_t stored[SFSS_CRC_CHUNK_BLOCKS], computed[SFSS_CRC_CHUNK_BLOCKS];
+    if (n > SFSS_CRC_CHUNK_BLOCKS) n = SFSS_CRC_CHUNK_BLOCKS;
+    ssize_t got = pread(sfd, stored, sizeof(uint32_t) * n, (off_t)first * sizeof(uint32_t));
+    close(sfd);
+    if (got != (ssize_t)(sizeof(uint32_t) * n)) return -1;
+
+    crc32c_blocks(data, n, computed);
+    __atomic_add_fetch(&crc_blocks_verified, n, __ATOMIC_RELAXED);
+    if (memcmp(stored, computed, sizeof(uint32_t) * n) == 0) return 0;
+    int bad = 0;
+    for (int i = n - 1; i >= 0; i--) {
+        if (stored[i] != computed[i]) {
+            bad++;
+            if (bad_first != NULL) *bad_first = first + i;
         }
     }
+    return bad;
+}
 
-    // Checa o path compartilhado (Ex: /A0)
-    if (is_shared_path) {
-        // Checa se é /A0 (exato) ou /A0/...
-        if (path_len == shared_prefix_len) { // Exatamente /A0
-            is_valid = 1;
-        } else if (path[shared_prefix_len] == '/') { // É /A0/...
-            is_valid = 1;
+// Nº de blocos com checksum no sidecar de 'full_path' (-1 se não há sidecar)
+static long crc_sidecar_blocks(const char* full_path) {
+    char side[SFP_MAX_PATH_LEN + 512];
+    struct stat st;
+    if (!crc_sidecar_path(side, sizeof(side), full_path) || stat(side, &st) != 0) return -1;
+    return (long)(st.st_size / (off_t)sizeof(uint32_t));
+}
+
+// Verifica o arquivo inteiro contra o sidecar. Os blocos além do fim do
+// sidecar (escritos por fora do servidor) não têm com o que ser conferidos:
+// ganham checksum ("selados") e são relatados, assim como um arquivo sem
+// sidecar nenhum (anterior ao servidor, ou sidecar apagado), que é selado
+// por inteiro. Retorna o nº de blocos divergentes.
+static long scrub_file(const char* full_path) {
+    pthread_mutex_lock(&crc_lock);
+    int fd = open(full_path, O_RDONLY);
+    if (fd < 0) {
+        pthread_mutex_unlock(&crc_lock);
+        return 0;
+    }
+    struct stat st;
+    long bad = 0;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        long nblocks = (st.st_size + SFSS_CRC_BLOCK - 1) / SFSS_CRC_BLOCK;
+        long covered = crc_sidecar_blocks(full_path);
+        if (covered < 0) {
+            printf("Servidor: (SCRUB) SEM CHECKSUMS: %s (%ld bloco(s) selado(s) sem verificação)\n",
+                   full_path, nblocks);
+            if (crc_update_range(fd, full_path, 0, nblocks - 1, 1) == 0) {
+                __atomic_add_fetch(&scrub_no_sidecar, 1, __ATOMIC_RELAXED);
+                __atomic_add_fetch(&scrub_sealed, nblocks, __ATOMIC_RELAXED);
+            }
+        } else {
+            long checked = covered < nblocks ? covered : nblocks;
+            unsigned char buf[SFSS_CRC_CHUNK_BLOCKS * SFSS_CRC_BLOCK];
+            for (long b = 0; b < checked; b += SFSS_CRC_CHUNK_BLOCKS) {
+                int n = (checked - b < SFSS_CRC_CHUNK_BLOCKS) ? (int)(checked - b) : SFSS_CRC_CHUNK_BLOCKS;
+                if (crc_read_blocks(fd, b, n, buf) != 0) break;
+                long bad_first = 0;
+                int nbad = crc_verify_blocks(full_path, b, n, buf, &bad_first);
+                if (nbad < 0) break;
+                if (nbad > 0) {
+                    bad += nbad;
+                    printf("Servidor: (SCRUB) CORRUPÇÃO em %s: %d bloco(s), primeiro no offset %ld\n",
+                           full_path, nbad, bad_first * SFSS_CRC_BLOCK);
+                }
+            }
+            if (covered < nblocks) {
+                printf("Servidor: (SCRUB) SEM CHECKSUMS: %s a partir do offset %ld (%ld bloco(s) selado(s) sem verificação)\n",
+                       full_path, covered * SFSS_CRC_BLOCK, nblocks - covered);
+                if (crc_update_range(fd, full_path, covered, nblocks - 1, 0) == 0)
+                    __atomic_add_fetch(&scrub_sealed, nblocks - covered, __ATOMIC_RELAXED);
+            }
         }
     }
+    close(fd);
+    pthread_mutex_unlock(&crc_lock);
+    __atomic_add_fetch(&scrub_files, 1, __ATOMIC_RELAXED);
+    if (bad > 0) __atomic_add_fetch(&crc_mismatches, bad, __ATOMIC_RELAXED);
+    return bad;
+}
+
+// Thread de scrub: a cada 'scrub_interval_s' percorre os arquivos do índice
+// em lotes de SFSS_SCRUB_BATCH (paths copiados sob index_lock, verificação
+// feita sem segurar o índice).
+static void* scrub_thread(void* arg) {
+    (void)arg;
+    static char batch[SFSS_SCRUB_BATCH][SFP_MAX_PATH_LEN];
+    static int batch_len[SFSS_SCRUB_BATCH];
+    for (;;) {
+        sleep(scrub_interval_s);
+        unsigned long files_before = scrub_files, bad = 0;
+        int bucket = 0;
+        SfssIndexEntry* cursor = NULL;
+        while (bucket < SFSS_INDEX_BUCKETS) {
+            int n = 0;
+            pthread_mutex_lock(&index_lock);
+            // O cursor pode ter sido removido entre lotes: retoma do início do bucket
+            SfssIndexEntry* e = index_tab[bucket];
+            if (cursor != NULL) {
+                SfssIndexEntry* it = e;
+                while (it != NULL && it != cursor) it = it->next;
+                e = (it != NULL) ? it : e;
+            }
+            while (n < SFSS_SCRUB_BATCH && bucket < SFSS_INDEX_BUCKETS) {
+                if (e == NULL) {
+                    if (++bucket < SFSS_INDEX_BUCKETS) e = index_tab[bucket];
+                    continue;
+                }
+                if (!e->is_dir) {
+                    memcpy(batch[n], e->path, e->path_len + 1);
+                    batch_len[n++] = e->path_len;
+                }
+                e = e->next;
+            }
+            if (e == NULL) bucket++; // Lote fechou no fim do bucket
+            cursor = e;
+            pthread_mutex_unlock(&index_lock);
+
+            for (int i = 0; i < n; i++) {
+                char full[SFP_MAX_PATH_LEN + 256];
+                if (join_root(full, sizeof(full), batch[i], batch_len[i], NULL)) bad += scrub_file(full);
+            }
+        }
+        printf("Servidor: (SCRUB) Passada completa: %lu arquivo(s), %lu bloco(s) corrompido(s); "
+               "até agora %lu arquivo(s) sem sidecar, %lu bloco(s) selado(s)\n",
+               scrub_files - files_before, bad, scrub_no_sidecar, scrub_sealed);
+    }
+    return NULL;
+}
+
+void start_scrubber(void) {
+    if (scrub_interval_s <= 0) return;
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, scrub_thread, NULL) == 0) {
+        pthread_detach(tid);
+        printf("Servidor: Scrubber de checksums a cada %d s\n", scrub_interval_s);
+    }
+}
 
-    return is_valid;
+
+// --- Handles (OPEN/CLOSE) ---
+// Um OPEN valida o path uma vez e guarda o resultado numa tabela; RD/WR por
+// handle só consultam a tabela. O handle codifica slot e geração, então um
+// handle fechado ou expirado não é confundido com o próximo dono do slot.
+// Handles sem uso há SFSS_HANDLE_IDLE_S expiram (o cliente pode ter sumido)
+// e um novo HELLO do mesmo cliente descarta os dele (o cliente reiniciou).
+#define SFSS_MAX_HANDLES   256
+#define SFSS_HANDLE_IDLE_S 120
+
+typedef struct {
+    int in_use;
+    int owner;
+    int gen;                   // Geração do slot (parte do número do handle)
+    struct sockaddr_in client; // Quem abriu
+    time_t last_used;
+    SfssPath p;                // Resultado de validate_path no OPEN
+} SfssHandle;
+
+static SfssHandle handle_tab[SFSS_MAX_HANDLES];
+static pthread_mutex_t handle_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long handles_opened = 0, handles_expired = 0;
+
+// Remetente do datagrama em atendimento (fixo durante um lote)
+static struct sockaddr_in cur_client;
+
+static int same_client(const struct sockaddr_in* a, const struct sockaddr_in* b) {
+    return a->sin_addr.s_addr == b->sin_addr.s_addr && a->sin_port == b->sin_port;
 }
 
+// Slot de 'handle' se ele ainda vale para 'owner' e o cliente atual (senão
+// NULL); um slot ocioso há mais de SFSS_HANDLE_IDLE_S expira aqui mesmo sem
+// um OPEN ter varrido a tabela desde então. Chamador segura handle_lock.
+static SfssHandle* handle_find_locked(int owner, int handle, time_t now) {
+    if (handle <= 0) return NULL;
+    SfssHandle* h = &handle_tab[handle % SFSS_MAX_HANDLES];
+    if (h->in_use && now - h->last_used > SFSS_HANDLE_IDLE_S) {
+        h->in_use = 0;
+        handles_expired++;
+    }
+    if (h->in_use && h->gen == handle / SFSS_MAX_HANDLES && h->owner == owner &&
+        same_client(&h->client, &cur_client))
+        return h;
+    return NULL;
+}
+
+// Resolve 'handle' para o path validado no OPEN. Retorna SFP_SUCCESS ou
+// SFP_ERR_BAD_HANDLE.
+int handle_lookup(int owner, int handle, SfssPath* out) {
+    int rc = SFP_ERR_BAD_HANDLE;
+    time_t now = time(NULL);
+    pthread_mutex_lock(&handle_lock);
+    SfssHandle* h = handle_find_locked(owner, handle, now);
+    if (h != NULL) {
+        h->last_used = now;
+        *out = h->p;
+        rc = SFP_SUCCESS;
+    }
+    pthread_mutex_unlock(&handle_lock);
+    return rc;
+}
+
+// Abre um handle para 'p'. Retorna o handle (> 0) ou SFP_ERR_IO (tabela cheia).
+int handle_open(int owner, const SfssPath* p) {
+    time_t now = time(NULL);
+    int free_slot = -1;
+    pthread_mutex_lock(&handle_lock);
+    for (int i = 0; i < SFSS_MAX_HANDLES; i++) {
+        SfssHandle* h = &handle_tab[i];
+        if (h->in_use && now - h->last_used > SFSS_HANDLE_IDLE_S) {
+            h->in_use = 0;
+            handles_expired++;
+        }
+        if (!h->in_use && free_slot < 0) free_slot = i;
+    }
+    int handle = SFP_ERR_IO;
+    if (free_slot >= 0) {
+        SfssHandle* h = &handle_tab[free_slot];
+        h->gen = h->gen % (INT32_MAX / SFSS_MAX_HANDLES - 1) + 1;
+        h->in_use = 1;
+        h->owner = owner;
+        h->client = cur_client;
+        h->last_used = now;
+        h->p = *p;
+        handles_opened++;
+        handle = h->gen * SFSS_MAX_HANDLES + free_slot;
+    }
+    pthread_mutex_unlock(&handle_lock);
+    return handle;
+}
+
+// Fecha 'handle'. A conferência e a liberação do slot ficam sob a mesma
+// trava: um OPEN em outra thread de lote pode reusar o slot logo depois.
+int handle_close(int owner, int handle) {
+    int rc = SFP_ERR_BAD_HANDLE;
+    pthread_mutex_lock(&handle_lock);
+    SfssHandle* h = handle_find_locked(owner, handle, time(NULL));
+    if (h != NULL) {
+        h->in_use = 0;
+        rc = SFP_SUCCESS;
+    }
+    pthread_mutex_unlock(&handle_lock);
+    return rc;
+}
+
+// Descarta os handles abertos pelo cliente atual (ele reiniciou)
+void handle_drop_client(void) {
+    int n = 0;
+    pthread_mutex_lock(&handle_lock);
+    for (int i = 0; i < SFSS_MAX_HANDLES; i++) {
+        if (handle_tab[i].in_use && same_client(&handle_tab[i].client, &cur_client)) {
+            handle_tab[i].in_use = 0;
+            n++;
+        }
+    }
+    handles_expired += n;
+    pthread_mutex_unlock(&handle_lock);
+    if (n > 0) printf("Servidor: (HL) Cliente reiniciou; %d handle(s) descartado(s)\n", n);
+}
+
+// Um RENAME de 'src' para 'dst': os handles da origem seguem o arquivo (se o
+// dono pode acessar o destino) e os do destino substituído deixam de valer
+void handle_rename(const SfssPath* src, const SfssPath* dst) {
+    int moved = 0, dropped = 0;
+    pthread_mutex_lock(&handle_lock);
+    for (int i = 0; i < SFSS_MAX_HANDLES; i++) {
+        SfssHandle* h = &handle_tab[i];
+        if (!h->in_use) continue;
+        if (h->p.len == dst->len && memcmp(h->p.norm, dst->norm, dst->len) == 0) {
+            h->in_use = 0;
+            dropped++;
+        } else if (h->p.len == src->len && memcmp(h->p.norm, src->norm, src->len) == 0) {
+            if (dst->area == 0 || dst->area == h->owner) {
+                h->p = *dst;
+                moved++;
+            } else {
+                h->in_use = 0;
+                dropped++;
+            }
+        }
+    }
+    pthread_mutex_unlock(&handle_lock);
+    if (moved + dropped > 0)
+        printf("Servidor: (RN) %d handle(s) redirecionado(s), %d invalidado(s)\n", moved, dropped);
+}
+
+// Alvo de um RD/WR: o arquivo do handle ou o path validado agora.
+// Retorna SFP_SUCCESS, SFP_ERR_PERMISSION ou SFP_ERR_BAD_HANDLE.
+static int rw_target(int owner, int handle, const char* path, SfssPath* p) {
+    if (handle != 0) return handle_lookup(owner, handle, p);
+    return validate_path(owner, path, p) ? SFP_SUCCESS : SFP_ERR_PERMISSION;
+}
+
+// --- Assinaturas (WATCH) e NOTIFY ---
+// Cada assinatura é (owner, cliente, path). Os handlers que mudam algo
+// chamam watch_note; o laço principal envia os NT-MSG pendentes, no máximo
+// um por assinatura a cada notify_interval_ms (mudanças no meio do
+// intervalo se juntam ao próximo).
+#define SFSS_MAX_WATCHES 256
+
+typedef struct {
+    int in_use;
+    int owner;
+    struct sockaddr_in client;
+    int len;
+    char path[SFP_PATH_CAP];   // Path normalizado assinado
+    unsigned events;           // SFP_NT_* pendentes (0 = nada a enviar)
+    int count;                 // Mudanças pendentes
+    int name_len;              // Entrada que mudou (-1 = mais de uma)
+    char name[SFP_NAME_CAP];
+    long long last_sent_us;
+} SfssWatch;
+
+static SfssWatch watch_tab[SFSS_MAX_WATCHES];
+static pthread_mutex_t watch_lock = PTHREAD_MUTEX_INITIALIZER;
+static int watch_count = 0;            // Lido sem trava: sem assinaturas, watch_note sai logo
+static int notify_interval_ms = 100;   // -N: intervalo mínimo entre NT-MSGs de uma assinatura
+static unsigned long notify_sent = 0, notify_changes = 0;
+
+// Registra uma mudança em 'path' (normalizado) para as assinaturas do
+// próprio path e do diretório que o contém
+void watch_note(const char* path, int len, unsigned events) {
+    if (__atomic_load_n(&watch_count, __ATOMIC_RELAXED) == 0) return;
+    pthread_mutex_lock(&watch_lock);
+    for (int i = 0; i < SFSS_MAX_WATCHES; i++) {
+        SfssWatch* w = &watch_tab[i];
+        if (!w->in_use || len < w->len || memcmp(path, w->path, w->len) != 0) continue;
+        const char* name = path + w->len;
+        int name_len = len - w->len;
+        if (name_len > 0) {
+            // Só entradas diretas do diretório assinado
+            if (name[0] != '/' || memchr(name + 1, '/', name_len - 1) != NULL) continue;
+            name++;
+            name_len--;
+        }
+        if (w->count == 0) {
+            w->name_len = name_len < SFP_NAME_CAP ? name_len : -1;
+            if (w->name_len >= 0) {
+                memcpy(w->name, name, name_len);
+                w->name[name_len] = '\0';
+            }
+        } else if (w->name_len != name_len || memcmp(w->name, name, name_len) != 0) {
+            w->name_len = -1;
+        }
+        w->events |= events;
+        w->count++;
+    }
+    pthread_mutex_unlock(&watch_lock);
+}
+
+// Próximo NT-MSG que já pode sair (ver sfss_next_notify)
+static int notify_next(long long now_us, SfpMsg* out, struct sockaddr_in* to, int* wait_ms) {
+    long long wait_us = -1;
+    pthread_mutex_lock(&watch_lock);
+    for (int i = 0; i < SFSS_MAX_WATCHES; i++) {
+        SfssWatch* w = &watch_tab[i];
+        if (!w->in_use || w->count == 0) continue;
+        long long due = w->last_sent_us + (long long)notify_interval_ms * 1000;
+        if (now_us < due) {
+            if (wait_us < 0 || due - now_us < wait_us) wait_us = due - now_us;
+            continue;
+        }
+        memset(out, 0, sizeof(*out));
+        out->hdr.msg_type = SFP_MSG_NT_MSG;
+        out->hdr.owner = w->owner;
+        out->nt.events = (int)w->events;
+        out->nt.count = w->count;
+        memcpy(out->nt.path, w->path, w->len + 1);
+        out->nt.path_len = w->len;
+        if (w->name_len > 0) {
+            memcpy(out->nt.name, w->name, w->name_len + 1);
+            out->nt.name_len = w->name_len;
+        }
+        *to = w->client;
+        notify_sent++;
+        notify_changes += w->count;
+        w->events = 0;
+        w->count = 0;
+        w->last_sent_us = now_us;
+        pthread_mutex_unlock(&watch_lock);
+        *wait_ms = 0;
+        return 1;
+    }
+    pthread_mutex_unlock(&watch_lock);
+    *wait_ms = wait_us < 0 ? -1 : (int)((wait_us + 999) / 1000);
+    return 0;
+}
+
+// Assina 'p' para o owner e o cliente atual. Retorna SFP_SUCCESS ou
+// SFP_ERR_IO (tabela cheia); assinar de novo não duplica.
+int watch_add(int owner, const SfssPath* p) {
+    int free_slot = -1, rc = SFP_ERR_IO;
+    if (p->len >= SFP_PATH_CAP) return rc;
+    pthread_mutex_lock(&watch_lock);
+    for (int i = 0; i < SFSS_MAX_WATCHES; i++) {
+        SfssWatch* w = &watch_tab[i];
+        if (w->in_use && w->owner == owner && w->len == p->len &&
+            memcmp(w->path, p->norm, p->len) == 0 && same_client(&w->client, &cur_client)) {
+            free_slot = -1;
+            rc = SFP_SUCCESS;
+            break;
+        }
+        if (!w->in_use && free_slot < 0) free_slot = i;
+    }
+    if (free_slot >= 0) {
+        SfssWatch* w = &watch_tab[free_slot];
+        memset(w, 0, sizeof(*w));
+        w->in_use = 1;
+        w->owner = owner;
+        w->client = cur_client;
+        w->len = p->len;
+        memcpy(w->path, p->norm, p->len);
+        w->path[p->len] = '\0';
+        __atomic_add_fetch(&watch_count, 1, __ATOMIC_RELAXED);
+        rc = SFP_SUCCESS;
+    }
+    pthread_mutex_unlock(&watch_lock);
+    return rc;
+}
+
+// Cancela a assinatura de 'p'. Retorna SFP_SUCCESS ou SFP_ERR_NOT_FOUND.
+int watch_remove(int owner, const SfssPath* p) {
+    int rc = SFP_ERR_NOT_FOUND;
+    pthread_mutex_lock(&watch_lock);
+    for (int i = 0; i < SFSS_MAX_WATCHES; i++) {
+        SfssWatch* w = &watch_tab[i];
+        if (w->in_use && w->owner == owner && w->len == p->len &&
+            memcmp(w->path, p->norm, p->len) == 0 && same_client(&w->client, &cur_client)) {
+            w->in_use = 0;
+            __atomic_sub_fetch(&watch_count, 1, __ATOMIC_RELAXED);
+            rc = SFP_SUCCESS;
+        }
+    }
+    pthread_mutex_unlock(&watch_lock);
+    return rc;
+}
+
+// Descarta as assinaturas do cliente atual (ele reiniciou)
+void watch_drop_client(void) {
+    int n = 0;
+    pthread_mutex_lock(&watch_lock);
+    for (int i = 0; i < SFSS_MAX_WATCHES; i++) {
+        if (watch_tab[i].in_use && same_client(&watch_tab[i].client, &cur_client)) {
+            watch_tab[i].in_use = 0;
+            n++;
+        }
+    }
+    __atomic_sub_fetch(&watch_count, n, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&watch_lock);
+    if (n > 0) printf("Servidor: (HL) Cliente reiniciou; %d assinatura(s) descartada(s)\n", n);
+}
+
+// --- Requisições Repetidas (retransmissões) ---
+// O kernel retransmite com o mesmo req_id uma requisição que ficou sem
+// resposta. Para um APPEND, COPY ou DC não ser executado duas vezes, guarda-se
+// a resposta das requisições recentes (mapeamento direto por req_id); uma
+// repetição recebe a resposta guardada sem passar pelo handler. Respostas com
+// corpo externo (RD/DL grandes) não são guardadas: leituras podem ser
+// refeitas. Só o laço principal usa a tabela.
+#define SFSS_DUP_SLOTS 256
+
+typedef struct {
+    unsigned long long req_id; // 0 = vazio
+    struct sockaddr_in client;
+    SfpMsg reply;
+} SfssDupEntry;
+
+static SfssDupEntry dup_tab[SFSS_DUP_SLOTS];
+static unsigned long dup_hits = 0;
+
+// Resposta já dada a 'req' pelo cliente atual (NULL = requisição nova)
+const SfpMsg* dup_lookup(const SfpHdr* req) {
+    if (req->req_id == 0) return NULL;
+    const SfssDupEntry* d = &dup_tab[req->req_id % SFSS_DUP_SLOTS];
+    if (d->req_id != req->req_id || d->reply.hdr.owner != req->owner || !same_client(&d->client, &cur_client))
+        return NULL;
+    dup_hits++;
+    return &d->reply;
+}
+
+// Guarda 'res' (já com req_id e owner da requisição) para repetições
+void dup_store(const SfpMsg* res) {
+    if (res->hdr.req_id == 0) return;
+    if (res->hdr.msg_type == SFP_MSG_DL_REP && res->dl_rep.nrnames > 0) return;
+    if (res->hdr.msg_type == SFP_MSG_RD_REP && res->rd_rep.length > SFP_PAYLOAD_SIZE) return;
+    SfssDupEntry* d = &dup_tab[res->hdr.req_id % SFSS_DUP_SLOTS];
+    d->req_id = res->hdr.req_id;
+    d->client = cur_client;
+    d->reply = *res;
+}
+
+// Esquece as respostas do cliente atual: um kernel novo recomeça os req_ids
+void dup_drop_client(void) {
+    for (int i = 0; i < SFSS_DUP_SLOTS; i++) {
+        if (dup_tab[i].req_id != 0 && same_client(&dup_tab[i].client, &cur_client)) dup_tab[i].req_id = 0;
+    }
+}
 
 // --- Funções de Manipulação ---
 
-void handle_rd_req(const SfpMessage* req, SfpMessage* res) {
+// Copia o path normalizado para o campo de resposta (truncado em SFP_PATH_CAP)
+static int copy_reply_path(char* dst, const SfssPath* p) {
+    int n = p->len < SFP_PATH_CAP ? p->len : SFP_PATH_CAP - 1;
+    memcpy(dst, p->norm, n);
+    dst[n] = '\0';
+    return n;
+}
+
+void handle_rd_req(const SfpRdReq* req, SfpRdRep* res, SfpBulk* body) {
     // 1. Inicializa a Resposta
-    res->msg_type = SFP_MSG_RD_REP;
-    res->owner = req->owner;
-    strncpy(res->path, req->path, SFP_MAX_PATH_LEN);
-    res->path_len = req->path_len;
+    res->hdr.msg_type = SFP_MSG_RD_REP;
+    res->hdr.owner = req->hdr.owner;
     res->offset = req->offset;
+    res->handle = req->handle;
     memset(res->payload, 0, SFP_PAYLOAD_SIZE);
+    int want = sfp_rw_len(req->length);
+    char* dst = want > SFP_PAYLOAD_SIZE ? body->data : res->payload;
 
-    // 2. Validação de Permissões (CORRIGIDO)
-    if (!check_permission(req->owner, req->path, strlen(req->path))) {
-        printf("Servidor: ERRO (RD) Permissão negada. Owner %d tenta acessar %s\n", req->owner, req->path);
-        res->offset = SFP_ERR_PERMISSION; // Retorna erro
+    // 2. Validação de Permissões (passada única sobre o path, ou handle)
+    SfssPath p;
+    int rc = rw_target(req->hdr.owner, req->handle, req->path, &p);
+    if (rc != SFP_SUCCESS) {
+        if (rc == SFP_ERR_BAD_HANDLE)
+            printf("Servidor: ERRO (RD) Handle %d inválido para o owner %d\n", req->handle, req->hdr.owner);
+        else
+            printf("Servidor: ERRO (RD) Permissão negada. Owner %d tenta acessar %.*s\n", req->hdr.owner, SFP_PATH_CAP, req->path);
+        strncpy(res->path, req->path, SFP_PATH_CAP);
+        res->path_len = req->path_len;
+        res->offset = rc; // Retorna erro
         return;
     }
+    res->path_len = copy_reply_path(res->path, &p);
 
     // 3. Construção do Path Real
     char full_path[SFP_MAX_PATH_LEN + 256];
-    snprintf(full_path, sizeof(full_path), "%s%s", SFSS_ROOT_DIR, req->path);
+    if (!build_full_path(full_path, sizeof(full_path), &p, NULL)) {
+        res->offset = SFP_ERR_IO;
+        return;
+    }
 
     // 4. Operação de Arquivo
     FILE *file = fopen(full_path, "rb");
     if (file == NULL) {
         printf("Servidor: ERRO (RD) Arquivo não encontrado: %s\n", full_path);
+        index_remove(p.norm, p.len);
         res->offset = SFP_ERR_NOT_FOUND;
         return;
     }
 
-    fseek(file, 0, SEEK_END);
-    long file_size = ftell(file);
+    // Tamanho vem do próprio arquivo aberto: o índice pode estar defasado
+    // (alteração feita fora do servidor) e serve só às listagens, que ele
+    // aproveita para atualizar
+    struct stat st;
+    if (fstat(fileno(file), &st) != 0) {
+        res->offset = SFP_ERR_IO;
+        fclose(file);
+        return;
+    }
+    long file_size = (long)st.st_size;
+    index_put(p.norm, p.len, st.st_size, st.st_mtime, S_ISDIR(st.st_mode) ? 1 : 0);
 
     if (req->offset >= file_size) {
         if (!(file_size == 0 && req->offset == 0)) {
@@ -102,235 +1404,1386 @@ void handle_rd_req(const SfpMessage* req, SfpMessage* res) {
     }
 
     fseek(file, req->offset, SEEK_SET);
-    size_t bytes_read = fread(res->payload, 1, SFP_PAYLOAD_SIZE, file);
+    size_t bytes_read = fread(dst, 1, want, file);
+
+    // 5. Verificação dos checksums dos blocos lidos
+    if (crc_verify_on_read && bytes_read > 0) {
+        long first = req->offset / SFSS_CRC_BLOCK;
+        int nblocks = (int)((req->offset + (long)bytes_read - 1) / SFSS_CRC_BLOCK - first + 1);
+        unsigned char blocks[(SFP_MAX_PAYLOAD / SFSS_CRC_BLOCK + 1) * SFSS_CRC_BLOCK];
+        const unsigned char* data = (const unsigned char*)dst;
+        pthread_mutex_lock(&crc_lock);
+        // O CRC cobre blocos inteiros: uma leitura que não começa e termina em
+        // borda de bloco (inclusive a de 1..15 bytes) é conferida pelos blocos relidos
+        if (req->offset % SFSS_CRC_BLOCK != 0 || bytes_read % SFSS_CRC_BLOCK != 0) {
+            crc_read_blocks(fileno(file), first, nblocks, blocks);
+            data = blocks;
+        }
+        int nbad = crc_verify_blocks(full_path, first, nblocks, data, NULL);
+        pthread_mutex_unlock(&crc_lock);
+        if (nbad > 0) {
+            printf("Servidor: ERRO (RD) Checksum divergente em %s @ offset %d\n", full_path, req->offset);
+            __atomic_add_fetch(&crc_mismatches, 1, __ATOMIC_RELAXED);
+            memset(res->payload, 0, SFP_PAYLOAD_SIZE);
+            res->offset = SFP_ERR_CORRUPT;
+            fclose(file);
+            return;
+        }
+        if (nbad < 0) __atomic_add_fetch(&crc_unverified_reads, 1, __ATOMIC_RELAXED);
+    }
+    // Transferência variável: informa quantos bytes vieram (poucos voltam ao 'payload')
+    if (req->length != 0) {
+        res->length = (int)bytes_read;
+        if (dst != res->payload && bytes_read <= SFP_PAYLOAD_SIZE) memcpy(res->payload, dst, bytes_read);
+    }
     printf("Servidor: (RD) Sucesso. Leu %zu bytes de %s @ offset %d\n", bytes_read, full_path, req->offset);
     fclose(file);
 }
 
-void handle_wr_req(const SfpMessage* req, SfpMessage* res) {
+// Escrita de um WR-REQ ou AP-REQ. Com 'append', o offset é o tamanho do
+// arquivo lido sob crc_lock, que serializa todas as escritas: dois APPENDs
+// concorrentes nunca recebem o mesmo offset. 'bulk' são os dados acima de
+// SFP_PAYLOAD_SIZE bytes (no próprio datagrama recebido, sem cópia).
+static void write_file(const SfpWrReq* req, const char* bulk, SfpWrRep* res, int append) {
     // 1. Inicializa a Resposta
-    res->msg_type = SFP_MSG_WR_REP;
-    res->owner = req->owner;
-    strncpy(res->path, req->path, SFP_MAX_PATH_LEN);
-    res->path_len = req->path_len;
-    memset(res->payload, 0, SFP_PAYLOAD_SIZE);
-    res->offset = req->offset; 
+    res->hdr.msg_type = append ? SFP_MSG_AP_REP : SFP_MSG_WR_REP;
+    res->hdr.owner = req->hdr.owner;
+    res->offset = req->offset;
+    res->handle = req->handle;
+    int len = sfp_rw_len(req->length);
+    const char* data = len > SFP_PAYLOAD_SIZE ? bulk : req->payload;
+
+    // 2. Validação de Permissões (passada única sobre o path, ou handle)
+    SfssPath p;
+    int rc = rw_target(req->hdr.owner, req->handle, req->path, &p);
+    if (rc != SFP_SUCCESS) {
+        if (rc == SFP_ERR_BAD_HANDLE)
+            printf("Servidor: ERRO (WR) Handle %d inválido para o owner %d\n", req->handle, req->hdr.owner);
+        else
+            printf("Servidor: ERRO (WR) Permissão negada. Owner %d tenta acessar %.*s\n", req->hdr.owner, SFP_PATH_CAP, req->path);
+        strncpy(res->path, req->path, SFP_PATH_CAP);
+        res->path_len = req->path_len;
+        res->offset = rc;
+        return;
+    }
+    res->path_len = copy_reply_path(res->path, &p);
+
+    // 3. Construção do Path Real
+    char full_path[SFP_MAX_PATH_LEN + 256];
+    if (!build_full_path(full_path, sizeof(full_path), &p, NULL)) {
+        res->offset = SFP_ERR_IO;
+        return;
+    }
+
+    // 4. Lógica de Remoção (só no WR com o bloco padrão de 16 bytes)
+    if (!append && req->length == 0 && req->offset == 0 && req->payload[0] == '\0') {
+        printf("Servidor: (WR) Lógica de REMOÇÃO ativada para %s\n", full_path);
+        long long old_size = item_size(p.norm, p.len, full_path);
+        int in_sync = area_sync_begin(p.area);
+        int status = unlink(full_path);
+        area_sync_end(p.area, in_sync);
+        if (status == 0) {
+            printf("Servidor: (WR) Arquivo removido com sucesso.\n");
+            quota_release(p.area, old_size, 1);
+            index_remove(p.norm, p.len);
+            watch_note(p.norm, p.len, SFP_NT_REMOVED);
+            crc_remove_sidecar(full_path);
+            res->offset = 0;
+        } else {
+            perror("Servidor: ERRO (WR) falha ao remover arquivo");
+            res->offset = SFP_ERR_IO;
+        }
+        return;
+    }
+
+    // 5. Lógica de Escrita / Criação
+    // crc_lock mantém dado e sidecar consistentes para o scrubber
+    pthread_mutex_lock(&crc_lock);
+    int created = 0;
+    FILE *file = fopen(full_path, "r+b"); 
+    if (file == NULL) {
+        printf("Servidor: (WR) Arquivo não existe. Criando %s...\n", full_path);
+        if (!quota_charge(p.area, 0, 1)) {
+            printf("Servidor: ERRO (WR) Cota de inodes da área A%d esgotada\n", p.area);
+            res->offset = SFP_ERR_QUOTA;
+            pthread_mutex_unlock(&crc_lock);
+            return;
+        }
+        int in_sync = area_sync_begin(p.area);
+        file = fopen(full_path, "w+b"); 
+        area_sync_end(p.area, in_sync);
+        if (file == NULL) {
+            perror("Servidor: ERRO (WR) Falha ao criar arquivo");
+            quota_release(p.area, 0, 1);
+            res->offset = SFP_ERR_NOT_FOUND;
+            pthread_mutex_unlock(&crc_lock);
+            return;
+        }
+        created = 1;
+    }
+
+    // 6. Lógica de "Buracos"
+    fseek(file, 0, SEEK_END);
+    long file_size = ftell(file);
+    long offset = append ? file_size : req->offset;
+
+    // Cota: o crescimento inclui o buraco preenchido
+    long long growth = (long long)offset + len - file_size;
+    if (growth > 0 && !quota_charge(p.area, growth, 0)) {
+        printf("Servidor: ERRO (WR) Cota de bytes da área A%d esgotada (+%lld)\n", p.area, growth);
+        res->offset = SFP_ERR_QUOTA;
+        fclose(file);
+        if (created) {
+            unlink(full_path);
+            quota_release(p.area, 0, 1);
+        }
+        pthread_mutex_unlock(&crc_lock);
+        return;
+    }
+    if (offset > file_size) {
+        printf("Servidor: (WR) Offset > tamanho. Preenchendo buraco de %ld até %ld\n", file_size, offset);
+        char whitespace = 0x20; 
+        fseek(file, file_size, SEEK_SET); 
+        for (long i = file_size; i < offset; i++) {
+            if (fwrite(&whitespace, 1, 1, file) != 1) {
+                 perror("Servidor: ERRO (WR) Falha ao preencher buraco");
+                 res->offset = SFP_ERR_IO;
+                 quota_settle(file, p.area, file_size, growth);
+                 fclose(file);
+                 pthread_mutex_unlock(&crc_lock);
+                 return;
+            }
+        }
+    }
+
+    // 7. Escrita Final
+    if (fseek(file, offset, SEEK_SET) != 0) {
+        perror("Servidor: ERRO (WR) Falha no fseek para o offset");
+        res->offset = SFP_ERR_IO;
+        quota_settle(file, p.area, file_size, growth);
+        fclose(file);
+        pthread_mutex_unlock(&crc_lock);
+        return;
+    }
+    size_t bytes_written = fwrite(data, 1, len, file);
+    if (bytes_written != (size_t)len) {
+        perror("Servidor: ERRO (WR) Falha ao escrever payload");
+        res->offset = SFP_ERR_IO;
+        quota_settle(file, p.area, file_size, growth);
+    } else {
+        printf("Servidor: (%s) Sucesso. Escreveu %zu bytes em %s @ offset %ld\n",
+               append ? "AP" : "WR", bytes_written, full_path, offset);
+        res->offset = (int)offset;
+        if (req->length != 0) res->length = (int)bytes_written;
+        long end = offset + len;
+        index_put(p.norm, p.len, end > file_size ? end : file_size, time(NULL), 0);
+        watch_note(p.norm, p.len, created ? SFP_NT_CREATED | SFP_NT_WRITTEN : SFP_NT_WRITTEN);
+
+        // 8. Checksums dos blocos tocados (inclui o buraco preenchido)
+        fflush(file);
+        long first = ((offset < file_size) ? offset : file_size) / SFSS_CRC_BLOCK;
+        long last = (end - 1) / SFSS_CRC_BLOCK;
+        if (crc_update_range(fileno(file), full_path, first, last, created) != 0) {
+            perror("Servidor: AVISO (WR) falha ao atualizar checksums");
+        }
+    }
+    fclose(file);
+    pthread_mutex_unlock(&crc_lock);
+}
+
+void handle_wr_req(const SfpWrReq* req, const char* bulk, SfpWrRep* res) {
+    write_file(req, bulk, res, 0);
+}
+
+void handle_ap_req(const SfpApReq* req, const char* bulk, SfpApRep* res) {
+    write_file(req, bulk, res, 1);
+}
+
+void handle_tr_req(const SfpTrReq* req, SfpTrRep* res) {
+    // 1. Inicializa a Resposta
+    res->hdr.msg_type = SFP_MSG_TR_REP;
+    res->hdr.owner = req->hdr.owner;
+    res->offset = req->offset;
+    res->handle = req->handle;
+
+    // 2. Validação de Permissões (passada única sobre o path, ou handle)
+    SfssPath p;
+    int rc = rw_target(req->hdr.owner, req->handle, req->path, &p);
+    if (rc != SFP_SUCCESS) {
+        if (rc == SFP_ERR_BAD_HANDLE)
+            printf("Servidor: ERRO (TR) Handle %d inválido para o owner %d\n", req->handle, req->hdr.owner);
+        else
+            printf("Servidor: ERRO (TR) Permissão negada. Owner %d tenta truncar %.*s\n", req->hdr.owner, SFP_PATH_CAP, req->path);
+        strncpy(res->path, req->path, SFP_PATH_CAP);
+        res->path_len = req->path_len;
+        res->offset = rc;
+        return;
+    }
+    res->path_len = copy_reply_path(res->path, &p);
+
+    // 3. Construção do Path Real
+    char full_path[SFP_MAX_PATH_LEN + 256];
+    if (!build_full_path(full_path, sizeof(full_path), &p, NULL)) {
+        res->offset = SFP_ERR_IO;
+        return;
+    }
+    if (req->offset < 0) {
+        res->offset = SFP_ERR_OFFSET_OOB;
+        return;
+    }
+
+    // 4. Novo tamanho (crescer completa com zeros, como ftruncate)
+    pthread_mutex_lock(&crc_lock);
+    int fd = open(full_path, O_RDWR);
+    int missing = (fd < 0 && errno == ENOENT);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        printf("Servidor: ERRO (TR) Falha ao abrir %s\n", full_path);
+        if (missing) index_remove(p.norm, p.len);
+        res->offset = missing ? SFP_ERR_NOT_FOUND : SFP_ERR_IO;
+        if (fd >= 0) close(fd);
+        pthread_mutex_unlock(&crc_lock);
+        return;
+    }
+    long long new_size = req->offset;
+    long long growth = new_size - st.st_size;
+    if (growth > 0 && !quota_charge(p.area, growth, 0)) {
+        printf("Servidor: ERRO (TR) Cota de bytes da área A%d esgotada (+%lld)\n", p.area, growth);
+        res->offset = SFP_ERR_QUOTA;
+        close(fd);
+        pthread_mutex_unlock(&crc_lock);
+        return;
+    }
+    if (ftruncate(fd, (off_t)new_size) != 0) {
+        perror("Servidor: ERRO (TR) Falha ao truncar arquivo");
+        if (growth > 0) quota_release(p.area, growth, 0);
+        res->offset = SFP_ERR_IO;
+        close(fd);
+        pthread_mutex_unlock(&crc_lock);
+        return;
+    }
+    if (growth < 0) quota_release(p.area, -growth, 0);
+    index_put(p.norm, p.len, new_size, time(NULL), 0);
+    watch_note(p.norm, p.len, SFP_NT_WRITTEN);
+
+    // 5. Checksums: recalcula a partir do bloco onde o tamanho mudou e corta
+    // o sidecar no novo número de blocos
+    long first = (long)((new_size < st.st_size ? new_size : st.st_size) / SFSS_CRC_BLOCK);
+    long last = (long)((new_size + SFSS_CRC_BLOCK - 1) / SFSS_CRC_BLOCK) - 1;
+    char side[SFP_MAX_PATH_LEN + 512];
+    if (crc_update_range(fd, full_path, first, last, new_size == 0) != 0 ||
+        !crc_sidecar_path(side, sizeof(side), full_path) ||
+        truncate(side, (off_t)(last + 1) * (off_t)sizeof(uint32_t)) != 0) {
+        perror("Servidor: AVISO (TR) falha ao atualizar checksums");
+    }
+    close(fd);
+    pthread_mutex_unlock(&crc_lock);
+    printf("Servidor: (TR) Sucesso. %s: %lld -> %lld bytes\n", full_path, (long long)st.st_size, new_size);
+}
+
+void handle_cp_req(const SfpCpReq* req, SfpCpRep* res) {
+    // 1. Inicializa a Resposta (path = destino)
+    res->hdr.msg_type = SFP_MSG_CP_REP;
+    res->hdr.owner = req->hdr.owner;
+    res->offset = SFP_SUCCESS;
+
+    // 2. Validação de Permissões: origem e destino, ambos do owner
+    SfssPath src, dst;
+    if (!validate_path(req->hdr.owner, req->path, &src) || !validate_path(req->hdr.owner, req->dst, &dst)) {
+        printf("Servidor: ERRO (CP) Permissão negada. Owner %d tenta copiar %.*s -> %.*s\n",
+               req->hdr.owner, SFP_PATH_CAP, req->path, SFP_PATH_CAP, req->dst);
+        strncpy(res->path, req->dst, SFP_PATH_CAP);
+        res->path_len = req->dst_len;
+        res->offset = SFP_ERR_PERMISSION;
+        return;
+    }
+    res->path_len = copy_reply_path(res->path, &dst);
+
+    // 3. Construção dos Paths Reais
+    char src_full[SFP_MAX_PATH_LEN + 256], dst_full[SFP_MAX_PATH_LEN + 256];
+    if (!build_full_path(src_full, sizeof(src_full), &src, NULL) ||
+        !build_full_path(dst_full, sizeof(dst_full), &dst, NULL) ||
+        (src.len == dst.len && memcmp(src.norm, dst.norm, src.len) == 0)) {
+        res->offset = SFP_ERR_IO; // Inclui copiar um arquivo sobre ele mesmo
+        return;
+    }
+    if (req->offset < 0 || req->length < 0) {
+        res->offset = SFP_ERR_OFFSET_OOB;
+        return;
+    }
+
+    // 4. Origem e trecho
+    pthread_mutex_lock(&crc_lock);
+    int in = open(src_full, O_RDONLY);
+    struct stat st;
+    if (in < 0 || fstat(in, &st) != 0 || S_ISDIR(st.st_mode)) {
+        printf("Servidor: ERRO (CP) Arquivo não encontrado: %s\n", src_full);
+        res->offset = SFP_ERR_NOT_FOUND;
+        if (in >= 0) close(in);
+        pthread_mutex_unlock(&crc_lock);
+        return;
+    }
+    if (req->offset > st.st_size) {
+        printf("Servidor: ERRO (CP) Offset fora dos limites. Size: %lld, Offset: %d\n", (long long)st.st_size, req->offset);
+        res->offset = SFP_ERR_OFFSET_OOB;
+        close(in);
+        pthread_mutex_unlock(&crc_lock);
+        return;
+    }
+    long long count = st.st_size - req->offset;
+    if (req->length > 0 && req->length < count) count = req->length;
+
+    // 5. Destino: substituído pelo trecho; a cota cobra só a diferença
+    struct stat dst_st;
+    int exists = (stat(dst_full, &dst_st) == 0);
+    if (exists && S_ISDIR(dst_st.st_mode)) {
+        printf("Servidor: ERRO (CP) Destino é um diretório: %s\n", dst_full);
+        res->offset = SFP_ERR_PERMISSION;
+        close(in);
+        pthread_mutex_unlock(&crc_lock);
+        return;
+    }
+    long long net = count - (exists ? (long long)dst_st.st_size : 0);
+    if (!quota_charge(dst.area, net > 0 ? net : 0, exists ? 0 : 1)) {
+        printf("Servidor: ERRO (CP) Cota da área A%d esgotada (+%lld)\n", dst.area, net);
+        res->offset = SFP_ERR_QUOTA;
+        close(in);
+        pthread_mutex_unlock(&crc_lock);
+        return;
+    }
+    int in_sync = area_sync_begin(dst.area);
+    int out = open(dst_full, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    area_sync_end(dst.area, in_sync);
+    if (out < 0) {
+        perror("Servidor: ERRO (CP) Falha ao abrir destino");
+        quota_release(dst.area, net > 0 ? net : 0, exists ? 0 : 1);
+        res->offset = SFP_ERR_IO;
+        close(in);
+        pthread_mutex_unlock(&crc_lock);
+        return;
+    }
+    if (net < 0) quota_release(dst.area, -net, 0);
+
+    // 6. Cópia em blocos alinhados: cada pedaço da origem é conferido contra
+    // o sidecar antes de ir para o destino (corrupção não se propaga)
+    unsigned char buf[SFSS_CRC_CHUNK_BLOCKS * SFSS_CRC_BLOCK];
+    long long end = req->offset + count, copied = 0;
+    long long pos = req->offset / SFSS_CRC_BLOCK * SFSS_CRC_BLOCK;
+    int unverified = 0;
+    while (pos < end && res->offset == SFP_SUCCESS) {
+        long long left = (end - pos + SFSS_CRC_BLOCK - 1) / SFSS_CRC_BLOCK;
+        int n = left < SFSS_CRC_CHUNK_BLOCKS ? (int)left : SFSS_CRC_CHUNK_BLOCKS;
+        if (crc_read_blocks(in, pos / SFSS_CRC_BLOCK, n, buf) != 0) {
+            res->offset = SFP_ERR_IO;
+            break;
+        }
+        if (crc_verify_on_read) {
+            int nbad = crc_verify_blocks(src_full, pos / SFSS_CRC_BLOCK, n, buf, NULL);
+            if (nbad > 0) {
+                printf("Servidor: ERRO (CP) Checksum divergente em %s @ offset %lld\n", src_full, pos);
+                __atomic_add_fetch(&crc_mismatches, 1, __ATOMIC_RELAXED);
+                res->offset = SFP_ERR_CORRUPT;
+                break;
+            }
+            if (nbad < 0) unverified = 1;
+        }
+        long long from = pos > req->offset ? pos : req->offset;
+        long long to = pos + (long long)n * SFSS_CRC_BLOCK < end ? pos + (long long)n * SFSS_CRC_BLOCK : end;
+        if (write(out, buf + (from - pos), (size_t)(to - from)) != (ssize_t)(to - from)) {
+            perror("Servidor: ERRO (CP) Falha ao escrever destino");
+            res->offset = SFP_ERR_IO;
+            break;
+        }
+        copied += to - from;
+        pos += (long long)n * SFSS_CRC_BLOCK;
+    }
+    if (unverified) __atomic_add_fetch(&crc_unverified_reads, 1, __ATOMIC_RELAXED);
+    if (copied < count) quota_release(dst.area, count - copied, 0);
+
+    // 7. Destino com checksums novos e metadados no índice
+    if (crc_update_range(out, dst_full, 0, (long)((copied + SFSS_CRC_BLOCK - 1) / SFSS_CRC_BLOCK) - 1, 1) != 0) {
+        perror("Servidor: AVISO (CP) falha ao atualizar checksums");
+    }
+    index_put(dst.norm, dst.len, copied, time(NULL), 0);
+    watch_note(dst.norm, dst.len, exists ? SFP_NT_WRITTEN : SFP_NT_CREATED | SFP_NT_WRITTEN);
+    res->length = copied > INT32_MAX ? INT32_MAX : (int)copied;
+    close(out);
+    close(in);
+    pthread_mutex_unlock(&crc_lock);
+    if (res->offset == SFP_SUCCESS)
+        printf("Servidor: (CP) Sucesso. Copiou %lld bytes de %s @ offset %d para %s\n", copied, src_full, req->offset, dst_full);
+}
 
-    // 2. Validação de Permissões (CORRIGIDO)
-    if (!check_permission(req->owner, req->path, strlen(req->path))) {
-        printf("Servidor: ERRO (WR) Permissão negada. Owner %d tenta acessar %s\n", req->owner, req->path);
+void handle_rn_req(const SfpRnReq* req, SfpRnRep* res) {
+    // 1. Inicializa a Resposta (path = destino)
+    res->hdr.msg_type = SFP_MSG_RN_REP;
+    res->hdr.owner = req->hdr.owner;
+    res->offset = SFP_SUCCESS;
+
+    // 2. Validação de Permissões: origem e destino, ambos do owner
+    SfssPath src, dst;
+    if (!validate_path(req->hdr.owner, req->path, &src) || !validate_path(req->hdr.owner, req->dst, &dst)) {
+        printf("Servidor: ERRO (RN) Permissão negada. Owner %d tenta renomear %.*s -> %.*s\n",
+               req->hdr.owner, SFP_PATH_CAP, req->path, SFP_PATH_CAP, req->dst);
+        strncpy(res->path, req->dst, SFP_PATH_CAP);
+        res->path_len = req->dst_len;
         res->offset = SFP_ERR_PERMISSION;
         return;
     }
+    res->path_len = copy_reply_path(res->path, &dst);
 
-    // 3. Construção do Path Real
-    char full_path[SFP_MAX_PATH_LEN + 256];
-    snprintf(full_path, sizeof(full_path), "%s%s", SFSS_ROOT_DIR, req->path);
-
-    // 4. Lógica de Remoção
-    if (req->offset == 0 && req->payload[0] == '\0') {
-        printf("Servidor: (WR) Lógica de REMOÇÃO ativada para %s\n", full_path);
-        if (unlink(full_path) == 0) {
-            printf("Servidor: (WR) Arquivo removido com sucesso.\n");
-            res->offset = 0;
-        } else {
-            perror("Servidor: ERRO (WR) falha ao remover arquivo");
-            res->offset = SFP_ERR_IO;
-        }
+    // 3. Construção dos Paths Reais
+    char src_full[SFP_MAX_PATH_LEN + 256], dst_full[SFP_MAX_PATH_LEN + 256];
+    if (!build_full_path(src_full, sizeof(src_full), &src, NULL) ||
+        !build_full_path(dst_full, sizeof(dst_full), &dst, NULL)) {
+        res->offset = SFP_ERR_IO;
         return;
     }
+    if (src.len == dst.len && memcmp(src.norm, dst.norm, src.len) == 0) return;
 
-    // 5. Lógica de Escrita / Criação
-    FILE *file = fopen(full_path, "r+b"); 
-    if (file == NULL) {
-        printf("Servidor: (WR) Arquivo não existe. Criando %s...\n", full_path);
-        file = fopen(full_path, "w+b"); 
-        if (file == NULL) {
-            perror("Servidor: ERRO (WR) Falha ao criar arquivo");
-            res->offset = SFP_ERR_NOT_FOUND;
-            return;
-        }
+    // 4. Só arquivos (renomear diretórios invalidaria o índice de uma subárvore)
+    pthread_mutex_lock(&crc_lock);
+    struct stat st, dst_st;
+    if (lstat(src_full, &st) != 0 || S_ISDIR(st.st_mode)) {
+        printf("Servidor: ERRO (RN) Arquivo não encontrado: %s\n", src_full);
+        res->offset = SFP_ERR_NOT_FOUND;
+        pthread_mutex_unlock(&crc_lock);
+        return;
     }
-
-    // 6. Lógica de "Buracos"
-    fseek(file, 0, SEEK_END);
-    long file_size = ftell(file);
-    if (req->offset > file_size) {
-        printf("Servidor: (WR) Offset > tamanho. Preenchendo buraco de %ld até %d\n", file_size, req->offset);
-        char whitespace = 0x20; 
-        fseek(file, file_size, SEEK_SET); 
-        for (long i = file_size; i < req->offset; i++) {
-            if (fwrite(&whitespace, 1, 1, file) != 1) {
-                 perror("Servidor: ERRO (WR) Falha ao preencher buraco");
-                 res->offset = SFP_ERR_IO;
-                 fclose(file);
-                 return;
-            }
-        }
+    int exists = (lstat(dst_full, &dst_st) == 0);
+    if (exists && S_ISDIR(dst_st.st_mode)) {
+        printf("Servidor: ERRO (RN) Destino é um diretório: %s\n", dst_full);
+        res->offset = SFP_ERR_PERMISSION;
+        pthread_mutex_unlock(&crc_lock);
+        return;
     }
 
-    // 7. Escrita Final
-    if (fseek(file, req->offset, SEEK_SET) != 0) {
-        perror("Servidor: ERRO (WR) Falha no fseek para o offset");
-        res->offset = SFP_ERR_IO;
-        fclose(file);
+    // 5. Cota: entre áreas, o arquivo passa a contar no destino
+    int cross = (src.area != dst.area);
+    if (cross && !quota_charge(dst.area, st.st_size, 1)) {
+        printf("Servidor: ERRO (RN) Cota da área A%d esgotada (+%lld)\n", dst.area, (long long)st.st_size);
+        res->offset = SFP_ERR_QUOTA;
+        pthread_mutex_unlock(&crc_lock);
         return;
     }
-    size_t bytes_written = fwrite(req->payload, 1, SFP_PAYLOAD_SIZE, file);
-    if (bytes_written != SFP_PAYLOAD_SIZE) {
-        perror("Servidor: ERRO (WR) Falha ao escrever payload");
+    int src_sync = area_sync_begin(src.area);
+    int dst_sync = cross ? area_sync_begin(dst.area) : 0;
+    int status = rename(src_full, dst_full);
+    area_sync_end(src.area, src_sync);
+    if (cross) area_sync_end(dst.area, dst_sync);
+    if (status != 0) {
+        perror("Servidor: ERRO (RN) falha ao renomear arquivo");
+        if (cross) quota_release(dst.area, st.st_size, 1);
         res->offset = SFP_ERR_IO;
-    } else {
-        printf("Servidor: (WR) Sucesso. Escreveu %zu bytes em %s @ offset %d\n", bytes_written, full_path, req->offset);
+        pthread_mutex_unlock(&crc_lock);
+        return;
     }
-    fclose(file);
+    if (cross) quota_release(src.area, st.st_size, 1);
+    if (exists) quota_release(dst.area, dst_st.st_size, 1);
+
+    // 6. O sidecar acompanha o arquivo (o do destino substituído sai)
+    char src_side[SFP_MAX_PATH_LEN + 512], dst_side[SFP_MAX_PATH_LEN + 512];
+    if (crc_sidecar_path(src_side, sizeof(src_side), src_full) &&
+        crc_sidecar_path(dst_side, sizeof(dst_side), dst_full) &&
+        rename(src_side, dst_side) != 0) {
+        unlink(dst_side);
+    }
+    pthread_mutex_unlock(&crc_lock);
+    index_remove(src.norm, src.len);
+    index_put(dst.norm, dst.len, st.st_size, st.st_mtime, 0);
+    handle_rename(&src, &dst);
+    watch_note(src.norm, src.len, SFP_NT_REMOVED);
+    watch_note(dst.norm, dst.len, exists ? SFP_NT_WRITTEN : SFP_NT_CREATED);
+    printf("Servidor: (RN) Sucesso. %s -> %s\n", src_full, dst_full);
 }
 
-void handle_dc_req(const SfpMessage* req, SfpMessage* res) {
+void handle_dc_req(const SfpDcReq* req, SfpDcRep* res) {
     // 1. Inicializa a Resposta
-    res->msg_type = SFP_MSG_DC_REP;
-    res->owner = req->owner;
+    res->hdr.msg_type = SFP_MSG_DC_REP;
+    res->hdr.owner = req->hdr.owner;
 
-    // 2. Validação de Permissões (CORRIGIDO)
+    // 2. Validação de Permissões (passada única sobre o path)
     // A permissão é checada no 'path' base onde o diretório será criado
-    if (!check_permission(req->owner, req->path, strlen(req->path))) {
-        printf("Servidor: ERRO (DC) Permissão negada. Owner %d tenta criar em %s\n", req->owner, req->path);
-        strcpy(res->path, req->path);
+    SfssPath p;
+    if (!validate_path(req->hdr.owner, req->path, &p) || !validate_name(req->name)) {
+        printf("Servidor: ERRO (DC) Permissão negada. Owner %d tenta criar em %.*s\n", req->hdr.owner, SFP_PATH_CAP, req->path);
+        strncpy(res->path, req->path, SFP_PATH_CAP);
         res->path_len = SFP_ERR_PERMISSION; // Retorna erro
         return;
     }
+    copy_reply_path(res->path, &p);
 
     // 3. Construção do Path Real
     char full_new_path[SFP_MAX_PATH_LEN + 256];
-    snprintf(full_new_path, sizeof(full_new_path), "%s%s/%s", 
-             SFSS_ROOT_DIR, req->path, req->name);
+    if (!build_full_path(full_new_path, sizeof(full_new_path), &p, req->name)) {
+        res->path_len = SFP_ERR_IO;
+        return;
+    }
+
+    // O path criado volta na resposta: se não cabe no campo, nem cria
+    int new_len = (int)strlen(full_new_path) - (int)sfss_root_len;
+    if (new_len >= SFP_PATH_CAP) {
+        printf("Servidor: ERRO (DC) Path %s/%.*s longo demais para a resposta\n", p.norm, SFP_NAME_CAP, req->name);
+        res->path_len = SFP_ERR_PATH;
+        return;
+    }
 
     // 4. Operação de Criação de Diretório
-    if (mkdir(full_new_path, 0755) == 0) {
+    if (!quota_charge(p.area, 0, 1)) {
+        printf("Servidor: ERRO (DC) Cota de inodes da área A%d esgotada\n", p.area);
+        res->path_len = SFP_ERR_QUOTA;
+        return;
+    }
+    int in_sync = area_sync_begin(p.area);
+    int status = mkdir(full_new_path, 0755);
+    area_sync_end(p.area, in_sync);
+    if (status != 0) quota_release(p.area, 0, 1);
+    if (status == 0) {
         printf("Servidor: (DC) Diretório criado: %s\n", full_new_path);
-        snprintf(res->path, SFP_MAX_PATH_LEN, "%s/%s", req->path, req->name);
-        res->path_len = strlen(res->path);
+        // O novo path é o sufixo de 'full_new_path' após a raiz
+        memcpy(res->path, full_new_path + sfss_root_len, new_len + 1);
+        res->path_len = new_len;
+        index_put(res->path, new_len, 0, time(NULL), 1);
+        watch_note(res->path, new_len, SFP_NT_CREATED);
     } else {
         perror("Servidor: ERRO (DC) falha ao criar diretório");
-        strcpy(res->path, req->path);
         res->path_len = SFP_ERR_IO;
     }
 }
 
-void handle_dr_req(const SfpMessage* req, SfpMessage* res) {
+void handle_dr_req(const SfpDrReq* req, SfpDrRep* res) {
     // 1. Inicializa a Resposta
-    res->msg_type = SFP_MSG_DR_REP;
-    res->owner = req->owner;
-    strcpy(res->path, req->path); 
+    res->hdr.msg_type = SFP_MSG_DR_REP;
+    res->hdr.owner = req->hdr.owner;
 
-    // 2. Validação de Permissões (CORRIGIDO)
-    if (!check_permission(req->owner, req->path, strlen(req->path))) {
-        printf("Servidor: ERRO (DR) Permissão negada. Owner %d tenta remover de %s\n", req->owner, req->path);
+    // 2. Validação de Permissões (passada única sobre o path)
+    SfssPath p;
+    if (!validate_path(req->hdr.owner, req->path, &p) || !validate_name(req->name)) {
+        printf("Servidor: ERRO (DR) Permissão negada. Owner %d tenta remover de %.*s\n", req->hdr.owner, SFP_PATH_CAP, req->path);
+        strncpy(res->path, req->path, SFP_PATH_CAP);
         res->path_len = SFP_ERR_PERMISSION;
         return;
     }
+    copy_reply_path(res->path, &p);
 
     // 3. Construção do Path Real
     char full_target_path[SFP_MAX_PATH_LEN + 256];
-    snprintf(full_target_path, sizeof(full_target_path), "%s%s/%s", 
-             SFSS_ROOT_DIR, req->path, req->name);
+    if (!build_full_path(full_target_path, sizeof(full_target_path), &p, req->name)) {
+        res->path_len = SFP_ERR_IO;
+        return;
+    }
 
     // 4. Operação de Remoção
+    const char* target_rel = full_target_path + sfss_root_len;
+    int target_len = strlen(target_rel);
+    long long old_size = item_size(target_rel, target_len, full_target_path);
+    int in_sync = area_sync_begin(p.area);
     int status = unlink(full_target_path);
     if (status != 0) {
         status = rmdir(full_target_path);
     }
+    area_sync_end(p.area, in_sync);
     if (status == 0) {
         printf("Servidor: (DR) Item removido: %s\n", full_target_path);
-        res->path_len = strlen(res->path);
+        crc_remove_sidecar(full_target_path);
+        quota_release(p.area, old_size, 1);
+        res->path_len = p.len;
+        index_remove(target_rel, target_len);
+        watch_note(target_rel, target_len, SFP_NT_REMOVED);
     } else {
         perror("Servidor: ERRO (DR) falha ao remover item");
         res->path_len = SFP_ERR_IO;
     }
 }
 
-void handle_dl_req(const SfpMessage* req, SfpMessage* res) {
+// Ordem das páginas do DL
+static int cmp_names(const void* a, const void* b) {
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+void handle_dl_req(const SfpDlReq* req, SfpDlRep* res, SfpBulk* body) {
+    SfpDlList* list = &body->list;
     // 1. Inicializa a Resposta
-    res->msg_type = SFP_MSG_DL_REP;
-    res->owner = req->owner;
+    res->hdr.msg_type = SFP_MSG_DL_REP;
+    res->hdr.owner = req->hdr.owner;
     res->nrnames = 0;
-    memset(res->allfilenames, 0, SFP_MAX_ALLFILENAMES_LEN);
-    memset(res->fstlstpositions, 0, sizeof(SfpFstLst) * SFP_MAX_NAMES_IN_DIR);
+    memset(list, 0, sizeof(SfpDlList));
 
-    // 2. Validação de Permissões (CORRIGIDO)
-    if (!check_permission(req->owner, req->path, strlen(req->path))) {
-        printf("Servidor: ERRO (DL) Permissão negada. Owner %d tenta listar %s\n", req->owner, req->path);
+    // 2. Validação de Permissões (passada única sobre o path)
+    SfssPath p;
+    if (!validate_path(req->hdr.owner, req->path, &p)) {
+        printf("Servidor: ERRO (DL) Permissão negada. Owner %d tenta listar %.*s\n", req->hdr.owner, SFP_PATH_CAP, req->path);
         res->nrnames = SFP_ERR_PERMISSION;
         return;
     }
 
     // 3. Construção do Path Real
     char full_path[SFP_MAX_PATH_LEN + 256];
-    snprintf(full_path, sizeof(full_path), "%s%s", SFSS_ROOT_DIR, req->path);
+    if (!build_full_path(full_path, sizeof(full_path), &p, NULL)) {
+        res->nrnames = SFP_ERR_IO;
+        return;
+    }
 
-    // 4. Operação de Leitura de Diretório
+    // 4. Leitura do Diretório: nomes após o cursor, ordenados para que as
+    // páginas sejam estáveis mesmo com o diretório mudando entre elas
     DIR *d = opendir(full_path);
     if (d == NULL) {
         perror("Servidor: ERRO (DL) falha ao abrir diretório");
         res->nrnames = SFP_ERR_NOT_FOUND;
         return;
     }
-
+    int paged = req->paged;
+    res->paged = paged;
+    char** names = NULL;
+    int count = 0, cap = 0;
     struct dirent *dir_entry;
-    int current_name_index = 0;
-    int current_char_index = 0;
-
     while ((dir_entry = readdir(d)) != NULL) {
-        if (strcmp(dir_entry->d_name, ".") == 0 || strcmp(dir_entry->d_name, "..") == 0) {
+        const char* name = dir_entry->d_name;
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0 || is_crc_sidecar(name, strlen(name))) {
+            continue;
+        }
+        // O cursor guarda só os primeiros SFP_NAME_CAP - 1 bytes do nome
+        if (paged && strncmp(name, req->cursor, SFP_NAME_CAP - 1) <= 0) {
             continue;
         }
-        if (current_name_index >= SFP_MAX_NAMES_IN_DIR) {
-            break; 
+        if (count == cap) {
+            int new_cap = cap ? cap * 2 : 64;
+            char** grown = realloc(names, sizeof(char*) * new_cap);
+            if (grown == NULL) break;
+            names = grown;
+            cap = new_cap;
         }
+        if ((names[count] = strdup(name)) == NULL) break;
+        count++;
+    }
+    closedir(d);
+    if (count > 1) qsort(names, count, sizeof(char*), cmp_names);
+
+    // 5. Montagem da Página: sem paginação, os limites antigos (o resto é
+    // descartado); com ela, também o orçamento de bytes no fio, contando só
+    // o sufixo que não repete o nome anterior
+    int max_names = paged ? SFP_DL_PAGE_NAMES : SFP_MAX_NAMES_IN_DIR;
+    int max_chars = paged ? SFP_DL_PAGE_CHARS : SFP_MAX_ALLFILENAMES_LEN;
+    int current_name_index = 0;
+    int current_char_index = 0;
+    int wire_bytes = 0;
+    const char* prev = "";
 
-        char* name = dir_entry->d_name;
+    for (int i = 0; i < count && current_name_index < max_names; i++) {
+        const char* name = names[i];
         int name_len = strlen(name);
-        if (current_char_index + name_len >= SFP_MAX_ALLFILENAMES_LEN) {
+        if (current_char_index + name_len >= max_chars) {
             break;
         }
+        if (paged) {
+            int shared = 0;
+            while (shared < 255 && name[shared] != '\0' && name[shared] == prev[shared]) shared++;
+            if (current_name_index > 0 && wire_bytes + 4 + name_len - shared > SFP_DL_PAGE_BYTES) {
+                break;
+            }
+            wire_bytes += 4 + name_len - shared;
+            prev = name;
+        }
 
+        // Tipo vem do índice; sem entrada, faz stat() e indexa
         int is_dir = 0;
         char entry_full_path[SFP_MAX_PATH_LEN + 512];
         snprintf(entry_full_path, sizeof(entry_full_path), "%s/%s", full_path, name);
+        const char* entry_path = entry_full_path + sfss_root_len;
+        int entry_len = strlen(entry_path);
 
+        SfssIndexEntry meta;
         struct stat st;
-        if (stat(entry_full_path, &st) == 0) {
+        if (entry_len < SFP_MAX_PATH_LEN && index_get(entry_path, entry_len, &meta)) {
+            is_dir = meta.is_dir;
+        } else if (stat(entry_full_path, &st) == 0) {
             if (S_ISDIR(st.st_mode)) {
                 is_dir = 1;
             }
+            if (entry_len < SFP_MAX_PATH_LEN) {
+                index_put(entry_path, entry_len, S_ISDIR(st.st_mode) ? 0 : st.st_size, st.st_mtime, is_dir);
+            }
         }
-        res->fstlstpositions[current_name_index].start_index = current_char_index;
-        res->fstlstpositions[current_name_index].end_index = current_char_index + name_len - 1;
-        res->fstlstpositions[current_name_index].is_dir = is_dir;
+        list->fstlstpositions[current_name_index].start_index = current_char_index;
+        list->fstlstpositions[current_name_index].end_index = current_char_index + name_len - 1;
+        list->fstlstpositions[current_name_index].is_dir = is_dir;
 
-        memcpy(&res->allfilenames[current_char_index], name, name_len);
+        memcpy(&list->allfilenames[current_char_index], name, name_len);
         current_char_index += name_len;
         current_name_index++;
     }
-    closedir(d);
     res->nrnames = current_name_index;
-    printf("Servidor: (DL) Sucesso. Listando %d itens de %s\n", res->nrnames, full_path);
+
+    // 6. Cursor: o último nome enviado, se ainda sobraram nomes
+    if (paged && current_name_index < count) {
+        const SfpFstLst* last = &list->fstlstpositions[current_name_index - 1];
+        int n = last->end_index - last->start_index + 1;
+        if (n > SFP_NAME_CAP - 1) n = SFP_NAME_CAP - 1;
+        memcpy(res->cursor, &list->allfilenames[last->start_index], n);
+        res->cursor[n] = '\0';
+        res->cursor_len = n;
+    }
+    for (int i = 0; i < count; i++) free(names[i]);
+    free(names);
+    if (res->cursor_len > 0)
+        printf("Servidor: (DL) Sucesso. Listando %d itens de %s (página; continua após '%s')\n",
+               res->nrnames, full_path, res->cursor);
+    else
+        printf("Servidor: (DL) Sucesso. Listando %d itens de %s\n", res->nrnames, full_path);
+}
+
+void handle_ga_req(const SfpGaReq* req, SfpGaRep* res) {
+    // 1. Inicializa a Resposta
+    res->hdr.msg_type = SFP_MSG_GA_REP;
+    res->hdr.owner = req->hdr.owner;
+    res->status = SFP_SUCCESS;
+
+    // 2. Validação de Permissões (passada única sobre o path)
+    SfssPath p;
+    if (!validate_path(req->hdr.owner, req->path, &p)) {
+        printf("Servidor: ERRO (GA) Permissão negada. Owner %d tenta consultar %.*s\n", req->hdr.owner, SFP_PATH_CAP, req->path);
+        res->status = SFP_ERR_PERMISSION;
+        return;
+    }
+
+    // 3. Metadados vêm do índice; sem entrada, faz stat() e indexa
+    SfssIndexEntry meta;
+    if (!index_get(p.norm, p.len, &meta)) {
+        char full_path[SFP_MAX_PATH_LEN + 256];
+        struct stat st;
+        if (!build_full_path(full_path, sizeof(full_path), &p, NULL)) {
+            res->status = SFP_ERR_IO;
+            return;
+        }
+        if (stat(full_path, &st) != 0) {
+            printf("Servidor: ERRO (GA) Item não encontrado: %s\n", full_path);
+            res->status = SFP_ERR_NOT_FOUND;
+            return;
+        }
+        index_put(p.norm, p.len, S_ISDIR(st.st_mode) ? 0 : st.st_size, st.st_mtime, S_ISDIR(st.st_mode) ? 1 : 0);
+        if (!index_get(p.norm, p.len, &meta)) {
+            res->status = SFP_ERR_IO;
+            return;
+        }
+    }
+    res->is_dir = meta.is_dir;
+    res->size = meta.is_dir ? 0 : meta.size;
+    res->mtime = meta.mtime;
+    res->version = meta.version;
+    printf("Servidor: (GA) Sucesso. %s: %s, %lld bytes, versão %llu\n",
+           p.norm, meta.is_dir ? "diretório" : "arquivo", res->size, res->version);
+}
+
+void handle_op_req(const SfpOpReq* req, SfpOpRep* res) {
+    res->hdr.msg_type = SFP_MSG_OP_REP;
+    res->hdr.owner = req->hdr.owner;
+
+    // Validação feita uma única vez; os RD/WR por handle não repetem
+    SfssPath p;
+    if (!validate_path(req->hdr.owner, req->path, &p)) {
+        printf("Servidor: ERRO (OP) Permissão negada. Owner %d tenta abrir %.*s\n", req->hdr.owner, SFP_PATH_CAP, req->path);
+        res->handle = SFP_ERR_PERMISSION;
+        return;
+    }
+    res->handle = handle_open(req->hdr.owner, &p);
+    if (res->handle < 0) {
+        printf("Servidor: ERRO (OP) Tabela de handles cheia (%d)\n", SFSS_MAX_HANDLES);
+        return;
+    }
+    printf("Servidor: (OP) Sucesso. %s aberto pelo owner %d -> handle %d\n", p.norm, req->hdr.owner, res->handle);
+}
+
+void handle_cl_req(const SfpClReq* req, SfpClRep* res) {
+    res->hdr.msg_type = SFP_MSG_CL_REP;
+    res->hdr.owner = req->hdr.owner;
+    res->handle = handle_close(req->hdr.owner, req->handle);
+    if (res->handle == SFP_SUCCESS) printf("Servidor: (CL) Handle %d fechado\n", req->handle);
+    else printf("Servidor: ERRO (CL) Handle %d inválido para o owner %d\n", req->handle, req->hdr.owner);
+}
+
+// WATCH/UNWATCH: o path precisa existir para ser assinado
+void handle_wa_req(const SfpWaReq* req, SfpWaRep* res) {
+    res->hdr.msg_type = SFP_MSG_WA_REP;
+    res->hdr.owner = req->hdr.owner;
+
+    SfssPath p;
+    if (!validate_path(req->hdr.owner, req->path, &p)) {
+        printf("Servidor: ERRO (WA) Permissão negada. Owner %d tenta assinar %.*s\n", req->hdr.owner, SFP_PATH_CAP, req->path);
+        strncpy(res->path, req->path, SFP_PATH_CAP);
+        res->path_len = SFP_ERR_PERMISSION;
+        return;
+    }
+    copy_reply_path(res->path, &p);
+    char full_path[SFP_MAX_PATH_LEN + 256];
+    struct stat st;
+    if (!build_full_path(full_path, sizeof(full_path), &p, NULL) || stat(full_path, &st) != 0) {
+        printf("Servidor: ERRO (WA) Item não encontrado: %s\n", p.norm);
+        res->path_len = SFP_ERR_NOT_FOUND;
+        return;
+    }
+    res->path_len = watch_add(req->hdr.owner, &p);
+    if (res->path_len < 0) {
+        printf("Servidor: ERRO (WA) Tabela de assinaturas cheia (%d)\n", SFSS_MAX_WATCHES);
+        return;
+    }
+    res->path_len = p.len;
+    printf("Servidor: (WA) Owner %d assinou %s\n", req->hdr.owner, p.norm);
+}
+
+void handle_uw_req(const SfpUwReq* req, SfpUwRep* res) {
+    res->hdr.msg_type = SFP_MSG_UW_REP;
+    res->hdr.owner = req->hdr.owner;
+
+    SfssPath p;
+    if (!validate_path(req->hdr.owner, req->path, &p)) {
+        printf("Servidor: ERRO (UW) Permissão negada. Owner %d tenta cancelar %.*s\n", req->hdr.owner, SFP_PATH_CAP, req->path);
+        strncpy(res->path, req->path, SFP_PATH_CAP);
+        res->path_len = SFP_ERR_PERMISSION;
+        return;
+    }
+    copy_reply_path(res->path, &p);
+    res->path_len = watch_remove(req->hdr.owner, &p);
+    if (res->path_len < 0) {
+        printf("Servidor: ERRO (UW) Owner %d não assinava %s\n", req->hdr.owner, p.norm);
+        return;
+    }
+    res->path_len = p.len;
+    printf("Servidor: (UW) Owner %d cancelou %s\n", req->hdr.owner, p.norm);
+}
+
+// HELLO: anuncia o que este servidor suporta; quem escolhe o modo é o cliente
+void handle_hl_req(const SfpHello* req, SfpHello* res) {
+    res->hdr.msg_type = SFP_MSG_HL_REP;
+    res->hdr.owner = req->hdr.owner;
+    res->version = SFP_PROTO_VERSION;
+    res->max_payload = SFP_MAX_PAYLOAD;
+    res->max_batch = SFP_MAX_BATCH;
+    res->transports = SFP_TR_LEGACY | SFP_TR_COMPACT;
+    res->features = SFP_FEAT_DEADLINE | SFP_FEAT_LENGTH | SFP_FEAT_BATCH | SFP_FEAT_REQID |
+                    SFP_FEAT_GETATTR | SFP_FEAT_HANDLES | SFP_FEAT_FILEOPS | SFP_FEAT_DLPAGE |
+                    SFP_FEAT_WATCH | SFP_FEAT_CREDITS;
+    printf("Servidor: (HL) Cliente v%d (payload %d, lote %d, formatos 0x%x, recursos 0x%x)\n",
+           req->version, req->max_payload, req->max_batch, req->transports, req->features);
+    handle_drop_client();
+    watch_drop_client();
+    dup_drop_client();
+}
+
+
+// --- Descarte por Prazo (load shedding) ---
+// Requisições cujo prazo (deadline_us) já venceu quando saem da fila do
+// socket não passam pelo handler: recebem SFP_ERR_EXPIRED (ou são
+// descartadas em silêncio com -D). O atraso de fila é medido por sent_us.
+#define SFSS_N_MSG_TYPES SFP_MSG_N_TYPES
+
+static int shed_drop = 0;                          // -D: descarta sem responder
+static unsigned long req_count[SFSS_N_MSG_TYPES];  // Requisições recebidas por tipo
+static unsigned long shed_count[SFSS_N_MSG_TYPES]; // Requisições vencidas por tipo
+static long long qdelay_sum_us = 0, qdelay_max_us = 0;
+static unsigned long qdelay_samples = 0;
+static long long qdelay_last_us = 0;               // Atraso da última requisição medida
+
+// --- Controle de Fluxo por Créditos ---
+// Toda resposta anuncia em hdr.credits quantas requisições o cliente pode
+// manter pendentes. A janela cabe no buffer de recepção do socket (cada
+// datagrama na fila conta como SFSS_CREDIT_COST bytes), ou vem de -C.
+// Enquanto as requisições saem da fila com mais de SFSS_CREDIT_QDELAY_US de
+// atraso, anuncia-se só metade: o cliente segura o excesso do seu lado em
+// vez de o socket descartá-lo.
+#define SFSS_CREDIT_COST 2048
+#define SFSS_CREDIT_QDELAY_US 20000
+#define SFSS_MAX_CREDITS 1024
+
+static int credit_window = 64;       // Ajustada pelo SO_RCVBUF ou por -C
+static unsigned long credit_throttled = 0; // Respostas que anunciaram meia janela
+
+static int current_credits(void) {
+    if (qdelay_last_us <= SFSS_CREDIT_QDELAY_US) return credit_window;
+    credit_throttled++;
+    return credit_window > 1 ? credit_window / 2 : 1;
+}
+
+// Tipo da resposta: o seguinte ao da requisição. Um tipo desconhecido
+// 0xff não tem seguinte no u8 do fio e é ecoado. Uma resposta (ou NT-MSG)
+// mandada ao servidor também é ecoada: o seguinte pode nem ser codificável
+// (DL-REP + 1 = BT-REQ). Os tipos vêm em pares REQ/REP a partir de RD_REQ = 0.
+static SfpMsgType reply_type(SfpMsgType t) {
+    if (t < SFP_MSG_N_TYPES && (t % 2 == 1 || t == SFP_MSG_NT_MSG)) return t;
+    return t < 0xff ? t + 1 : t;
+}
+
+// Resposta SFP_ERR_EXPIRED para 'req', ecoando o path da requisição
+void expired_reply(const SfpMsg* req, SfpMsg* res) {
+    res->hdr.msg_type = reply_type(req->hdr.msg_type);
+    switch (req->hdr.msg_type) {
+        case SFP_MSG_RD_REQ:
+            res->rd_rep.path_len = req->rd_req.path_len;
+            memcpy(res->rd_rep.path, req->rd_req.path, SFP_PATH_CAP);
+            break;
+        case SFP_MSG_WR_REQ:
+        case SFP_MSG_AP_REQ:
+            res->wr_rep.path_len = req->wr_req.path_len;
+            memcpy(res->wr_rep.path, req->wr_req.path, SFP_PATH_CAP);
+            break;
+        case SFP_MSG_TR_REQ:
+            res->tr_rep.path_len = req->tr_req.path_len;
+            memcpy(res->tr_rep.path, req->tr_req.path, SFP_PATH_CAP);
+            break;
+        case SFP_MSG_CP_REQ:
+        case SFP_MSG_RN_REQ:
+            res->cp_rep.path_len = req->cp_req.dst_len;
+            memcpy(res->cp_rep.path, req->cp_req.dst, SFP_PATH_CAP);
+            break;
+        case SFP_MSG_DC_REQ:
+        case SFP_MSG_DR_REQ:
+            memcpy(res->dc_rep.path, req->dc_req.path, SFP_PATH_CAP);
+            break;
+        case SFP_MSG_WA_REQ:
+        case SFP_MSG_UW_REQ:
+            memcpy(res->wa_rep.path, req->wa_req.path, SFP_PATH_CAP);
+            break;
+        default:
+            break;
+    }
+    sfp_set_status(res, SFP_ERR_EXPIRED);
+}
+
+// Mede o atraso de fila e decide se a requisição ainda vale a pena.
+// Retorna 1 se venceu (já contabilizada como descartada).
+int check_deadline(const SfpHdr* req) {
+    long long now = sfp_now_us();
+    int t = req->msg_type < SFSS_N_MSG_TYPES ? (int)req->msg_type : -1;
+    if (t >= 0) req_count[t]++;
+    if (req->sent_us > 0 && now >= req->sent_us) {
+        long long delay = now - req->sent_us;
+        qdelay_sum_us += delay;
+        qdelay_samples++;
+        qdelay_last_us = delay;
+        if (delay > qdelay_max_us) qdelay_max_us = delay;
+    }
+    if (req->deadline_us <= 0 || now <= req->deadline_us) return 0;
+    if (t >= 0) shed_count[t]++;
+    printf("Servidor: (SHED) Msg %d do owner %d venceu há %lld us\n",
+           req->msg_type, req->owner, now - req->deadline_us);
+    return 1;
+}
+
+// --- Despacho ---
+
+// Executa uma requisição simples e monta a resposta em 'res' (já zerada,
+// com owner/req_id/sent_us preenchidos). 'req_data' são os dados grandes de
+// um WR/AP-REQ; 'res_body' recebe o corpo externo da resposta.
+void dispatch(const SfpMsg* req, const char* req_data, SfpMsg* res, SfpBulk* res_body) {
+    switch (req->hdr.msg_type) {
+        case SFP_MSG_RD_REQ:
+            handle_rd_req(&req->rd_req, &res->rd_rep, res_body);
+            break;
+        case SFP_MSG_WR_REQ:
+            handle_wr_req(&req->wr_req, req_data, &res->wr_rep);
+            break;
+        case SFP_MSG_DC_REQ:
+            handle_dc_req(&req->dc_req, &res->dc_rep);
+            break;
+        case SFP_MSG_DR_REQ:
+            handle_dr_req(&req->dr_req, &res->dr_rep);
+            break;
+        case SFP_MSG_DL_REQ:
+            handle_dl_req(&req->dl_req, &res->dl_rep, res_body);
+            break;
+        case SFP_MSG_GA_REQ:
+            handle_ga_req(&req->ga_req, &res->ga_rep);
+            break;
+        case SFP_MSG_OP_REQ:
+            handle_op_req(&req->op_req, &res->op_rep);
+            break;
+        case SFP_MSG_CL_REQ:
+            handle_cl_req(&req->cl_req, &res->cl_rep);
+            break;
+        case SFP_MSG_AP_REQ:
+            handle_ap_req(&req->ap_req, req_data, &res->ap_rep);
+            break;
+        case SFP_MSG_TR_REQ:
+            handle_tr_req(&req->tr_req, &res->tr_rep);
+            break;
+        case SFP_MSG_CP_REQ:
+            handle_cp_req(&req->cp_req, &res->cp_rep);
+            break;
+        case SFP_MSG_RN_REQ:
+            handle_rn_req(&req->rn_req, &res->rn_rep);
+            break;
+        case SFP_MSG_WA_REQ:
+            handle_wa_req(&req->wa_req, &res->wa_rep);
+            break;
+        case SFP_MSG_UW_REQ:
+            handle_uw_req(&req->uw_req, &res->uw_rep);
+            break;
+        case SFP_MSG_HL_REQ:
+            handle_hl_req(&req->hello, &res->hello);
+            break;
+        default:
+            printf("Servidor: Recebeu tipo de msg desconhecido: %d\n", req->hdr.msg_type);
+            // Prepara uma resposta de erro genérico
+            res->hdr.msg_type = reply_type(req->hdr.msg_type); // Resposta genérica
+            sfp_set_status(res, SFP_ERR_UNKNOWN_MSG);
+    }
+}
+
+// --- Lotes (BT-REQ) ---
+// As sub-requisições são agrupadas pela área do path: cada grupo roda em
+// ordem numa thread própria e grupos de áreas diferentes rodam em paralelo.
+// Os handlers já sincronizam índice, cotas e checksums entre si.
+static unsigned long batch_count = 0, batch_items = 0;
+
+typedef struct {
+    const SfpBatch* req;
+    SfpBatch* rep;
+    int n;
+    int idx[SFP_MAX_BATCH]; // Itens do grupo, na ordem do lote
+} SfssBatchGroup;
+
+// Path de uma requisição simples (NULL se o tipo não tem)
+static const char* req_path(const SfpMsg* m) {
+    switch (m->hdr.msg_type) {
+        case SFP_MSG_RD_REQ: return m->rd_req.path;
+        case SFP_MSG_WR_REQ: return m->wr_req.path;
+        case SFP_MSG_DC_REQ: return m->dc_req.path;
+        case SFP_MSG_DR_REQ: return m->dr_req.path;
+        case SFP_MSG_DL_REQ: return m->dl_req.path;
+        case SFP_MSG_GA_REQ: return m->ga_req.path;
+        case SFP_MSG_OP_REQ: return m->op_req.path;
+        case SFP_MSG_AP_REQ: return m->ap_req.path;
+        case SFP_MSG_TR_REQ: return m->tr_req.path;
+        case SFP_MSG_CP_REQ: return m->cp_req.path;
+        case SFP_MSG_RN_REQ: return m->rn_req.path;
+        case SFP_MSG_WA_REQ: return m->wa_req.path;
+        case SFP_MSG_UW_REQ: return m->uw_req.path;
+        default: return NULL;
+    }
+}
+
+// Handle de um RD/WR/AP/TR (0 se o tipo não tem ou usa o path)
+static int req_handle(const SfpMsg* m) {
+    switch (m->hdr.msg_type) {
+        case SFP_MSG_RD_REQ:
+        case SFP_MSG_TR_REQ: return m->rd_req.handle;
+        case SFP_MSG_WR_REQ:
+        case SFP_MSG_AP_REQ: return m->wr_req.handle;
+        default: return 0;
+    }
+}
+
+static void* batch_group_thread(void* arg) {
+    SfssBatchGroup* g = (SfssBatchGroup*)arg;
+    for (int k = 0; k < g->n; k++) {
+        int i = g->idx[k];
+        dispatch(&g->req->items[i], g->req->bodies[i].data, &g->rep->items[i], &g->rep->bodies[i]);
+    }
+    return NULL;
+}
+
+// Executa o lote 'req' e preenche 'rep' (mesma ordem, um status por item)
+void run_batch(const SfpBatch* req, SfpBatch* rep) {
+    SfssBatchGroup groups[SFP_MAX_BATCH];
+    int group_area[SFP_MAX_BATCH];
+    int ngroups = 0, serial = 0;
+    int queued[SFP_MAX_BATCH], nqueued = 0; // Itens não vencidos, na ordem do lote
+
+    rep->count = req->count;
+    batch_count++;
+    batch_items += req->count;
+    for (int i = 0; i < req->count; i++) {
+        const SfpMsg* item = &req->items[i];
+        SfpMsg* out = &rep->items[i];
+        memset(out, 0, sizeof(SfpMsg));
+        out->hdr.owner = item->hdr.owner;
+        out->hdr.req_id = item->hdr.req_id;
+        out->hdr.sent_us = item->hdr.sent_us;
+
+        // Prazo por item: vencidos respondem SFP_ERR_EXPIRED (não há como
+        // descartar só parte do lote)
+        if (check_deadline(&item->hdr)) {
+            expired_reply(item, out);
+            continue;
+        }
+        // Item retransmitido que já foi executado: só repete a resposta
+        const SfpMsg* dup = dup_lookup(&item->hdr);
+        if (dup != NULL) {
+            *out = *dup;
+            out->hdr.sent_us = item->hdr.sent_us;
+            printf("Servidor: (DUP) Req %llu do owner %d repetida; resposta reenviada\n",
+                   item->hdr.req_id, item->hdr.owner);
+            continue;
+        }
+
+        // Área do path (ou do handle); inválidos (o handler recusa) e CLOSE
+        // ficam num grupo próprio
+        int area = -1 - i;
+        const char* path = req_path(item);
+        int handle = req_handle(item);
+        SfssPath p, d;
+        if (handle != 0 ? handle_lookup(item->hdr.owner, handle, &p) == SFP_SUCCESS
+                        : path != NULL && validate_path(item->hdr.owner, path, &p)) area = p.area;
+        // COPY/RENAME entre áreas tocam dois grupos: o lote inteiro vira sequencial
+        if ((item->hdr.msg_type == SFP_MSG_CP_REQ || item->hdr.msg_type == SFP_MSG_RN_REQ) &&
+            area >= 0 && validate_path(item->hdr.owner, item->cp_req.dst, &d) && d.area != area) serial = 1;
+
+        int g = 0;
+        while (g < ngroups && group_area[g] != area) g++;
+        if (g == ngroups) {
+            group_area[ngroups] = area;
+            groups[ngroups].req = req;
+            groups[ngroups].rep = rep;
+            groups[ngroups].n = 0;
+            ngroups++;
+        }
+        groups[g].idx[groups[g].n++] = i;
+        queued[nqueued++] = i;
+    }
+    if (serial && ngroups > 1) {
+        memcpy(groups[0].idx, queued, sizeof(int) * nqueued);
+        groups[0].n = nqueued;
+        ngroups = 1;
+    }
+
+    // O primeiro grupo roda nesta thread; os demais em threads auxiliares
+    pthread_t tids[SFP_MAX_BATCH];
+    int started[SFP_MAX_BATCH] = {0};
+    for (int g = 1; g < ngroups; g++) {
+        started[g] = (pthread_create(&tids[g], NULL, batch_group_thread, &groups[g]) == 0);
+        if (!started[g]) batch_group_thread(&groups[g]);
+    }
+    if (ngroups > 0) batch_group_thread(&groups[0]);
+    for (int g = 1; g < ngroups; g++) {
+        if (started[g]) pthread_join(tids[g], NULL);
+    }
+    for (int k = 0; k < nqueued; k++) dup_store(&rep->items[queued[k]]);
+    printf("Servidor: (BT) Lote de %d itens em %d grupo(s)\n", req->count, ngroups);
+}
+
+// Contadores exportados com SIGUSR1
+void print_stats(void) {
+    static const char* names[] = { "RD", "", "WR", "", "DC", "", "DR", "", "DL", "",
+                                   "", "", "HL", "", "GA", "", "OP", "", "CL", "",
+                                   "AP", "", "TR", "", "CP", "", "RN", "",
+                                   "WA", "", "UW", "", "" }; // Lotes: contados por item
+    printf("================ SFSS STATS =================\n");
+    for (int t = 0; t < SFSS_N_MSG_TYPES; t += 2) {
+        if (names[t][0] == '\0') continue;
+        printf("%s: %lu recebidas, %lu vencidas (%s)\n", names[t], req_count[t], shed_count[t],
+               shed_drop ? "descartadas" : "SFP_ERR_EXPIRED");
+    }
+    printf("Atraso de fila: médio %lld us, máximo %lld us (%lu amostras)\n",
+           qdelay_samples ? qdelay_sum_us / (long long)qdelay_samples : 0, qdelay_max_us, qdelay_samples);
+    printf("Créditos: janela %d, %lu respostas com meia janela (fila lenta)\n", credit_window, credit_throttled);
+    printf("CRC: %lu blocos verificados, %lu divergentes, %lu leituras sem checksum; "
+           "scrub: %lu arquivos, %lu sem sidecar, %lu blocos selados\n",
+           crc_blocks_verified, crc_mismatches, crc_unverified_reads, scrub_files, scrub_no_sidecar, scrub_sealed);
+    printf("Lotes: %lu (%lu sub-requisições)\n", batch_count, batch_items);
+    printf("Handles: %lu abertos, %lu expirados\n", handles_opened, handles_expired);
+    printf("Retransmissões: %lu requisições repetidas respondidas sem reexecutar\n", dup_hits);
+    printf("Assinaturas: %d ativas, %lu NT-MSGs enviados (%lu mudanças agrupadas)\n",
+           watch_count, notify_sent, notify_changes);
+    printf("Índice: %d entradas\n", index_count);
+    SfpCodecCounters cc;
+    sfp_codec_counters(&cc);
+    printf("Codec: %llu cópias (%llu bytes), %llu datagramas lidos sem cópia, %llu envios em 2 iovecs\n",
+           cc.copies, cc.bytes_copied, cc.views, cc.scatter_sends);
+    printf("=============================================\n");
+    fflush(stdout);
+}
+
+// --- Processamento de um datagrama ---
+// Buffers reutilizados entre datagramas (o laço principal é sequencial)
+static SfpMsg recv_msg, send_msg;
+static SfpBulk recv_body;  // Corpo de um item fora do caminho sem cópia (layout legado)
+static SfpBulk send_body;  // Dados de um RD-REP grande ou listagem do DL-REP
+static SfpView view;       // RD/WR/AP/TR lidos direto do datagrama
+static SfpBatch recv_batch, send_batch;
+static unsigned char send_buf[BUFFER_SIZE];
+
+void sfss_setup(const char* root, const char* index_file) {
+    SFSS_ROOT_DIR = root;
+    sfss_root_len = strlen(SFSS_ROOT_DIR);
+    init_owner_table();
+    printf("Servidor SFSS iniciando. Raiz: %s\n", SFSS_ROOT_DIR);
+
+    // Aquecimento: índice montado antes do bind, para que as primeiras
+    // requisições já encontrem os metadados em memória
+    build_index(index_file);
+    seed_quota_from_index();
+    init_crc32c();
+}
+
+int sfss_serve_datagram(const unsigned char* buf, size_t n, struct iovec iov[2]) {
+    SfpWireMode wire_mode; // A resposta segue o formato da requisição
+
+    // RD/WR/AP/TR: valida no próprio buffer; os dados de um WR/AP grande
+    // são lidos de lá pelo handler, sem passar por recv_body
+    const char* req_data = recv_body.data;
+    int drc = 0;
+    int vrc = sfp_view(buf, n, &view);
+    if (vrc == 0) {
+        sfp_view_to_msg(&view, &recv_msg);
+        wire_mode = SFP_WIRE_COMPACT;
+        if (view.data != NULL) req_data = (const char*)view.data;
+    } else if (vrc < 0 || (drc = sfp_decode(buf, n, &recv_msg, &recv_body, &wire_mode)) != 0) {
+        // Path legado que não cabe nos campos: responde com erro em vez de
+        // deixar o cliente retransmitir até desistir
+        if (drc != SFP_DECODE_LONG_PATH) {
+            printf("Servidor: Datagrama malformado (%zu bytes) descartado\n", n);
+            return 0;
+        }
+    }
+
+    memset(&send_msg, 0, sizeof(send_msg));
+    send_msg.hdr.owner = recv_msg.hdr.owner;
+    send_msg.hdr.req_id = recv_msg.hdr.req_id; // Ecoado: casa resposta e requisição
+    send_msg.hdr.sent_us = recv_msg.hdr.sent_us; // Ecoado: o cliente mede o RTT
+
+    // Um BT-REP não é pedido e não tem forma de mensagem simples para a resposta
+    if (recv_msg.hdr.msg_type == SFP_MSG_BT_REP) {
+        printf("Servidor: BT-REP recebido (%zu bytes) descartado\n", n);
+        return 0;
+    }
+
+    // Lote: cada item tem prazo e status próprios
+    if (recv_msg.hdr.msg_type == SFP_MSG_BT_REQ) {
+        if (wire_mode != SFP_WIRE_COMPACT ||
+            sfp_decode_batch(buf, n, &recv_msg, &recv_batch) != 0) {
+            printf("Servidor: Lote malformado (%zu bytes) descartado\n", n);
+            return 0;
+        }
+        run_batch(&recv_batch, &send_batch);
+        send_msg.hdr.msg_type = SFP_MSG_BT_REP;
+        send_msg.hdr.credits = current_credits();
+        int len = sfp_encode_batch(&send_msg, &send_batch, send_buf, sizeof(send_buf));
+        if (len < 0) {
+            printf("Servidor: ERRO ao codificar resposta do lote\n");
+            return -1;
+        }
+        iov[0].iov_base = send_buf;
+        iov[0].iov_len = (size_t)len;
+        return 1;
+    }
+
+    // Prazo vencido: responde (ou descarta) sem executar o handler.
+    // Retransmissão já executada: repete a resposta guardada.
+    const SfpMsg* dup;
+    if (drc == SFP_DECODE_LONG_PATH) {
+        printf("Servidor: ERRO Path longo demais (msg %d do owner %d)\n", recv_msg.hdr.msg_type, recv_msg.hdr.owner);
+        send_msg.hdr.msg_type = reply_type(recv_msg.hdr.msg_type);
+        sfp_set_status(&send_msg, SFP_ERR_PATH);
+    } else if (check_deadline(&recv_msg.hdr)) {
+        if (shed_drop) return 0;
+        expired_reply(&recv_msg, &send_msg);
+    } else if ((dup = dup_lookup(&recv_msg.hdr)) != NULL) {
+        send_msg = *dup;
+        send_msg.hdr.sent_us = recv_msg.hdr.sent_us;
+        printf("Servidor: (DUP) Req %llu do owner %d repetida; resposta reenviada\n",
+               recv_msg.hdr.req_id, recv_msg.hdr.owner);
+    } else {
+        dispatch(&recv_msg, req_data, &send_msg, &send_body);
+        dup_store(&send_msg);
+    }
+    send_msg.hdr.credits = current_credits();
+
+    // Os dados grandes de um RD-REP saem direto de send_body, sem serem
+    // montados em send_buf
+    int niov = sfp_encode_iov(&send_msg, &send_body, wire_mode, send_buf, sizeof(send_buf), iov);
+    if (niov < 0) {
+        printf("Servidor: ERRO ao codificar resposta (msg %d)\n", send_msg.hdr.msg_type);
+        return -1;
+    }
+    return niov;
+}
+
+int sfss_next_notify(long long now_us, unsigned char* buf, size_t cap, struct sockaddr_in* to, int* wait_ms) {
+    SfpMsg nt;
+    while (notify_next(now_us, &nt, to, wait_ms)) {
+        int len = sfp_encode(&nt, NULL, SFP_WIRE_COMPACT, buf, cap);
+        if (len > 0) return len;
+    }
+    return 0;
 }
 
+#ifndef SFSS_NO_MAIN // O harness de fuzzing (sfss_fuzz.c) traz o próprio main
+
+// Pedido de encerramento (SIGINT/SIGTERM): salva o índice antes de sair
+static volatile sig_atomic_t want_shutdown = 0;
+static volatile sig_atomic_t want_stats = 0;
+static void h_shutdown(int s) { (void)s; want_shutdown = 1; }
+static void h_stats(int s)    { (void)s; want_stats = 1; }
 
 int main(int argc, char *argv[]) {
-    if (argc < 2) {
-        fprintf(stderr, "Uso: %s <SFSS-root-dir>\n", argv[0]);
+    // Opções:
+    //   -i <arquivo>  persiste o índice de metadados (reinícios mais rápidos)
+    //   -V            desliga a verificação de checksums no RD
+    //   -S <s>        intervalo do scrubber de checksums (0 desliga)
+    //   -q <bytes>    cota de bytes por área /A<n> (0 = sem limite)
+    //   -Q <inodes>   cota de arquivos+diretórios por área (0 = sem limite)
+    //   -D            descarta em silêncio requisições com prazo vencido
+    //   -N <ms>       intervalo mínimo entre NT-MSGs de uma assinatura
+    //   -C <n>        créditos anunciados (0 = calculados pelo SO_RCVBUF)
+    const char* usage = "Uso: %s [-i arquivo-indice] [-V] [-S segundos] [-q bytes] [-Q inodes] [-D] [-N ms] [-C n] <SFSS-root-dir>\n";
+    const char* index_file = NULL;
+    int credit_opt = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "i:VS:q:Q:DN:C:")) != -1) {
+        switch (opt) {
+            case 'i':
+                index_file = optarg;
+                break;
+            case 'V':
+                crc_verify_on_read = 0;
+                break;
+            case 'S':
+                scrub_interval_s = atoi(optarg);
+                break;
+            case 'q':
+                quota_bytes = atoll(optarg);
+                break;
+            case 'Q':
+                quota_inodes = atol(optarg);
+                break;
+            case 'D':
+                shed_drop = 1;
+                break;
+            case 'N':
+                notify_interval_ms = atoi(optarg);
+                if (notify_interval_ms < 0) notify_interval_ms = 0;
+                break;
+            case 'C':
+                credit_opt = atoi(optarg);
+                if (credit_opt < 0) credit_opt = 0;
+                if (credit_opt > SFSS_MAX_CREDITS) credit_opt = SFSS_MAX_CREDITS;
+                break;
+            default:
+                fprintf(stderr, usage, argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+    if (optind >= argc) {
+        fprintf(stderr, usage, argv[0]);
         exit(EXIT_FAILURE);
     }
-    SFSS_ROOT_DIR = argv[1];
-    printf("Servidor SFSS iniciando. Raiz: %s\n", SFSS_ROOT_DIR);
+    sfss_setup(argv[optind], index_file);
+    start_scrubber();
+
+    // Sem SA_RESTART: o recvfrom retorna EINTR e o laço pode encerrar
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = h_shutdown;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sa.sa_handler = h_stats;
+    sigaction(SIGUSR1, &sa, NULL);
 
     int sockfd;
     struct sockaddr_in server_addr, client_addr;
     socklen_t client_len = sizeof(client_addr);
-    SfpMessage recv_msg;
-    SfpMessage send_msg;
+    static unsigned char recv_buf[BUFFER_SIZE], notify_buf[BUFFER_SIZE];
+    struct iovec iov[2];
 
     if ((sockfd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
         perror("Erro ao criar socket");
@@ -348,49 +2801,62 @@ int main(int argc, char *argv[]) {
         exit(EXIT_FAILURE);
     }
 
-    printf("Servidor SFSS aguardando na porta %d...\n", SERVER_PORT);
+    // Janela de créditos: quantos datagramas cabem na fila do socket
+    int rcvbuf = 0;
+    socklen_t optlen = sizeof(rcvbuf);
+    if (credit_opt > 0) {
+        credit_window = credit_opt;
+    } else if (getsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, &optlen) == 0 && rcvbuf > 0) {
+        credit_window = rcvbuf / SFSS_CREDIT_COST;
+        if (credit_window < 1) credit_window = 1;
+        if (credit_window > SFSS_MAX_CREDITS) credit_window = SFSS_MAX_CREDITS;
+    }
+
+    printf("Servidor SFSS aguardando na porta %d (%d créditos por cliente)...\n", SERVER_PORT, credit_window);
 
-    while (1) {
-        if (recvfrom(sockfd, &recv_msg, BUFFER_SIZE, 0,
-                     (struct sockaddr*)&client_addr, &client_len) < 0) {
-            perror("Erro no recvfrom");
+    while (!want_shutdown) {
+        if (want_stats) {
+            want_stats = 0;
+            print_stats();
+        }
+        // NOTIFYs vencidos saem antes de esperar o próximo datagrama; com
+        // algum pendente, a espera termina quando ele vencer
+        struct sockaddr_in nt_addr;
+        int wait_ms, nt_len;
+        while ((nt_len = sfss_next_notify(sfp_now_us(), notify_buf, sizeof(notify_buf), &nt_addr, &wait_ms)) > 0) {
+            if (sendto(sockfd, notify_buf, nt_len, 0, (struct sockaddr*)&nt_addr, sizeof(nt_addr)) < 0) {
+                perror("Erro no sendto (NT)");
+            }
+        }
+        struct pollfd pfd = { sockfd, POLLIN, 0 };
+        int ready = poll(&pfd, 1, wait_ms);
+        if (ready <= 0) {
+            if (ready < 0 && errno != EINTR) perror("Erro no poll");
             continue;
         }
-
-        memset(&send_msg, 0, BUFFER_SIZE);
-        send_msg.owner = recv_msg.owner;
-
-        // 5. Processa a Requisição
-        switch (recv_msg.msg_type) {
-            case SFP_MSG_RD_REQ:
-                handle_rd_req(&recv_msg, &send_msg);
-                break;
-            case SFP_MSG_WR_REQ:
-                handle_wr_req(&recv_msg, &send_msg);
-                break;
-            case SFP_MSG_DC_REQ:
-                handle_dc_req(&recv_msg, &send_msg);
-                break;
-            case SFP_MSG_DR_REQ:
-                handle_dr_req(&recv_msg, &send_msg);
-                break;
-            case SFP_MSG_DL_REQ:
-                handle_dl_req(&recv_msg, &send_msg);
-                break;
-            default:
-                printf("Servidor: Recebeu tipo de msg desconhecido: %d\n", recv_msg.msg_type);
-                // Prepara uma resposta de erro genérico
-                send_msg.msg_type = recv_msg.msg_type + 1; // Resposta genérica
-                send_msg.owner = recv_msg.owner;
-                send_msg.path_len = SFP_ERR_UNKNOWN_MSG;
+        client_len = sizeof(client_addr);
+        ssize_t n = recvfrom(sockfd, recv_buf, BUFFER_SIZE, 0,
+                             (struct sockaddr*)&client_addr, &client_len);
+        if (n < 0) {
+            if (errno != EINTR) perror("Erro no recvfrom");
+            continue;
         }
+        cur_client = client_addr; // Handles pertencem a quem os abriu
 
-        if (sendto(sockfd, &send_msg, BUFFER_SIZE, 0,
-                   (struct sockaddr*)&client_addr, client_len) < 0) {
-            perror("Erro no sendto");
-        }
+        int niov = sfss_serve_datagram(recv_buf, (size_t)n, iov);
+        if (niov <= 0) continue;
+        struct msghdr mh;
+        memset(&mh, 0, sizeof(mh));
+        mh.msg_name = &client_addr;
+        mh.msg_namelen = client_len;
+        mh.msg_iov = iov;
+        mh.msg_iovlen = (size_t)niov;
+        if (sendmsg(sockfd, &mh, 0) < 0) perror("Erro no sendmsg");
     }
 
+    printf("Servidor SFSS encerrando.\n");
+    if (index_file != NULL) index_save(index_file);
     close(sockfd);
     return 0;
-}
\ No newline at end of file
+}
+#endif // SFSS_NO_MAIN
@@ -0,0 +1,28 @@
+#ifndef SFSS_SERVER_H
+#define SFSS_SERVER_H
+
+#include <stddef.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+
+// --- Entrada do SFSS sem o socket ---
+// Usada pelo laço principal do servidor e pelo harness de fuzzing
+// (sfss_fuzz.c, compilado com -DSFSS_NO_MAIN).
+
+// Aponta o servidor para 'root' e monta o índice (persistido em
+// 'index_file' se não for NULL). Não inicia o scrubber.
+void sfss_setup(const char* root, const char* index_file);
+
+// Processa um datagrama recebido como o laço principal: decodifica,
+// despacha (ou executa o lote) e codifica a resposta. A resposta fica em
+// 'iov', apontando para buffers internos válidos até a próxima chamada.
+// Retorna o número de iovecs (0 = nada a enviar; -1 = o handler produziu
+// uma resposta que não pôde ser codificada, um bug do servidor).
+int sfss_serve_datagram(const unsigned char* buf, size_t len, struct iovec iov[2]);
+
+// Próximo NT-MSG (WATCH) que já pode sair no instante 'now_us': codifica em
+// 'buf', põe o destino em 'to' e retorna o tamanho, ou 0 se nenhum está
+// pronto. 'wait_ms' recebe quanto falta para o próximo (-1 = nenhum pendente).
+int sfss_next_notify(long long now_us, unsigned char* buf, size_t cap, struct sockaddr_in* to, int* wait_ms);
+
+#endif // SFSS_SERVER_H